@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 // Original Author: Andrej Karpathy
 // https://github.com/karpathy/llm.c
 
@@ -18,6 +19,7 @@
 
 #include "thread.h"
 #include "thread-sync.h"
+#include "gpt.h"
 
 // ----------------------------------------------------------------------------
 // all the individual layers' forward passes
@@ -92,6 +94,40 @@ void layernorm_forward(float* out, float* mean, float* rstd,
     }
 }
 
+// With fewer rows than this (decoding is one row per sequence), each row
+// is also split into tiles of MATMUL_TILE output channels, so a single
+// token still keeps all of the pool busy.
+#define MATMUL_MIN_ROWS 64
+#define MATMUL_TILE     64
+
+struct matmul_args {
+    float *out, *inp, *weight, *bias;
+    int C, OC;
+    int tile, ntiles;  // output channels per tile, tiles per row
+};
+
+// tiles [begin, end) of out: tile k holds channels
+// [(k % ntiles) * tile, + tile) of row k / ntiles
+static void matmul_tiles(void *ctx, long begin, long end) {
+    struct matmul_args *a = ctx;
+    int C = a->C, OC = a->OC;
+    for (long k = begin; k < end; k++) {
+        long bt = k / a->ntiles;
+        int o0 = (k % a->ntiles) * a->tile;
+        int o1 = o0 + a->tile < OC ? o0 + a->tile : OC;
+        float* out_bt = a->out + bt * OC;
+        float* inp_bt = a->inp + bt * C;
+        for (int o = o0; o < o1; o++) {
+            float val = (a->bias != NULL) ? a->bias[o] : 0.0f;
+            float* wrow = a->weight + o*C;
+            for (int i = 0; i < C; i++) {
+                val += inp_bt[i] * wrow[i];
+            }
+            out_bt[o] = val;
+        }
+    }
+}
+
 void matmul_forward(float* out,
                     float* inp, float* weight, float* bias,
                     int B, int T, int C, int OC) {
@@ -99,21 +135,15 @@ void matmul_forward(float* out,
     // OC is short for "output channels"
     // inp is (B,T,C), weight is (OC, C), bias is (OC)
     // out will be (B,T,OC)
-    #pragma omp parallel for num_threads(4) collapse(2)
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            float* out_bt = out + b * T * OC + t * OC;
-            float* inp_bt = inp + b * T * C + t * C;
-            for (int o = 0; o < OC; o++) {
-                float val = (bias != NULL) ? bias[o] : 0.0f;
-                float* wrow = weight + o*C;
-                for (int i = 0; i < C; i++) {
-                    val += inp_bt[i] * wrow[i];
-                }
-                out_bt[o] = val;
-            }
-        }
+    // rows are independent, and so are the channels of a row: split them
+    // among the thread pool
+    long rows = (long)B * T;
+    struct matmul_args args = { out, inp, weight, bias, C, OC, OC, 1 };
+    if (rows < MATMUL_MIN_ROWS && OC > MATMUL_TILE) {
+        args.tile = MATMUL_TILE;
+        args.ntiles = (OC + MATMUL_TILE - 1) / MATMUL_TILE;
     }
+    parallel_for(0, rows * args.ntiles, 1, matmul_tiles, &args);
 }
 
 void attention_forward(float* out, float* preatt, float* att,
@@ -191,6 +221,220 @@ void attention_forward(float* out, float* preatt, float* att,
     }
 }
 
+// ----------------------------------------------------------------------------
+// paged KV cache (see gpt.h)
+
+int kv_pool_init(KVPool* kv, int L, int NH, int C, int dtype, int num_blocks) {
+    kv->num_layers = L;
+    kv->num_heads = NH;
+    kv->channels = C;
+    kv->dtype = dtype;
+    kv->num_blocks = num_blocks;
+    switch (dtype) {
+        case KV_F32: kv->row_size = C * sizeof(float); break;
+        case KV_F16: kv->row_size = C * sizeof(_Float16); break;
+        // the scales stay aligned
+        default: kv->row_size = (C + 3) / 4 * 4 + NH * sizeof(float); break;
+    }
+    kv->block_size = (size_t)L * 2 * KV_BLOCK_TOKENS * kv->row_size;
+    // pages are only touched once a block is used
+    kv->memory = (char*)malloc(num_blocks * kv->block_size);
+    kv->free_blocks = (int*)malloc(num_blocks * sizeof(int));
+    if (kv->memory == NULL || kv->free_blocks == NULL) {
+        kv_pool_free(kv);
+        return -1;
+    }
+    // hand out low block ids first
+    for (int i = 0; i < num_blocks; i++) {
+        kv->free_blocks[i] = num_blocks - 1 - i;
+    }
+    kv->num_free = num_blocks;
+    mutex_init(&kv->lock);
+    return 0;
+}
+
+void kv_pool_free(KVPool* kv) {
+    free(kv->memory);
+    free(kv->free_blocks);
+    kv->memory = NULL;
+    kv->free_blocks = NULL;
+    kv->num_blocks = kv->num_free = 0;
+}
+
+void kv_seq_init(KVSeq* seq) {
+    *seq = (KVSeq) { 0 };
+}
+
+// make room for len positions; -1 if the pool is out of blocks
+// (the sequence keeps what it had)
+int kv_seq_reserve(KVPool* kv, KVSeq* seq, int len) {
+    int need = (len + KV_BLOCK_TOKENS - 1) / KV_BLOCK_TOKENS;
+    if (need <= seq->num_blocks) {
+        return 0;
+    }
+    if (need > seq->max_blocks) {
+        int max_blocks = seq->max_blocks ? seq->max_blocks : 4;
+        while (max_blocks < need) { max_blocks *= 2; }
+        int* table = (int*)realloc(seq->block_table, max_blocks * sizeof(int));
+        if (table == NULL) { return -1; }
+        seq->block_table = table;
+        seq->max_blocks = max_blocks;
+    }
+    mutex_lock(&kv->lock);
+    int ok = kv->num_free >= need - seq->num_blocks;
+    while (ok && seq->num_blocks < need) {
+        seq->block_table[seq->num_blocks++] = kv->free_blocks[--kv->num_free];
+    }
+    mutex_unlock(&kv->lock);
+    return ok ? 0 : -1;
+}
+
+// the sequence is done: its blocks go straight back to the pool
+void kv_seq_release(KVPool* kv, KVSeq* seq) {
+    mutex_lock(&kv->lock);
+    for (int i = 0; i < seq->num_blocks; i++) {
+        kv->free_blocks[kv->num_free++] = seq->block_table[i];
+    }
+    mutex_unlock(&kv->lock);
+    free(seq->block_table);
+    kv_seq_init(seq);
+}
+
+// store the C values of x in a cache row
+static void kv_store(KVPool* kv, char* row, float* x) {
+    int C = kv->channels, NH = kv->num_heads, hs = C / NH;
+    if (kv->dtype == KV_F32) {
+        memcpy(row, x, C * sizeof(float));
+    } else if (kv->dtype == KV_F16) {
+        _Float16* h = (_Float16*)row;
+        for (int i = 0; i < C; i++) { h[i] = (_Float16)x[i]; }
+    } else {
+        // symmetric, per head: the largest magnitude maps to 127
+        signed char* q = (signed char*)row;
+        float* scales = (float*)(row + (C + 3) / 4 * 4);
+        for (int h = 0; h < NH; h++) {
+            float* x_h = x + h * hs;
+            float amax = 0.0f;
+            for (int i = 0; i < hs; i++) { amax = fmaxf(amax, fabsf(x_h[i])); }
+            float inv = amax > 0.0f ? 127.0f / amax : 0.0f;
+            for (int i = 0; i < hs; i++) { q[h * hs + i] = (signed char)lrintf(x_h[i] * inv); }
+            scales[h] = amax / 127.0f;
+        }
+    }
+}
+
+// (query of head h) dot (head h of the key row)
+static inline float kv_dot(KVPool* kv, char* row, int h, int hs, float* query) {
+    float val = 0.0f;
+    if (kv->dtype == KV_F32) {
+        float* k = (float*)row + h * hs;
+        for (int i = 0; i < hs; i++) { val += query[i] * k[i]; }
+    } else if (kv->dtype == KV_F16) {
+        _Float16* k = (_Float16*)row + h * hs;
+        for (int i = 0; i < hs; i++) { val += query[i] * (float)k[i]; }
+    } else {
+        signed char* k = (signed char*)row + h * hs;
+        for (int i = 0; i < hs; i++) { val += query[i] * k[i]; }
+        val *= ((float*)(row + (kv->channels + 3) / 4 * 4))[h];
+    }
+    return val;
+}
+
+// out += a * (head h of the value row)
+static inline void kv_axpy(KVPool* kv, char* row, int h, int hs, float a, float* out) {
+    if (kv->dtype == KV_F32) {
+        float* v = (float*)row + h * hs;
+        for (int i = 0; i < hs; i++) { out[i] += a * v[i]; }
+    } else if (kv->dtype == KV_F16) {
+        _Float16* v = (_Float16*)row + h * hs;
+        for (int i = 0; i < hs; i++) { out[i] += a * (float)v[i]; }
+    } else {
+        signed char* v = (signed char*)row + h * hs;
+        a *= ((float*)(row + (kv->channels + 3) / 4 * 4))[h];
+        for (int i = 0; i < hs; i++) { out[i] += a * v[i]; }
+    }
+}
+
+struct attention_args {
+    float *out, *inp;
+    KVPool* kv;
+    KVSeq** seqs;
+    int l, T, C, NH;
+    float scale;
+};
+
+// (b, t, h) triples [begin, end) of attention_forward_paged, flattened
+static void attention_heads(void *ctx, long begin, long end) {
+    struct attention_args *a = ctx;
+    KVPool* kv = a->kv;
+    int l = a->l, T = a->T, C = a->C, NH = a->NH;
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    for (long bth = begin; bth < end; bth++) {
+        int b = bth / (T * NH), t = bth / NH % T, h = bth % NH;
+        KVSeq* seq = a->seqs[b];
+        int pos = seq->len + t;
+        float* query_t = a->inp + b * T * C3 + t * C3 + h * hs;
+        float att[pos + 1];
+
+        // pass 1: calculate query dot key and maxval
+        float maxval = -10000.0f; // TODO something better
+        for (int t2 = 0; t2 <= pos; t2++) {
+            float val = kv_dot(kv, kv_key(kv, seq, l, t2), h, hs, query_t);
+            val *= a->scale;
+            if (val > maxval) {
+                maxval = val;
+            }
+            att[t2] = val;
+        }
+
+        // pass 2: calculate the exp and keep track of sum
+        float expsum = 0.0f;
+        for (int t2 = 0; t2 <= pos; t2++) {
+            float expv = expf(att[t2] - maxval);
+            expsum += expv;
+            att[t2] = expv;
+        }
+        float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+
+        // pass 3: normalize to get the softmax
+        for (int t2 = 0; t2 <= pos; t2++) {
+            att[t2] *= expsum_inv;
+        }
+
+        // pass 4: accumulate weighted values into the output of attention
+        float* out_bth = a->out + b * T * C + t * C + h * hs;
+        for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
+        for (int t2 = 0; t2 <= pos; t2++) {
+            kv_axpy(kv, kv_value(kv, seq, l, t2), h, hs, att[t2], out_bth);
+        }
+    }
+}
+
+void attention_forward_paged(float* out, float* inp, KVPool* kv, KVSeq** seqs, int l,
+                             int B, int T, int C, int NH) {
+    // as attention_forward, for T new tokens of each of the B sequences:
+    // inp is (B, T, 3C) holding their Q, K, V; the new K, V are appended
+    // to the cache of layer l, and each query attends to all cached
+    // positions up to its own, through the block table, dequantizing
+    // the rows as it reads them
+    // output is (B, T, C)
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.0 / sqrtf(hs);
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* qkv_bt = inp + b * T * C3 + t * C3;
+            int pos = seqs[b]->len + t;
+            kv_store(kv, kv_key(kv, seqs[b], l, pos), qkv_bt + C);
+            kv_store(kv, kv_value(kv, seqs[b], l, pos), qkv_bt + C*2);
+        }
+    }
+    // every (b, t, h) only reads the cache and writes its own head of out
+    struct attention_args args = { out, inp, kv, seqs, l, T, C, NH, scale };
+    parallel_for(0, (long)B * T * NH, 1, attention_heads, &args);
+}
+
 #define GELU_SCALING_FACTOR sqrtf(2.0f / M_PI)
 void gelu_forward(float* out, float* inp, int N) {
     // (approximate) GeLU elementwise non-linearity in the MLP block of Transformer
@@ -239,28 +483,7 @@ void softmax_forward(float* probs, float* logits, int B, int T, int V) {
 }
 
 // ----------------------------------------------------------------------------
-// GPT-2 model definition
-
-// the parameters of the model
-#define NUM_PARAMETER_TENSORS 16
-typedef struct {
-    float* wte; // (V, C)
-    float* wpe; // (maxT, C)
-    float* ln1w; // (L, C)
-    float* ln1b; // (L, C)
-    float* qkvw; // (L, 3*C, C)
-    float* qkvb; // (L, 3*C)
-    float* attprojw; // (L, C, C)
-    float* attprojb; // (L, C)
-    float* ln2w; // (L, C)
-    float* ln2b; // (L, C)
-    float* fcw; // (L, 4*C, C)
-    float* fcb; // (L, 4*C)
-    float* fcprojw; // (L, C, 4*C)
-    float* fcprojb; // (L, C)
-    float* lnfw; // (C)
-    float* lnfb; // (C)
-} ParameterTensors;
+// GPT-2 model (the types are in gpt.h)
 
 // allocate memory for the parameters and point the individual tensors to the right places
 float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes) {
@@ -284,33 +507,6 @@ float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes
     return params_memory;
 }
 
-#define NUM_ACTIVATION_TENSORS 23
-typedef struct {
-    float* encoded; // (B, T, C)
-    float* ln1; // (L, B, T, C)
-    float* ln1_mean; // (L, B, T)
-    float* ln1_rstd; // (L, B, T)
-    float* qkv; // (L, B, T, 3*C)
-    float* atty; // (L, B, T, C)
-    float* preatt; // (L, B, NH, T, T)
-    float* att; // (L, B, NH, T, T)
-    float* attproj; // (L, B, T, C)
-    float* residual2; // (L, B, T, C)
-    float* ln2; // (L, B, T, C)
-    float* ln2_mean; // (L, B, T)
-    float* ln2_rstd; // (L, B, T)
-    float* fch; // (L, B, T, 4*C)
-    float* fch_gelu; // (L, B, T, 4*C)
-    float* fcproj; // (L, B, T, C)
-    float* residual3; // (L, B, T, C)
-    float* lnf; // (B, T, C)
-    float* lnf_mean; // (B, T)
-    float* lnf_rstd; // (B, T)
-    float* logits; // (B, T, V)
-    float* probs; // (B, T, V)
-    float* losses; // (B, T)
-} ActivationTensors;
-
 float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes) {
     size_t num_activations = 0;
     for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
@@ -331,43 +527,6 @@ float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes)
     return acts_memory;
 }
 
-typedef struct {
-    int max_seq_len; // max sequence length, e.g. 1024
-    int vocab_size; // vocab size, e.g. 50257
-    int num_layers; // number of layers, e.g. 12
-    int num_heads; // number of heads in attention, e.g. 12
-    int channels; // number of channels, e.g. 768
-} GPT2Config;
-
-typedef struct {
-    GPT2Config config;
-    // the weights (parameters) of the model, and their sizes
-    ParameterTensors params;
-    size_t param_sizes[NUM_PARAMETER_TENSORS];
-    float* params_memory;
-    int num_parameters;
-    // gradients of the weights
-    ParameterTensors grads;
-    float* grads_memory;
-    // buffers for the AdamW optimizer
-    float* m_memory;
-    float* v_memory;
-    // the activations of the model, and their sizes
-    ActivationTensors acts;
-    size_t act_sizes[NUM_ACTIVATION_TENSORS];
-    float* acts_memory;
-    int num_activations;
-    // gradients of the activations
-    ActivationTensors grads_acts;
-    float* grads_acts_memory;
-    // other run state configuration
-    int batch_size; // the batch size (B) of current forward pass
-    int seq_len; // the sequence length (T) of current forward pass
-    int* inputs; // the input tokens for the current forward pass
-    int* targets; // the target tokens for the current forward pass
-    float mean_loss; // after a forward pass with targets, will be populated with the mean loss
-} GPT2;
-
 void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
 
     // read in model from a checkpoint file
@@ -429,13 +588,20 @@ void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
     model->mean_loss = -1.0f; // -1.0f will designate no loss
 }
 
-void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
+// (re)allocate the activations for a forward pass over (B,T), and cache the inputs
+static void gpt2_prepare_forward(GPT2 *model, int* inputs, int B, int T) {
     // convenience parameters
     int V = model->config.vocab_size;
     int L = model->config.num_layers;
     int NH = model->config.num_heads;
     int C = model->config.channels;
 
+    // the same shape as last time (e.g. decoding step by step): reuse everything
+    if (model->acts_memory && model->batch_size == B && model->seq_len == T) {
+        memcpy(model->inputs, inputs, B * T * sizeof(int));
+        return;
+    }
+
     // record the current B,T as well
     model->batch_size = B;
     model->seq_len = T;
@@ -483,12 +649,21 @@ void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
 
     // cache the inputs/targets
     memcpy(model->inputs, inputs, B * T * sizeof(int));
+}
+
+// the transformer blocks and the head, from acts.encoded; attention reads
+// and extends the KV cache of seqs if kv is given
+static void gpt2_forward_blocks(GPT2 *model, KVPool* kv, KVSeq** seqs, int B, int T) {
+    // convenience parameters
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int NH = model->config.num_heads;
+    int C = model->config.channels;
 
     // forward pass
     ParameterTensors params = model->params; // for brevity
     ActivationTensors acts = model->acts;
     float* residual;
-    encoder_forward(acts.encoded, inputs, params.wte, params.wpe, B, T, C); // encoding goes into residual[0]
     for (int l = 0; l < L; l++) {
 
         residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
@@ -528,7 +703,11 @@ void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
         // now do the forward pass
         layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
         matmul_forward(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, 3*C);
-        attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
+        if (kv) {
+            attention_forward_paged(l_atty, l_qkv, kv, seqs, l, B, T, C, NH);
+        } else {
+            attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
+        }
         matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
         residual_forward(l_residual2, residual, l_attproj, B*T*C);
         layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C);
@@ -543,6 +722,49 @@ void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
     softmax_forward(acts.probs, acts.logits, B, T, V);
 }
 
+void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
+    gpt2_prepare_forward(model, inputs, B, T);
+    ParameterTensors params = model->params;
+    int C = model->config.channels;
+    encoder_forward(model->acts.encoded, inputs, params.wte, params.wpe, B, T, C); // encoding goes into residual[0]
+    gpt2_forward_blocks(model, NULL, NULL, B, T);
+}
+
+// Run T new tokens of each of the B sequences, (B,T) in inputs, attending
+// to what the sequences have cached and appending their keys and values;
+// probs then hold the next-token distributions for the new positions.
+// Prompts are one call with all their tokens; decoding is T = 1, for a
+// batch of sequences of any lengths. Returns -1 if a sequence would grow
+// beyond max_seq_len or the pool is out of blocks.
+int gpt2_forward_cached(GPT2 *model, KVPool* kv, KVSeq** seqs, int* inputs, int B, int T) {
+    int maxT = model->config.max_seq_len;
+    int C = model->config.channels;
+    for (int b = 0; b < B; b++) {
+        if (seqs[b]->len + T > maxT || kv_seq_reserve(kv, seqs[b], seqs[b]->len + T) < 0) {
+            return -1;
+        }
+    }
+    gpt2_prepare_forward(model, inputs, B, T);
+
+    // as encoder_forward, with positions continuing where each sequence is
+    ParameterTensors params = model->params;
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* out_bt = model->acts.encoded + b * T * C + t * C;
+            float* wte_ix = params.wte + inputs[b * T + t] * C;
+            float* wpe_t = params.wpe + (seqs[b]->len + t) * C;
+            for (int i = 0; i < C; i++) {
+                out_bt[i] = wte_ix[i] + wpe_t[i];
+            }
+        }
+    }
+    gpt2_forward_blocks(model, kv, seqs, B, T);
+    for (int b = 0; b < B; b++) {
+        seqs[b]->len += T;
+    }
+    return 0;
+}
+
 void gpt2_zero_grad(GPT2 *model) {
     if(model->grads_memory != NULL) { memset(model->grads_memory, 0, model->num_parameters * sizeof(float)); }
     if(model->grads_acts_memory != NULL) { memset(model->grads_acts_memory, 0, model->num_activations * sizeof(float)); }
@@ -575,9 +797,23 @@ int sample_mult(float* probabilities, int n) {
 // the GPT-2 end-of-text token id
 #define GPT2_EOT 50256
 
+// a model loaded before main(), e.g., once for all tests (.setup_once);
+// main() uses it instead of reading the checkpoint again
+GPT2 gpt2_preloaded;
+int gpt2_is_preloaded = 0;
+
+void gpt2_preload(void) {
+    gpt2_build_from_checkpoint(&gpt2_preloaded, "gpt2_124M.bin");
+    gpt2_is_preloaded = 1;
+}
+
 int main(int argc, char** argv) {
     GPT2 model;
-    gpt2_build_from_checkpoint(&model, "gpt2_124M.bin");
+    if (gpt2_is_preloaded) {
+        model = gpt2_preloaded;
+    } else {
+        gpt2_build_from_checkpoint(&model, "gpt2_124M.bin");
+    }
     const int n = 10;  // Token limit.
 
     if (argc == 1) {
@@ -589,6 +825,11 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
+    // One worker per physical core, each staying on its core.
+    if (pool_.nworkers == 0) {
+        pool_start_pinned(TOPO_COMPACT);
+    }
+
     int tokens[n];
 
     for (int i = 0; i < n; i++) {
@@ -599,16 +840,35 @@ int main(int argc, char** argv) {
         }
     }
 
+    // keys and values of the tokens so far are cached: the prompt is run
+    // once, then each new token on its own
+    KVPool kv;
+    KVSeq seq;
+    KVSeq* seqs[] = { &seq };
+    int V = model.config.vocab_size;
+    if (kv_pool_init(&kv, model.config.num_layers, model.config.num_heads, model.config.channels,
+                     KV_F32, (n + KV_BLOCK_TOKENS - 1) / KV_BLOCK_TOKENS) < 0) {
+        printf("Out of memory.\n");
+        exit(1);
+    }
+    kv_seq_init(&seq);
+    gpt2_forward_cached(&model, &kv, seqs, tokens, 1, argc - 1);
+
     for (int t = argc - 1; t < n; t++) {
-        gpt2_forward(&model, tokens, 1, t);
-        float* probs = model.acts.probs + (t-1) * model.config.vocab_size;
-        int next_token = sample_mult(probs, model.config.vocab_size);
+        float* probs = model.acts.probs + (model.seq_len - 1) * V;
+        int next_token = sample_mult(probs, V);
         tokens[t] = next_token;
 
         printf("%d\n", tokens[t]);
         fflush(stdout);
+
+        if (t + 1 < n) {
+            gpt2_forward_cached(&model, &kv, seqs, &tokens[t], 1, 1);
+        }
     }
 
+    kv_seq_release(&kv, &seq);
+    kv_pool_free(&kv);
     gpt2_free(&model);
 
     return 0;
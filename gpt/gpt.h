@@ -0,0 +1,153 @@
+#pragma once
+
+// GPT-2 model definition, shared by gpt.c and its tests.
+
+#include <stddef.h>
+#include "thread-sync.h"
+
+// the parameters of the model
+#define NUM_PARAMETER_TENSORS 16
+typedef struct {
+    float* wte; // (V, C)
+    float* wpe; // (maxT, C)
+    float* ln1w; // (L, C)
+    float* ln1b; // (L, C)
+    float* qkvw; // (L, 3*C, C)
+    float* qkvb; // (L, 3*C)
+    float* attprojw; // (L, C, C)
+    float* attprojb; // (L, C)
+    float* ln2w; // (L, C)
+    float* ln2b; // (L, C)
+    float* fcw; // (L, 4*C, C)
+    float* fcb; // (L, 4*C)
+    float* fcprojw; // (L, C, 4*C)
+    float* fcprojb; // (L, C)
+    float* lnfw; // (C)
+    float* lnfb; // (C)
+} ParameterTensors;
+
+#define NUM_ACTIVATION_TENSORS 23
+typedef struct {
+    float* encoded; // (B, T, C)
+    float* ln1; // (L, B, T, C)
+    float* ln1_mean; // (L, B, T)
+    float* ln1_rstd; // (L, B, T)
+    float* qkv; // (L, B, T, 3*C)
+    float* atty; // (L, B, T, C)
+    float* preatt; // (L, B, NH, T, T)
+    float* att; // (L, B, NH, T, T)
+    float* attproj; // (L, B, T, C)
+    float* residual2; // (L, B, T, C)
+    float* ln2; // (L, B, T, C)
+    float* ln2_mean; // (L, B, T)
+    float* ln2_rstd; // (L, B, T)
+    float* fch; // (L, B, T, 4*C)
+    float* fch_gelu; // (L, B, T, 4*C)
+    float* fcproj; // (L, B, T, C)
+    float* residual3; // (L, B, T, C)
+    float* lnf; // (B, T, C)
+    float* lnf_mean; // (B, T)
+    float* lnf_rstd; // (B, T)
+    float* logits; // (B, T, V)
+    float* probs; // (B, T, V)
+    float* losses; // (B, T)
+} ActivationTensors;
+
+typedef struct {
+    int max_seq_len; // max sequence length, e.g. 1024
+    int vocab_size; // vocab size, e.g. 50257
+    int num_layers; // number of layers, e.g. 12
+    int num_heads; // number of heads in attention, e.g. 12
+    int channels; // number of channels, e.g. 768
+} GPT2Config;
+
+typedef struct {
+    GPT2Config config;
+    // the weights (parameters) of the model, and their sizes
+    ParameterTensors params;
+    size_t param_sizes[NUM_PARAMETER_TENSORS];
+    float* params_memory;
+    int num_parameters;
+    // gradients of the weights
+    ParameterTensors grads;
+    float* grads_memory;
+    // buffers for the AdamW optimizer
+    float* m_memory;
+    float* v_memory;
+    // the activations of the model, and their sizes
+    ActivationTensors acts;
+    size_t act_sizes[NUM_ACTIVATION_TENSORS];
+    float* acts_memory;
+    int num_activations;
+    // gradients of the activations
+    ActivationTensors grads_acts;
+    float* grads_acts_memory;
+    // other run state configuration
+    int batch_size; // the batch size (B) of current forward pass
+    int seq_len; // the sequence length (T) of current forward pass
+    int* inputs; // the input tokens for the current forward pass
+    int* targets; // the target tokens for the current forward pass
+    float mean_loss; // after a forward pass with targets, will be populated with the mean loss
+} GPT2;
+
+// ----------------------------------------------------------------------------
+// Paged KV cache: the keys and values of all sequences live in fixed-size
+// blocks drawn from one shared pool. Each sequence maps its positions to
+// blocks through a block table, so it holds memory for the tokens it has
+// (rounded up to a block) instead of max_seq_len, and returns it as soon
+// as it is released. A block holds KV_BLOCK_TOKENS positions of every
+// layer: (L, 2, KV_BLOCK_TOKENS) rows, K then V, a row holding the C
+// values of one position.
+//
+// Rows are stored as fp32, fp16, or int8 with one scale per head (about a
+// quarter of the fp32 size); attention dequantizes as it reads them.
+#define KV_BLOCK_TOKENS 16
+
+enum { KV_F32, KV_F16, KV_INT8 };
+
+typedef struct {
+    int num_layers;
+    int num_heads;
+    int channels;
+    int dtype; // KV_F32, KV_F16 or KV_INT8
+    int num_blocks;
+    size_t row_size; // bytes per row (int8: C values, then NH float scales)
+    size_t block_size; // bytes per block
+    char* memory; // (num_blocks, block_size)
+    int* free_blocks; // stack of free block ids
+    int num_free;
+    mutex_t lock; // sequences may come and go from several threads
+} KVPool;
+
+typedef struct {
+    int len; // positions cached so far
+    int num_blocks; // blocks in the table
+    int max_blocks; // capacity of the table
+    int* block_table; // logical block -> block in the pool
+} KVSeq;
+
+int kv_pool_init(KVPool* kv, int L, int NH, int C, int dtype, int num_blocks);
+void kv_pool_free(KVPool* kv);
+void kv_seq_init(KVSeq* seq);
+int kv_seq_reserve(KVPool* kv, KVSeq* seq, int len);
+void kv_seq_release(KVPool* kv, KVSeq* seq);
+
+// key/value rows of layer l at position t of the sequence
+static inline char* kv_key(KVPool* kv, KVSeq* seq, int l, int t) {
+    char* block = kv->memory + seq->block_table[t / KV_BLOCK_TOKENS] * kv->block_size;
+    return block + ((size_t)l * 2 * KV_BLOCK_TOKENS + t % KV_BLOCK_TOKENS) * kv->row_size;
+}
+
+static inline char* kv_value(KVPool* kv, KVSeq* seq, int l, int t) {
+    return kv_key(kv, seq, l, t) + KV_BLOCK_TOKENS * kv->row_size;
+}
+
+// ----------------------------------------------------------------------------
+
+void matmul_forward(float* out, float* inp, float* weight, float* bias,
+                    int B, int T, int C, int OC);
+void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path);
+void gpt2_forward(GPT2 *model, int* inputs, int B, int T);
+int gpt2_forward_cached(GPT2 *model, KVPool* kv, KVSeq** seqs, int* inputs, int B, int T);
+void gpt2_free(GPT2 *model);
+void gpt2_preload(void);
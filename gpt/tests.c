@@ -1,12 +1,1087 @@
+#define _GNU_SOURCE
 #include <testkit.h>
 #include <string.h>
+#include <math.h>
 
-// You may need to change time limit in testkit.h
+#include "gpt.h"
 
-SystemTest(test_inference, ((const char *[]){ "31373", "612", "338", "635", "281", "4998", "3715", "351", "2506" })) {
+// The checkpoint is loaded once, in the fixture; running the model still
+// takes a while.
+
+SystemTest(test_inference, ((const char *[]){ "31373", "612", "338", "635", "281", "4998", "3715", "351", "2506" }),
+           .setup_once = gpt2_preload, .timeout_ms = 30000) {
     tk_assert(result->exit_status == 0, "Must exit 0");
     tk_assert(
         strstr(result->output, "852") != NULL,
         "Must print correct token"
     );
 }
+
+SystemTest(test_no_tokens, ((const char *[]){}), .setup_once = gpt2_preload) {
+    tk_assert(result->exit_status == 1, "Must exit 1");
+    tk_assert(strstr(result->output, "Provide at least one token") != NULL,
+              "Must ask for tokens");
+}
+
+SystemTest(test_too_many_tokens,
+           ((const char *[]){ "1", "2", "3", "4", "5", "6", "7", "8", "9", "10" }),
+           .setup_once = gpt2_preload) {
+    tk_assert(result->exit_status == 1, "Must exit 1");
+}
+
+#define BENCH_T  16
+#define BENCH_C  256
+#define BENCH_OC 256
+
+static float bench_inp[BENCH_T * BENCH_C], bench_weight[BENCH_OC * BENCH_C];
+static float bench_bias[BENCH_OC], bench_out[BENCH_T * BENCH_OC];
+
+static void setup_bench_matmul(void) {
+    for (int i = 0; i < BENCH_T * BENCH_C; i++) bench_inp[i] = (i % 13) / 13.0f - 0.5f;
+    for (int i = 0; i < BENCH_OC * BENCH_C; i++) bench_weight[i] = (i % 7) / 7.0f - 0.5f;
+    for (int i = 0; i < BENCH_OC; i++) bench_bias[i] = i / (float)BENCH_OC;
+}
+
+// Few rows are split into tiles of output channels as well; OC is not a
+// multiple of the tile, so the last one is short.
+UnitTest(test_matmul_forward_tiles) {
+    static float want[BENCH_T * BENCH_OC];
+    int C = BENCH_C, OC = BENCH_OC - 37;
+    setup_bench_matmul();
+    for (int T = 1; T <= BENCH_T; T += BENCH_T - 1) {
+        memset(bench_out, 0, sizeof(bench_out));
+        matmul_forward(bench_out, bench_inp, bench_weight, bench_bias, 1, T, C, OC);
+        for (int t = 0; t < T; t++) {
+            for (int o = 0; o < OC; o++) {
+                float val = bench_bias[o];
+                for (int i = 0; i < C; i++) {
+                    val += bench_inp[t * C + i] * bench_weight[o * C + i];
+                }
+                want[t * OC + o] = val;
+            }
+        }
+        tk_assert(memcmp(bench_out, want, sizeof(float) * T * OC) == 0, "T = %d", T);
+    }
+}
+
+BenchTest(bench_matmul_forward, .init = setup_bench_matmul) {
+    for (long i = 0; i < bench->iters; i++) {
+        matmul_forward(bench_out, bench_inp, bench_weight, bench_bias,
+                       1, BENCH_T, BENCH_C, BENCH_OC);
+        TK_KEEP(bench_out[0]);
+    }
+}
+
+// ======================= Synchronization =======================
+
+#include <pthread.h>
+#include "thread-sync.h"
+
+#define SYNC_THREADS 8
+
+static long counter;
+static spinlock_t spin = SPIN_INIT();
+static mutex_t mutex = MUTEX_INIT();
+static pthread_mutex_t pmutex = PTHREAD_MUTEX_INITIALIZER;
+
+enum { LOCK_SPIN, LOCK_MUTEX, LOCK_PTHREAD };
+
+struct lock_worker {
+    pthread_t thread;
+    int kind;
+    long n;
+};
+
+static void *lock_worker(void *arg) {
+    struct lock_worker *w = arg;
+    for (long i = 0; i < w->n; i++) {
+        switch (w->kind) {
+            case LOCK_SPIN: spin_lock(&spin); counter++; spin_unlock(&spin); break;
+            case LOCK_MUTEX: mutex_lock(&mutex); counter++; mutex_unlock(&mutex); break;
+            case LOCK_PTHREAD: pthread_mutex_lock(&pmutex); counter++; pthread_mutex_unlock(&pmutex); break;
+        }
+    }
+    return NULL;
+}
+
+// Increment counter n times in total from nthreads threads.
+static void count_with_lock(int kind, int nthreads, long n) {
+    struct lock_worker workers[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        workers[i] = (struct lock_worker) {
+            .kind = kind,
+            .n = n / nthreads + (i < n % nthreads),
+        };
+        pthread_create(&workers[i].thread, NULL, lock_worker, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+}
+
+UnitTest(test_locks_count) {
+    count_with_lock(LOCK_SPIN, SYNC_THREADS, 200000);
+    tk_assert(counter == 200000, "spin_lock lost updates: %ld", counter);
+    count_with_lock(LOCK_MUTEX, SYNC_THREADS, 200000);
+    tk_assert(counter == 400000, "mutex_lock lost updates: %ld", counter);
+}
+
+#define QUEUE_SIZE 4
+#define QUEUE_ITEMS 20000
+
+static int queue[QUEUE_SIZE], queue_head, queue_count;
+static long consumed_sum;
+static cond_t queue_cond = COND_INIT();
+static semaphore_t slots, items;
+
+// Bounded buffer with a mutex and a condition variable.
+static void *cond_producer(void *arg) {
+    for (int i = 1; i <= QUEUE_ITEMS; i++) {
+        mutex_lock(&mutex);
+        while (queue_count == QUEUE_SIZE) {
+            cond_wait(&queue_cond, &mutex);
+        }
+        queue[(queue_head + queue_count++) % QUEUE_SIZE] = i;
+        cond_broadcast(&queue_cond);
+        mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+static void *cond_consumer(void *arg) {
+    for (int i = 0; i < QUEUE_ITEMS; i++) {
+        mutex_lock(&mutex);
+        while (queue_count == 0) {
+            cond_wait(&queue_cond, &mutex);
+        }
+        consumed_sum += queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_count--;
+        cond_broadcast(&queue_cond);
+        mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+// Bounded buffer with semaphores (and the mutex for the indices).
+static void *sem_producer(void *arg) {
+    for (int i = 1; i <= QUEUE_ITEMS; i++) {
+        P(&slots);
+        mutex_lock(&mutex);
+        queue[(queue_head + queue_count++) % QUEUE_SIZE] = i;
+        mutex_unlock(&mutex);
+        V(&items);
+    }
+    return NULL;
+}
+
+static void *sem_consumer(void *arg) {
+    for (int i = 0; i < QUEUE_ITEMS; i++) {
+        P(&items);
+        mutex_lock(&mutex);
+        consumed_sum += queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_count--;
+        mutex_unlock(&mutex);
+        V(&slots);
+    }
+    return NULL;
+}
+
+static void run_pairs(void *(*producer)(void *), void *(*consumer)(void *), int pairs) {
+    pthread_t threads[2 * pairs];
+    for (int i = 0; i < pairs; i++) {
+        pthread_create(&threads[2 * i], NULL, producer, NULL);
+        pthread_create(&threads[2 * i + 1], NULL, consumer, NULL);
+    }
+    for (int i = 0; i < 2 * pairs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+UnitTest(test_cond_queue) {
+    run_pairs(cond_producer, cond_consumer, 3);
+    long expected = 3L * QUEUE_ITEMS * (QUEUE_ITEMS + 1) / 2;
+    tk_assert(consumed_sum == expected && queue_count == 0,
+              "consumed %ld, expected %ld", consumed_sum, expected);
+}
+
+UnitTest(test_semaphore_queue) {
+    SEM_INIT(&slots, QUEUE_SIZE);
+    SEM_INIT(&items, 0);
+    run_pairs(sem_producer, sem_consumer, 3);
+    long expected = 3L * QUEUE_ITEMS * (QUEUE_ITEMS + 1) / 2;
+    tk_assert(consumed_sum == expected && queue_count == 0,
+              "consumed %ld, expected %ld", consumed_sum, expected);
+}
+
+// More threads than CPUs: a lock holder may be preempted, and waiters
+// must not burn its CPU time.
+static int oversubscribed_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 && 4 * cpus < 64 ? 4 * cpus : 64;
+}
+
+BenchTest(bench_spin_lock_oversubscribed) {
+    count_with_lock(LOCK_SPIN, oversubscribed_threads(), bench->iters);
+}
+
+BenchTest(bench_mutex_lock_oversubscribed) {
+    count_with_lock(LOCK_MUTEX, oversubscribed_threads(), bench->iters);
+}
+
+BenchTest(bench_pthread_mutex_oversubscribed) {
+    count_with_lock(LOCK_PTHREAD, oversubscribed_threads(), bench->iters);
+}
+
+// ========================= Thread pool =========================
+
+#include "thread.h"
+
+#define PFOR_N 100003
+
+static unsigned char visits[PFOR_N];
+static long pfor_calls;
+
+static void mark_range(void *ctx, long begin, long end) {
+    long grain = *(long *)ctx;
+    tk_assert(end - begin <= grain, "range [%ld, %ld) exceeds grain %ld", begin, end, grain);
+    for (long i = begin; i < end; i++) {
+        __atomic_fetch_add(&visits[i], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&pfor_calls, 1, __ATOMIC_RELAXED);
+}
+
+UnitTest(test_parallel_for_covers_range) {
+    pool_start(4);  // more workers than the sandbox may have CPUs
+    long grains[] = { 1, 7, 1000, PFOR_N };
+    for (int g = 0; g < 4; g++) {
+        memset(visits, 0, sizeof(visits));
+        parallel_for(0, PFOR_N, grains[g], mark_range, &grains[g]);
+        for (long i = 0; i < PFOR_N; i++) {
+            tk_assert(visits[i] == 1, "index %ld visited %d times (grain %ld)",
+                      i, visits[i], grains[g]);
+        }
+    }
+    pool_stop();
+}
+
+static void nested_for(void *ctx, long begin, long end) {
+    for (long i = begin; i < end; i++) {
+        long grain = PFOR_N;
+        parallel_for(i * 10, i * 10 + 10, 1, mark_range, &grain);
+    }
+}
+
+UnitTest(test_parallel_for_nested) {
+    memset(visits, 0, sizeof(visits));
+    parallel_for(0, PFOR_N / 10, 16, nested_for, NULL);
+    for (long i = 0; i < PFOR_N / 10 * 10; i++) {
+        tk_assert(visits[i] == 1, "index %ld visited %d times", i, visits[i]);
+    }
+}
+
+#define PHASES 200
+
+static barrier_t phase_barrier;
+static int phase_counts[PHASES];
+
+static void *phase_worker(void *arg) {
+    int sense = 0;
+    for (int p = 0; p < PHASES; p++) {
+        __atomic_fetch_add(&phase_counts[p], 1, __ATOMIC_RELAXED);
+        barrier_wait(&phase_barrier, &sense);
+        // Everyone has finished phase p before anyone starts p + 1.
+        tk_assert(__atomic_load_n(&phase_counts[p], __ATOMIC_RELAXED) == SYNC_THREADS,
+                  "phase %d: %d arrivals", p, phase_counts[p]);
+        if (p + 1 < PHASES) {
+            tk_assert(__atomic_load_n(&phase_counts[p + 1], __ATOMIC_RELAXED) < SYNC_THREADS,
+                      "phase %d started early", p + 1);
+        }
+    }
+    return NULL;
+}
+
+UnitTest(test_barrier_phases) {
+    barrier_init(&phase_barrier, SYNC_THREADS);
+    pthread_t threads[SYNC_THREADS];
+    for (int i = 0; i < SYNC_THREADS; i++) {
+        pthread_create(&threads[i], NULL, phase_worker, NULL);
+    }
+    for (int i = 0; i < SYNC_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void nothing(void *ctx, long begin, long end) {
+    TK_KEEP(begin);
+}
+
+// Fork-join overhead: wake the workers, split, steal and join.
+BenchTest(bench_parallel_for_overhead) {
+    for (long i = 0; i < bench->iters; i++) {
+        parallel_for(0, 1024, 16, nothing, NULL);
+    }
+}
+
+// ======================== Lock-free queues ========================
+
+#define QUEUE_MSGS 1000000
+
+// Spin, then yield: with more threads than CPUs the other side needs
+// our CPU to make progress.
+static void backoff(int *spins) {
+    if (++*spins < SPIN_LIMIT) {
+        cpu_relax();
+    } else {
+        *spins = 0;
+        sched_yield();
+    }
+}
+
+static void spsc_send(spsc_t *q, void *msg) {
+    for (int spins = 0; !spsc_push(q, msg); ) {
+        backoff(&spins);
+    }
+}
+
+static void *spsc_recv(spsc_t *q) {
+    void *msg;
+    for (int spins = 0; !spsc_pop(q, &msg); ) {
+        backoff(&spins);
+    }
+    return msg;
+}
+
+static void mpmc_send(mpmc_t *q, void *msg) {
+    for (int spins = 0; !mpmc_push(q, msg); ) {
+        backoff(&spins);
+    }
+}
+
+static void *mpmc_recv(mpmc_t *q) {
+    void *msg;
+    for (int spins = 0; !mpmc_pop(q, &msg); ) {
+        backoff(&spins);
+    }
+    return msg;
+}
+
+static spsc_t ring, reply_ring;
+static mpmc_t mpmc;
+
+struct producer {
+    pthread_t thread;
+    long first, n;  // sends first, first + 1, ..., first + n - 1
+};
+
+static void *spsc_producer(void *arg) {
+    struct producer *p = arg;
+    for (long i = 0; i < p->n; i++) {
+        spsc_send(&ring, (void *)(p->first + i));
+    }
+    spsc_flush(&ring);
+    return NULL;
+}
+
+static void *mpmc_producer(void *arg) {
+    struct producer *p = arg;
+    for (long i = 0; i < p->n; i++) {
+        mpmc_send(&mpmc, (void *)(p->first + i));
+    }
+    return NULL;
+}
+
+UnitTest(test_spsc_in_order) {
+    spsc_init(&ring, 256);
+    struct producer p = { .first = 1, .n = QUEUE_MSGS };
+    pthread_create(&p.thread, NULL, spsc_producer, &p);
+    for (long i = 1; i <= QUEUE_MSGS; i++) {
+        long msg = (long)spsc_recv(&ring);
+        tk_assert(msg == i, "expected message %ld, got %ld", i, msg);
+    }
+    pthread_join(p.thread, NULL);
+    spsc_destroy(&ring);
+}
+
+#define MPMC_PRODUCERS 4
+
+static unsigned char received[MPMC_PRODUCERS * QUEUE_MSGS / 4];
+
+static void *mpmc_consumer(void *arg) {
+    long n = (long)arg;
+    for (long i = 0; i < n; i++) {
+        long msg = (long)mpmc_recv(&mpmc);
+        __atomic_fetch_add(&received[msg], 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+UnitTest(test_mpmc_exactly_once) {
+    long per = QUEUE_MSGS / 4;
+    mpmc_init(&mpmc, 64);
+    struct producer producers[MPMC_PRODUCERS];
+    pthread_t consumers[MPMC_PRODUCERS];
+    for (int i = 0; i < MPMC_PRODUCERS; i++) {
+        producers[i] = (struct producer) { .first = i * per, .n = per };
+        pthread_create(&producers[i].thread, NULL, mpmc_producer, &producers[i]);
+        pthread_create(&consumers[i], NULL, mpmc_consumer, (void *)per);
+    }
+    for (int i = 0; i < MPMC_PRODUCERS; i++) {
+        pthread_join(producers[i].thread, NULL);
+        pthread_join(consumers[i], NULL);
+    }
+    for (long i = 0; i < MPMC_PRODUCERS * per; i++) {
+        tk_assert(received[i] == 1, "message %ld received %d times", i, received[i]);
+    }
+    mpmc_destroy(&mpmc);
+}
+
+// Throughput: messages from another thread, per message.
+BenchTest(bench_spsc_throughput) {
+    spsc_init(&ring, 1024);
+    struct producer p = { .first = 1, .n = bench->iters };
+    pthread_create(&p.thread, NULL, spsc_producer, &p);
+    for (long i = 0; i < bench->iters; i++) {
+        TK_KEEP(spsc_recv(&ring));
+    }
+    pthread_join(p.thread, NULL);
+    spsc_destroy(&ring);
+}
+
+static void mpmc_fan_in(int nproducers, long n) {
+    mpmc_init(&mpmc, 1024);
+    struct producer producers[nproducers];
+    for (int i = 0; i < nproducers; i++) {
+        long lo = n * i / nproducers, hi = n * (i + 1) / nproducers;
+        producers[i] = (struct producer) { .first = lo + 1, .n = hi - lo };
+        pthread_create(&producers[i].thread, NULL, mpmc_producer, &producers[i]);
+    }
+    for (long i = 0; i < n; i++) {
+        TK_KEEP(mpmc_recv(&mpmc));
+    }
+    for (int i = 0; i < nproducers; i++) {
+        pthread_join(producers[i].thread, NULL);
+    }
+    mpmc_destroy(&mpmc);
+}
+
+BenchTest(bench_mpmc_1_producer) {
+    mpmc_fan_in(1, bench->iters);
+}
+
+BenchTest(bench_mpmc_2_producers) {
+    mpmc_fan_in(2, bench->iters);
+}
+
+BenchTest(bench_mpmc_4_producers) {
+    mpmc_fan_in(4, bench->iters);
+}
+
+// Latency: a message and its reply, through two rings.
+static void *echo(void *arg) {
+    long n = (long)arg;
+    for (long i = 0; i < n; i++) {
+        spsc_send(&reply_ring, spsc_recv(&ring));
+        spsc_flush(&reply_ring);
+    }
+    return NULL;
+}
+
+BenchTest(bench_spsc_round_trip) {
+    spsc_init(&ring, 64);
+    spsc_init(&reply_ring, 64);
+    pthread_t thread;
+    pthread_create(&thread, NULL, echo, (void *)bench->iters);
+    for (long i = 0; i < bench->iters; i++) {
+        spsc_send(&ring, (void *)i);
+        spsc_flush(&ring);
+        TK_KEEP(spsc_recv(&reply_ring));
+    }
+    pthread_join(thread, NULL);
+    spsc_destroy(&ring);
+    spsc_destroy(&reply_ring);
+}
+
+// ========================= Read-mostly state =========================
+
+// A small record that readers must never see half-updated.
+struct config {
+    long version, checksum, entries[4];
+};
+
+static struct config config;
+static rwlock_t config_rwlock;
+static pthread_rwlock_t config_prwlock = PTHREAD_RWLOCK_INITIALIZER;
+static mutex_t config_mutex = MUTEX_INIT();
+static seqlock_t config_seqlock = SEQLOCK_INIT();
+static int config_readers_done;
+
+enum { READ_RWLOCK, READ_PTHREAD_RWLOCK, READ_MUTEX, READ_SEQLOCK };
+
+static struct config make_config(long version) {
+    struct config c = { .version = version };
+    for (int i = 0; i < 4; i++) {
+        c.entries[i] = version * (i + 1);
+        c.checksum += c.entries[i];
+    }
+    return c;
+}
+
+static int config_ok(const struct config *c) {
+    long sum = 0;
+    for (int i = 0; i < 4; i++) {
+        sum += c->entries[i];
+    }
+    return sum == c->checksum && c->entries[0] == c->version;
+}
+
+static struct config read_config(int kind) {
+    struct config c;
+    switch (kind) {
+        case READ_RWLOCK: {
+            int slot = rwlock_rdlock(&config_rwlock);
+            c = config;
+            rwlock_rdunlock(&config_rwlock, slot);
+            break;
+        }
+        case READ_PTHREAD_RWLOCK:
+            pthread_rwlock_rdlock(&config_prwlock);
+            c = config;
+            pthread_rwlock_unlock(&config_prwlock);
+            break;
+        case READ_MUTEX:
+            mutex_lock(&config_mutex);
+            c = config;
+            mutex_unlock(&config_mutex);
+            break;
+        default:
+            seqlock_read(&config_seqlock, &c, &config, sizeof(c));
+    }
+    return c;
+}
+
+static void write_config(int kind, long version) {
+    struct config c = make_config(version);
+    switch (kind) {
+        case READ_RWLOCK:
+            rwlock_wrlock(&config_rwlock);
+            config = c;
+            rwlock_wrunlock(&config_rwlock);
+            break;
+        case READ_PTHREAD_RWLOCK:
+            pthread_rwlock_wrlock(&config_prwlock);
+            config = c;
+            pthread_rwlock_unlock(&config_prwlock);
+            break;
+        case READ_MUTEX:
+            mutex_lock(&config_mutex);
+            config = c;
+            mutex_unlock(&config_mutex);
+            break;
+        default:
+            seqlock_write(&config_seqlock, &config, &c, sizeof(c));
+    }
+}
+
+struct config_reader {
+    pthread_t thread;
+    int kind;
+    long n, bad;
+};
+
+static void *config_reader(void *arg) {
+    struct config_reader *r = arg;
+    for (long i = 0; i < r->n; i++) {
+        struct config c = read_config(r->kind);
+        r->bad += !config_ok(&c);
+    }
+    __atomic_add_fetch(&config_readers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// nreaders share n reads; the writer publishes a new version every
+// pause_us (or back to back) until they are done. Returns the number
+// of torn reads.
+static long read_config_with_writer(int kind, int nreaders, long n, int pause_us) {
+    rwlock_init(&config_rwlock);
+    config_readers_done = 0;
+    write_config(kind, 0);
+
+    struct config_reader readers[nreaders];
+    for (int i = 0; i < nreaders; i++) {
+        readers[i] = (struct config_reader) {
+            .kind = kind, .n = n * (i + 1) / nreaders - n * i / nreaders,
+        };
+        pthread_create(&readers[i].thread, NULL, config_reader, &readers[i]);
+    }
+    for (long v = 1; __atomic_load_n(&config_readers_done, __ATOMIC_ACQUIRE) < nreaders; v++) {
+        write_config(kind, v);
+        if (pause_us) {
+            usleep(pause_us);
+        }
+    }
+    long bad = 0;
+    for (int i = 0; i < nreaders; i++) {
+        pthread_join(readers[i].thread, NULL);
+        bad += readers[i].bad;
+    }
+    return bad;
+}
+
+UnitTest(test_rwlock_snapshots) {
+    long bad = read_config_with_writer(READ_RWLOCK, SYNC_THREADS, 200000, 0);
+    tk_assert(bad == 0, "%ld torn reads", bad);
+    bad = read_config_with_writer(READ_RWLOCK, SYNC_THREADS, 20000, 50);
+    tk_assert(bad == 0, "%ld torn reads", bad);
+}
+
+UnitTest(test_seqlock_snapshots) {
+    long bad = read_config_with_writer(READ_SEQLOCK, SYNC_THREADS, 200000, 0);
+    tk_assert(bad == 0, "%ld torn reads", bad);
+}
+
+// Reader throughput with one reader per CPU and an occasional writer;
+// compare with a single reader for the scaling.
+#define WRITER_PAUSE_US 100
+
+static int online_cpus(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 && cpus < 64 ? cpus : 64;
+}
+
+BenchTest(bench_rwlock_1_reader) {
+    read_config_with_writer(READ_RWLOCK, 1, bench->iters, WRITER_PAUSE_US);
+}
+
+BenchTest(bench_rwlock_readers_per_cpu) {
+    read_config_with_writer(READ_RWLOCK, online_cpus(), bench->iters, WRITER_PAUSE_US);
+}
+
+BenchTest(bench_pthread_rwlock_readers_per_cpu) {
+    read_config_with_writer(READ_PTHREAD_RWLOCK, online_cpus(), bench->iters, WRITER_PAUSE_US);
+}
+
+BenchTest(bench_mutex_readers_per_cpu) {
+    read_config_with_writer(READ_MUTEX, online_cpus(), bench->iters, WRITER_PAUSE_US);
+}
+
+BenchTest(bench_seqlock_readers_per_cpu) {
+    read_config_with_writer(READ_SEQLOCK, online_cpus(), bench->iters, WRITER_PAUSE_US);
+}
+
+// ========================= Topology =========================
+
+UnitTest(test_cpulist_parse) {
+    cpu_set_t set;
+    tk_assert(topo_parse_cpulist("0-3,8,10-11", &set) == 7, "count");
+    tk_assert(CPU_ISSET(3, &set) && CPU_ISSET(8, &set) && !CPU_ISSET(9, &set), "members");
+    tk_assert(topo_parse_cpulist("5", &set) == 1 && CPU_ISSET(5, &set), "single");
+    tk_assert(topo_parse_cpulist("3-1", &set) < 0, "reversed range");
+    tk_assert(topo_parse_cpulist("0,x", &set) < 0, "junk");
+}
+
+#include <sys/stat.h>
+
+static void write_sysfs(const char *root, const char *file, const char *text) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", root, file);
+    // mkdir -p the parents
+    for (char *p = path + strlen(root) + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+    FILE *fp = fopen(path, "w");
+    tk_assert(fp != NULL, "cannot create %s", path);
+    fprintf(fp, "%s\n", text);
+    fclose(fp);
+}
+
+// 2 nodes x 1 LLC x 2 cores x 2 threads; siblings are numbered apart,
+// as on most x86 machines: cpu0 and cpu4 share core 0.
+UnitTest(test_topology_fake_sysfs) {
+    char root[] = "/tmp/topoXXXXXX", file[128], text[64];
+    tk_assert(mkdtemp(root) != NULL, "mkdtemp");
+    write_sysfs(root, "online", "0-7");
+    for (int cpu = 0; cpu < 8; cpu++) {
+        int core = cpu % 4, node = core / 2;
+        snprintf(file, sizeof(file), "cpu%d/topology/core_cpus_list", cpu);
+        snprintf(text, sizeof(text), "%d,%d", core, core + 4);
+        write_sysfs(root, file, text);
+        snprintf(file, sizeof(file), "cpu%d/cache/index0/level", cpu);
+        write_sysfs(root, file, "1");
+        snprintf(file, sizeof(file), "cpu%d/cache/index0/shared_cpu_list", cpu);
+        write_sysfs(root, file, text);
+        snprintf(file, sizeof(file), "cpu%d/cache/index1/level", cpu);
+        write_sysfs(root, file, "3");
+        snprintf(file, sizeof(file), "cpu%d/cache/index1/shared_cpu_list", cpu);
+        snprintf(text, sizeof(text), "%d-%d,%d-%d", 2 * node, 2 * node + 1, 2 * node + 4, 2 * node + 5);
+        write_sysfs(root, file, text);
+        snprintf(file, sizeof(file), "cpu%d/node%d/cpulist", cpu, node);
+        write_sysfs(root, file, text);
+    }
+
+    static struct topology topo;
+    tk_assert(topo_load_from(&topo, root, NULL) == 0, "load");
+    tk_assert(topo.ncpus == 8 && topo.ncores == 4 && topo.nllcs == 2 && topo.nnodes == 2,
+              "%d cpus, %d cores, %d llcs, %d nodes", topo.ncpus, topo.ncores, topo.nllcs, topo.nnodes);
+    tk_assert(topo.cpus[4].core == topo.cpus[0].core && topo.cpus[4].smt == 1, "siblings");
+    tk_assert(topo.cpus[3].node == 1 && topo.cpus[7].llc == topo.cpus[2].llc, "groups");
+
+    int cpus[8], compact[] = { 0, 1, 2, 3, 4, 5, 6, 7 }, scatter[] = { 0, 2, 1, 3 };
+    tk_assert(topo_placement(&topo, TOPO_COMPACT, cpus, 8) == 8 &&
+              memcmp(cpus, compact, sizeof(compact)) == 0, "compact order");
+    tk_assert(topo_placement(&topo, TOPO_SCATTER, cpus, 4) == 4 &&
+              memcmp(cpus, scatter, sizeof(scatter)) == 0, "scatter order");
+
+    // Only the CPUs we may run on.
+    cpu_set_t allowed;
+    topo_parse_cpulist("2-3,6", &allowed);
+    tk_assert(topo_load_from(&topo, root, &allowed) == 0, "load");
+    tk_assert(topo.ncpus == 3 && topo.ncores == 2 && topo.nnodes == 1, "restricted");
+
+    // An empty file reads as an empty string, not as what buf held before.
+    char buf[16] = "0-7";
+    snprintf(file, sizeof(file), "%s/online", root);
+    fclose(fopen(file, "w"));
+    tk_assert(topo_read_(buf, sizeof(buf), "%s", file) < 0 && buf[0] == '\0', "empty file");
+    tk_assert(topo_load_from(&topo, root, NULL) < 0, "no online CPUs");
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    system(cmd);
+}
+
+static int pinned_cpus[POOL_MAX_WORKERS], pinned_bad;
+
+static void check_cpu(void *ctx, long begin, long end) {
+    int cpu = sched_getcpu(), ok = 0;
+    for (int i = 0; i < pool_.nworkers; i++) {
+        ok |= pinned_cpus[i] == cpu;
+    }
+    if (!ok) {
+        __atomic_fetch_add(&pinned_bad, 1, __ATOMIC_RELAXED);
+    }
+}
+
+UnitTest(test_pool_pinned) {
+    static struct topology topo;
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    tk_assert(topo_load(&topo) == 0, "cannot read " TOPO_SYSFS);
+    tk_assert(topo.ncpus == CPU_COUNT(&allowed) && topo.ncores <= topo.ncpus, "cpus");
+
+    pool_stop();  // in case an earlier parallel_for started it unpinned
+    pool_start_pinned(TOPO_COMPACT);
+    for (int i = 0; i < pool_.nworkers; i++) {
+        pinned_cpus[i] = pool_.workers[i].cpu;
+        for (int j = 0; j < i; j++) {
+            tk_assert(pinned_cpus[i] != pinned_cpus[j], "two workers on CPU %d", pinned_cpus[i]);
+        }
+    }
+    tk_assert(pool_.nworkers == (topo.ncores < POOL_MAX_WORKERS ? topo.ncores : POOL_MAX_WORKERS),
+              "%d workers for %d cores", pool_.nworkers, topo.ncores);
+    parallel_for(0, 100000, 100, check_cpu, NULL);
+    tk_assert(pinned_bad == 0, "%d ranges ran off their CPU", pinned_bad);
+
+    // matmul_forward (in gpt.c) runs on the same pool: it starts no
+    // workers of its own, and the ones it uses are still pinned.
+    setup_bench_matmul();
+    int nworkers = pool_.nworkers;
+    matmul_forward(bench_out, bench_inp, bench_weight, bench_bias,
+                   1, BENCH_T, BENCH_C, BENCH_OC);
+    tk_assert(pool_.nworkers == nworkers, "matmul_forward restarted the pool");
+    for (int i = 0; i < pool_.nworkers; i++) {
+        cpu_set_t set;
+        if (i == 0) {
+            sched_getaffinity(0, sizeof(set), &set);
+        } else {
+            pthread_getaffinity_np(pool_.workers[i].thread, sizeof(set), &set);
+        }
+        tk_assert(CPU_COUNT(&set) == 1 && CPU_ISSET(pinned_cpus[i], &set),
+                  "worker %d not pinned to CPU %d", i, pinned_cpus[i]);
+    }
+    pool_stop();
+}
+
+// Pins the pool matmul_forward runs on: there is one per program.
+static void setup_bench_matmul_pinned(void) {
+    setup_bench_matmul();
+    pool_stop();
+    pool_start_pinned(TOPO_COMPACT);
+}
+
+// As bench_matmul_forward, with workers pinned to cores.
+BenchTest(bench_matmul_forward_pinned, .init = setup_bench_matmul_pinned) {
+    for (long i = 0; i < bench->iters; i++) {
+        matmul_forward(bench_out, bench_inp, bench_weight, bench_bias,
+                       1, BENCH_T, BENCH_C, BENCH_OC);
+        TK_KEEP(bench_out[0]);
+    }
+}
+
+// ========================= KV cache =========================
+
+// A small model with random weights, written as a checkpoint and loaded
+// like the real one.
+#define TINY_MAXT 256
+#define TINY_V    128
+#define TINY_L    2
+#define TINY_NH   4
+#define TINY_C    64
+
+static void load_tiny_model(GPT2 *model) {
+    char path[] = "/tmp/tinygptXXXXXX";
+    int fd = mkstemp(path);
+    tk_assert(fd >= 0, "mkstemp");
+    FILE *fp = fdopen(fd, "wb");
+    int header[256] = { 20240326, 1, TINY_MAXT, TINY_V, TINY_L, TINY_NH, TINY_C };
+    fwrite(header, sizeof(int), 256, fp);
+
+    int C = TINY_C;
+    size_t n = (size_t)TINY_V * C + TINY_MAXT * C + 2 * C +
+               (size_t)TINY_L * (12 * C * C + 13 * C);
+    unsigned seed = 1;
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        float w = ((int)((seed >> 8) % 2001) - 1000) / 1000.0f;
+        fwrite(&w, sizeof(w), 1, fp);
+    }
+    fclose(fp);
+    gpt2_build_from_checkpoint(model, path);
+    unlink(path);
+}
+
+static int probs_close(const float *a, const float *b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (fabsf(a[i] - b[i]) > 1e-5f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Prompt and step-by-step decoding through the cache give what running
+// the model over the whole prefix gives, step after step.
+UnitTest(test_kv_cached_matches_full) {
+    static GPT2 model, ref;
+    load_tiny_model(&model);
+    load_tiny_model(&ref);
+    KVPool kv;
+    KVSeq seq, *seqs[] = { &seq };
+    tk_assert(kv_pool_init(&kv, TINY_L, TINY_NH, TINY_C, KV_F32, 8) == 0, "kv_pool_init");
+    kv_seq_init(&seq);
+
+    int tokens[40] = { 3, 14, 15, 92, 65 }, T = 5;
+    tk_assert(gpt2_forward_cached(&model, &kv, seqs, tokens, 1, T) == 0, "prompt");
+    for (; T < 40; T++) {
+        gpt2_forward(&ref, tokens, 1, T);
+        tk_assert(probs_close(model.acts.probs + (model.seq_len - 1) * TINY_V,
+                              ref.acts.probs + (T - 1) * TINY_V, TINY_V),
+                  "different distribution at position %d", T - 1);
+        tokens[T] = (tokens[T - 1] * 31 + 7) % TINY_V;
+        tk_assert(gpt2_forward_cached(&model, &kv, seqs, &tokens[T], 1, 1) == 0, "decode");
+    }
+    tk_assert(seq.len == 40 && seq.num_blocks == 3, "%d positions in %d blocks", seq.len, seq.num_blocks);
+    kv_seq_release(&kv, &seq);
+    tk_assert(kv.num_free == kv.num_blocks, "blocks not returned");
+    kv_pool_free(&kv);
+    gpt2_free(&model);
+    gpt2_free(&ref);
+}
+
+// Sequences of different lengths decode together as they do alone.
+UnitTest(test_kv_batched_decode) {
+    static GPT2 model;
+    load_tiny_model(&model);
+    KVPool kv;
+    tk_assert(kv_pool_init(&kv, TINY_L, TINY_NH, TINY_C, KV_F32, 16) == 0, "kv_pool_init");
+
+    enum { B = 3, STEPS = 4 };
+    int lens[B] = { 3, 7, 18 }, prompt[TINY_MAXT];
+    for (int i = 0; i < TINY_MAXT; i++) {
+        prompt[i] = (i * 37 + 11) % TINY_V;
+    }
+    static float alone[B][STEPS][TINY_V];
+    KVSeq seqs[B], *batch[B];
+    for (int b = 0; b < B; b++) {
+        KVSeq *one[] = { &seqs[b] };
+        kv_seq_init(&seqs[b]);
+        gpt2_forward_cached(&model, &kv, one, prompt, 1, lens[b]);
+        for (int s = 0; s < STEPS; s++) {
+            int token = s + b;
+            gpt2_forward_cached(&model, &kv, one, &token, 1, 1);
+            memcpy(alone[b][s], model.acts.probs, sizeof(alone[b][s]));
+        }
+        kv_seq_release(&kv, &seqs[b]);
+    }
+
+    for (int b = 0; b < B; b++) {
+        KVSeq *one[] = { &seqs[b] };
+        kv_seq_init(&seqs[b]);
+        gpt2_forward_cached(&model, &kv, one, prompt, 1, lens[b]);
+        batch[b] = &seqs[b];
+    }
+    for (int s = 0; s < STEPS; s++) {
+        int tokens[B];
+        for (int b = 0; b < B; b++) {
+            tokens[b] = s + b;
+        }
+        tk_assert(gpt2_forward_cached(&model, &kv, batch, tokens, B, 1) == 0, "decode");
+        for (int b = 0; b < B; b++) {
+            tk_assert(probs_close(model.acts.probs + b * TINY_V, alone[b][s], TINY_V),
+                      "sequence %d differs at step %d", b, s);
+        }
+    }
+    for (int b = 0; b < B; b++) {
+        kv_seq_release(&kv, &seqs[b]);
+    }
+    tk_assert(kv.num_free == kv.num_blocks, "blocks not returned");
+    kv_pool_free(&kv);
+    gpt2_free(&model);
+}
+
+// A full pool turns sequences away until another one is released.
+UnitTest(test_kv_pool_exhausted) {
+    static GPT2 model;
+    load_tiny_model(&model);
+    KVPool kv;
+    KVSeq a, b, *seq_a[] = { &a }, *seq_b[] = { &b };
+    tk_assert(kv_pool_init(&kv, TINY_L, TINY_NH, TINY_C, KV_F32, 2) == 0, "kv_pool_init");
+    kv_seq_init(&a);
+    kv_seq_init(&b);
+
+    int prompt[TINY_MAXT] = { 0 };
+    tk_assert(gpt2_forward_cached(&model, &kv, seq_a, prompt, 1, 2 * KV_BLOCK_TOKENS) == 0, "fits");
+    tk_assert(gpt2_forward_cached(&model, &kv, seq_b, prompt, 1, 1) < 0, "pool is full");
+    tk_assert(gpt2_forward_cached(&model, &kv, seq_a, prompt, 1, 1) < 0, "no block to grow into");
+    tk_assert(b.len == 0 && a.len == 2 * KV_BLOCK_TOKENS, "failed calls must not advance");
+    kv_seq_release(&kv, &a);
+    tk_assert(gpt2_forward_cached(&model, &kv, seq_b, prompt, 1, 1) == 0, "blocks reused");
+    tk_assert(gpt2_forward_cached(&model, &kv, seq_b, prompt, 1, TINY_MAXT) < 0, "beyond max_seq_len");
+    kv_seq_release(&kv, &b);
+    kv_pool_free(&kv);
+    gpt2_free(&model);
+}
+
+// One decoding step after TINY_MAXT / 2 positions: through the cache,
+// and by running the model over the whole prefix.
+static GPT2 bench_model;
+static KVPool bench_kv;
+static KVSeq bench_seq;
+static int bench_tokens[TINY_MAXT];
+
+static void setup_bench_decode(void) {
+    load_tiny_model(&bench_model);
+    for (int i = 0; i < TINY_MAXT; i++) {
+        bench_tokens[i] = (i * 37 + 11) % TINY_V;
+    }
+    KVSeq *seqs[] = { &bench_seq };
+    kv_pool_init(&bench_kv, TINY_L, TINY_NH, TINY_C, KV_F32, TINY_MAXT / KV_BLOCK_TOKENS);
+    kv_seq_init(&bench_seq);
+    gpt2_forward_cached(&bench_model, &bench_kv, seqs, bench_tokens, 1, TINY_MAXT / 2);
+}
+
+BenchTest(bench_decode_cached, .init = setup_bench_decode) {
+    KVSeq *seqs[] = { &bench_seq };
+    for (long i = 0; i < bench->iters; i++) {
+        bench_seq.len = TINY_MAXT / 2;  // the same step again
+        gpt2_forward_cached(&bench_model, &bench_kv, seqs, &bench_tokens[bench_seq.len], 1, 1);
+        TK_KEEP(bench_model.acts.probs[0]);
+    }
+}
+
+BenchTest(bench_decode_recompute, .init = setup_bench_decode) {
+    for (long i = 0; i < bench->iters; i++) {
+        gpt2_forward(&bench_model, bench_tokens, 1, TINY_MAXT / 2 + 1);
+        TK_KEEP(bench_model.acts.probs[0]);
+    }
+}
+
+// Quantized caches against the fp32 one, on a prompt filling most of the
+// context and the tokens decoded after it.
+static void kv_accuracy(int dtype, float max_diff, int min_same_top) {
+    static GPT2 model;
+    static float ref[32][TINY_V];
+    load_tiny_model(&model);
+    enum { PROMPT = TINY_MAXT - 32, STEPS = 32 };
+    int tokens[TINY_MAXT];
+    for (int i = 0; i < TINY_MAXT; i++) {
+        tokens[i] = (i * 37 + 11) % TINY_V;
+    }
+
+    float worst = 0.0f;
+    int same_top = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        KVPool kv;
+        KVSeq seq, *seqs[] = { &seq };
+        tk_assert(kv_pool_init(&kv, TINY_L, TINY_NH, TINY_C, pass ? dtype : KV_F32,
+                               TINY_MAXT / KV_BLOCK_TOKENS) == 0, "kv_pool_init");
+        kv_seq_init(&seq);
+        gpt2_forward_cached(&model, &kv, seqs, tokens, 1, PROMPT);
+        for (int s = 0; s < STEPS; s++) {
+            float *probs = model.acts.probs + (model.seq_len - 1) * TINY_V;
+            if (pass == 0) {
+                memcpy(ref[s], probs, sizeof(ref[s]));
+            } else {
+                int top = 0, ref_top = 0;
+                for (int i = 0; i < TINY_V; i++) {
+                    worst = fmaxf(worst, fabsf(probs[i] - ref[s][i]));
+                    top = probs[i] > probs[top] ? i : top;
+                    ref_top = ref[s][i] > ref[s][ref_top] ? i : ref_top;
+                }
+                same_top += top == ref_top;
+            }
+            if (s + 1 < STEPS) {
+                gpt2_forward_cached(&model, &kv, seqs, &tokens[PROMPT + s], 1, 1);
+            }
+        }
+        kv_seq_release(&kv, &seq);
+        kv_pool_free(&kv);
+    }
+    tk_assert(worst <= max_diff, "probabilities off by up to %g", worst);
+    tk_assert(same_top >= min_same_top, "same top token in only %d of %d steps", same_top, STEPS);
+    gpt2_free(&model);
+}
+
+UnitTest(test_kv_f16_accuracy) {
+    kv_accuracy(KV_F16, 5e-3f, 32);
+}
+
+UnitTest(test_kv_int8_accuracy) {
+    kv_accuracy(KV_INT8, 0.1f, 30);
+}
+
+UnitTest(test_kv_block_sizes) {
+    KVPool f32, f16, int8;
+    kv_pool_init(&f32, TINY_L, TINY_NH, TINY_C, KV_F32, 1);
+    kv_pool_init(&f16, TINY_L, TINY_NH, TINY_C, KV_F16, 1);
+    kv_pool_init(&int8, TINY_L, TINY_NH, TINY_C, KV_INT8, 1);
+    tk_assert(f16.block_size * 2 == f32.block_size, "fp16 is half of fp32");
+    tk_assert(int8.block_size * 3 < f32.block_size, "int8 is about a quarter of fp32");
+    kv_pool_free(&f32);
+    kv_pool_free(&f16);
+    kv_pool_free(&int8);
+}
+
+static void setup_bench_decode_int8(void) {
+    load_tiny_model(&bench_model);
+    for (int i = 0; i < TINY_MAXT; i++) {
+        bench_tokens[i] = (i * 37 + 11) % TINY_V;
+    }
+    KVSeq *seqs[] = { &bench_seq };
+    kv_pool_init(&bench_kv, TINY_L, TINY_NH, TINY_C, KV_INT8, TINY_MAXT / KV_BLOCK_TOKENS);
+    kv_seq_init(&bench_seq);
+    gpt2_forward_cached(&bench_model, &bench_kv, seqs, bench_tokens, 1, TINY_MAXT / 2);
+}
+
+// As bench_decode_cached, reading an int8 cache.
+BenchTest(bench_decode_cached_int8, .init = setup_bench_decode_int8) {
+    KVSeq *seqs[] = { &bench_seq };
+    for (long i = 0; i < bench->iters; i++) {
+        bench_seq.len = TINY_MAXT / 2;
+        gpt2_forward_cached(&bench_model, &bench_kv, seqs, &bench_tokens[bench_seq.len], 1, 1);
+        TK_KEEP(bench_model.acts.probs[0]);
+    }
+}
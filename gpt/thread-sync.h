@@ -1,5 +1,14 @@
-#include <semaphore.h>
+#pragma once
+
 #include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 // Spinlock
 typedef int spinlock_t;
@@ -12,33 +21,416 @@ static inline int atomic_xchg(volatile int *addr, int newval) {
     return result;
 }
 
-void spin_lock(spinlock_t *lk) {
-    while (1) {
-        int value = atomic_xchg(lk, 1);
-        if (value == 0) {
-            break;
+// Tell the CPU we are busy-waiting (and let the other hyperthread run).
+static inline void cpu_relax() {
+    asm volatile ("pause" ::: "memory");
+}
+
+// Spin (reading, not writing, the lock) for a while, then give the CPU
+// away: the lock holder may be waiting for it when there are more
+// threads than CPUs.
+#define SPIN_LIMIT 128
+
+static inline void spin_lock(spinlock_t *lk) {
+    for (int spins = 0; __atomic_exchange_n(lk, 1, __ATOMIC_ACQUIRE) != 0; ) {
+        while (__atomic_load_n(lk, __ATOMIC_RELAXED) != 0) {
+            if (++spins < SPIN_LIMIT) {
+                cpu_relax();
+            } else {
+                spins = 0;
+                sched_yield();
+            }
+        }
+    }
+}
+static inline void spin_unlock(spinlock_t *lk) {
+    __atomic_store_n(lk, 0, __ATOMIC_RELEASE);
+}
+
+// Futex
+static inline void futex_wait(int *addr, int val) {
+    // Sleeps only if *addr is still val; may wake up spuriously.
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(int *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// Mutex: 0 = unlocked, 1 = locked, 2 = locked and (maybe) waited for
+// ("Futexes Are Tricky", Drepper). Uncontended lock and unlock are a
+// single atomic instruction each, without system calls.
+typedef struct {
+    int state;
+} mutex_t;
+#define MUTEX_INIT() { 0 }
+
+static inline void mutex_init(mutex_t *mutex) {
+    mutex->state = 0;
+}
+
+static inline int mutex_cas_(int *addr, int expected, int desired) {
+    return __atomic_compare_exchange_n(addr, &expected, desired, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void mutex_lock(mutex_t *mutex) {
+    if (mutex_cas_(&mutex->state, 0, 1)) {
+        return;
+    }
+
+    // The holder is likely to release soon: spin for a while.
+    for (int i = 0; i < SPIN_LIMIT; i++) {
+        cpu_relax();
+        if (__atomic_load_n(&mutex->state, __ATOMIC_RELAXED) == 0 &&
+            mutex_cas_(&mutex->state, 0, 1)) {
+            return;
         }
     }
+
+    // Then sleep. Having slept, we cannot know if anyone else waits, so
+    // take the lock as 2 and have unlock wake up the next one.
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex_wait(&mutex->state, 2);
+    }
 }
-void spin_unlock(spinlock_t *lk) {
-    atomic_xchg(lk, 0);
+
+static inline void mutex_unlock(mutex_t *mutex) {
+    if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2) {
+        futex_wake(&mutex->state, 1);
+    }
 }
 
-// Mutex
-typedef pthread_mutex_t mutex_t;
-#define MUTEX_INIT() PTHREAD_MUTEX_INITIALIZER
-#define mutex_init(mutex) pthread_mutex_init(mutex, NULL)
-#define mutex_lock pthread_mutex_lock
-#define mutex_unlock pthread_mutex_unlock
+// Conditional Variable: waiters sleep on a sequence number that every
+// signal and broadcast increments, so a wake-up is never lost between
+// releasing the mutex and sleeping.
+typedef struct {
+    int seq;
+} cond_t;
+#define COND_INIT() { 0 }
 
-// Conditional Variable
-typedef pthread_cond_t cond_t;
-#define COND_INIT() PTHREAD_COND_INITIALIZER
-#define cond_wait pthread_cond_wait
-#define cond_broadcast pthread_cond_broadcast
-#define cond_signal pthread_cond_signal
+static inline void cond_wait(cond_t *cond, mutex_t *mutex) {
+    int seq = __atomic_load_n(&cond->seq, __ATOMIC_RELAXED);
+    mutex_unlock(mutex);
+    futex_wait(&cond->seq, seq);
+    mutex_lock(mutex);
+}
+
+static inline void cond_signal(cond_t *cond) {
+    __atomic_fetch_add(&cond->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&cond->seq, 1);
+}
+
+static inline void cond_broadcast(cond_t *cond) {
+    __atomic_fetch_add(&cond->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&cond->seq, INT_MAX);
+}
 
 // Semaphore
-#define P sem_wait
-#define V sem_post
-#define SEM_INIT(sem, val) sem_init(sem, 0, val)
+typedef struct {
+    int value;
+    int waiters;
+} semaphore_t;
+
+static inline void sem_p(semaphore_t *sem) {
+    for (int spins = 0; ; spins++) {
+        int value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+        if (value > 0) {
+            if (__atomic_compare_exchange_n(&sem->value, &value, value - 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+        } else if (spins < SPIN_LIMIT) {
+            cpu_relax();
+        } else {
+            // V() checks waiters after incrementing value; we check value
+            // (in the kernel) after announcing ourselves.
+            __atomic_fetch_add(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+            futex_wait(&sem->value, 0);
+            __atomic_fetch_sub(&sem->waiters, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static inline void sem_v(semaphore_t *sem) {
+    __atomic_fetch_add(&sem->value, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&sem->value, 1);
+    }
+}
+
+#define P sem_p
+#define V sem_v
+#define SEM_INIT(sem, val) (*(sem) = (semaphore_t) { .value = (val) })
+
+// Lock-free bounded queues of pointers (void * messages). Fields written
+// by different threads live on different cache lines. Push and pop never
+// block; they fail when the queue is full or empty.
+#define CACHE_LINE 64
+
+// Single-producer single-consumer ring. Both sides publish their index
+// only every SPSC_BATCH messages (or when they would otherwise wait), so
+// the shared cache lines move between cores once per batch, not once
+// per message. A producer that stops pushing must call spsc_flush().
+#define SPSC_BATCH 32
+
+typedef struct {
+    _Alignas(CACHE_LINE) size_t tail;  // published by the producer
+    _Alignas(CACHE_LINE) size_t head;  // published by the consumer
+    _Alignas(CACHE_LINE) size_t ptail, phead;  // producer's own tail, last seen head
+    _Alignas(CACHE_LINE) size_t chead, ctail;  // consumer's own head, last seen tail
+    _Alignas(CACHE_LINE) size_t mask;
+    void **slots;
+} spsc_t;
+
+// capacity must be a power of two; returns 0 if out of memory.
+static inline int spsc_init(spsc_t *q, size_t capacity) {
+    *q = (spsc_t) { .mask = capacity - 1 };
+    q->slots = calloc(capacity, sizeof(void *));
+    return q->slots != NULL;
+}
+
+static inline void spsc_destroy(spsc_t *q) {
+    free(q->slots);
+}
+
+static inline void spsc_flush(spsc_t *q) {
+    __atomic_store_n(&q->tail, q->ptail, __ATOMIC_RELEASE);
+}
+
+// Returns 0 if the ring is full.
+static inline int spsc_push(spsc_t *q, void *msg) {
+    if (q->ptail - q->phead > q->mask) {
+        q->phead = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (q->ptail - q->phead > q->mask) {
+            spsc_flush(q);  // The consumer must see what we have.
+            return 0;
+        }
+    }
+    q->slots[q->ptail & q->mask] = msg;
+    if ((++q->ptail & (SPSC_BATCH - 1)) == 0) {
+        spsc_flush(q);
+    }
+    return 1;
+}
+
+// Returns 0 if the ring is (as far as published) empty.
+static inline int spsc_pop(spsc_t *q, void **msg) {
+    if (q->chead == q->ctail) {
+        // Hand back the slots we consumed before looking for more.
+        __atomic_store_n(&q->head, q->chead, __ATOMIC_RELEASE);
+        q->ctail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (q->chead == q->ctail) {
+            return 0;
+        }
+    }
+    *msg = q->slots[q->chead & q->mask];
+    if ((++q->chead & (SPSC_BATCH - 1)) == 0) {
+        __atomic_store_n(&q->head, q->chead, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+// Bounded multi-producer multi-consumer queue (Dmitry Vyukov's). Every
+// cell has a sequence number telling whose turn it is: pos when it is
+// free for the producer of pos, pos + 1 when it holds that message. A
+// producer or consumer claims a position with one CAS, and nobody waits
+// for a preempted thread unless they need that very cell.
+struct mpmc_cell {
+    size_t seq;
+    void *msg;
+};
+
+typedef struct {
+    _Alignas(CACHE_LINE) size_t enqueue_pos;
+    _Alignas(CACHE_LINE) size_t dequeue_pos;
+    _Alignas(CACHE_LINE) size_t mask;
+    struct mpmc_cell *cells;
+} mpmc_t;
+
+// capacity must be a power of two (at least 2); returns 0 if out of memory.
+static inline int mpmc_init(mpmc_t *q, size_t capacity) {
+    *q = (mpmc_t) { .mask = capacity - 1 };
+    q->cells = malloc(capacity * sizeof(struct mpmc_cell));
+    if (!q->cells) {
+        return 0;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        q->cells[i].seq = i;
+    }
+    return 1;
+}
+
+static inline void mpmc_destroy(mpmc_t *q) {
+    free(q->cells);
+}
+
+// Returns 0 if the queue is full.
+static inline int mpmc_push(mpmc_t *q, void *msg) {
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    struct mpmc_cell *cell;
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        intptr_t diff = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->msg = msg;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Returns 0 if the queue is empty.
+static inline int mpmc_pop(mpmc_t *q, void **msg) {
+    size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    struct mpmc_cell *cell;
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        intptr_t diff = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    *msg = cell->msg;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Reader-writer lock for read-mostly data. Readers only touch a counter
+// of their CPU's slot (one cache line each), so they do not contend
+// with readers on other CPUs; a writer raises a flag that turns new
+// readers away, then waits until every slot drains. Writers therefore
+// do not starve, and are serialized by a mutex.
+#define RWLOCK_SLOTS 64
+
+typedef struct {
+    struct {
+        _Alignas(CACHE_LINE) int readers;
+    } slots[RWLOCK_SLOTS];
+    _Alignas(CACHE_LINE) int writer;
+    mutex_t writers;
+} rwlock_t;
+
+static inline void rwlock_init(rwlock_t *rw) {
+    memset(rw, 0, sizeof(*rw));
+}
+
+static inline void rwlock_slot_release_(rwlock_t *rw, int slot) {
+    // The last reader of a slot wakes up a writer waiting for it.
+    if (__atomic_sub_fetch(&rw->slots[slot].readers, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&rw->writer, __ATOMIC_SEQ_CST)) {
+        futex_wake(&rw->slots[slot].readers, 1);
+    }
+}
+
+// Returns the slot to pass to rwlock_rdunlock(); the thread may have
+// moved to another CPU by then.
+static inline int rwlock_rdlock(rwlock_t *rw) {
+    int cpu = sched_getcpu();
+    int slot = (cpu > 0 ? cpu : 0) % RWLOCK_SLOTS;
+    while (1) {
+        __atomic_fetch_add(&rw->slots[slot].readers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&rw->writer, __ATOMIC_SEQ_CST)) {
+            return slot;
+        }
+        // A writer is in (or waiting): step back until it is done.
+        rwlock_slot_release_(rw, slot);
+        for (int spins = 0; __atomic_load_n(&rw->writer, __ATOMIC_ACQUIRE); spins++) {
+            if (spins < SPIN_LIMIT) {
+                cpu_relax();
+            } else {
+                futex_wait(&rw->writer, 1);
+            }
+        }
+    }
+}
+
+static inline void rwlock_rdunlock(rwlock_t *rw, int slot) {
+    rwlock_slot_release_(rw, slot);
+}
+
+static inline void rwlock_wrlock(rwlock_t *rw) {
+    mutex_lock(&rw->writers);
+    __atomic_store_n(&rw->writer, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < RWLOCK_SLOTS; i++) {
+        int n, spins = 0;
+        while ((n = __atomic_load_n(&rw->slots[i].readers, __ATOMIC_SEQ_CST)) != 0) {
+            if (spins++ < SPIN_LIMIT) {
+                cpu_relax();
+            } else {
+                futex_wait(&rw->slots[i].readers, n);
+            }
+        }
+    }
+}
+
+static inline void rwlock_wrunlock(rwlock_t *rw) {
+    __atomic_store_n(&rw->writer, 0, __ATOMIC_RELEASE);
+    futex_wake(&rw->writer, INT_MAX);
+    mutex_unlock(&rw->writers);
+}
+
+// Seqlock for small plain-data snapshots: readers never write shared
+// memory at all; they copy the data and retry if a writer was active
+// meanwhile (the sequence number is odd while writing, and changes).
+typedef struct {
+    int seq;
+    spinlock_t lock;  // between writers
+} seqlock_t;
+#define SEQLOCK_INIT() { 0, SPIN_INIT() }
+
+// Copy with relaxed atomic accesses: the copy may race with a writer
+// (and is then thrown away), which plain memcpy() must not.
+static inline void seqlock_copy_(void *dst, const void *src, size_t size) {
+    char *d = dst;
+    const char *s = src;
+    if (((uintptr_t)d | (uintptr_t)s) % sizeof(long) == 0) {
+        for (; size >= sizeof(long); size -= sizeof(long), d += sizeof(long), s += sizeof(long)) {
+            __atomic_store_n((long *)d, __atomic_load_n((const long *)s, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        }
+    }
+    for (; size > 0; size--, d++, s++) {
+        __atomic_store_n(d, __atomic_load_n(s, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+}
+
+// Take a consistent snapshot of size bytes at shared.
+static inline void seqlock_read(seqlock_t *sl, void *snapshot, const void *shared, size_t size) {
+    while (1) {
+        int seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            cpu_relax();
+            continue;
+        }
+        seqlock_copy_(snapshot, shared, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sl->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+}
+
+// Replace size bytes at shared with value.
+static inline void seqlock_write(seqlock_t *sl, void *shared, const void *value, size_t size) {
+    spin_lock(&sl->lock);
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    seqlock_copy_(shared, value, size);
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+    spin_unlock(&sl->lock);
+}
@@ -0,0 +1,6 @@
+#define _GNU_SOURCE
+#include "thread.h"
+
+// The thread pool state shared by every user of thread.h.
+struct pool pool_;
+__thread int pool_in_job_;
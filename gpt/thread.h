@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -72,3 +74,351 @@ __attribute__((constructor))
 static void startup() {
     atexit(join);
 }
+
+// ------------------------------------------------------------------------
+// Thread pool: persistent workers for data parallelism (fork-join).
+//
+//   static void scale(void *ctx, long begin, long end) {
+//     float *x = ctx;
+//     for (long i = begin; i < end; i++) x[i] *= 2;
+//   }
+//   parallel_for(0, n, 1024, scale, x);
+//
+// Workers are started on the first parallel_for() (one per CPU, counting
+// the caller, who works as well) and sleep between jobs. Each worker
+// owns a deque of index ranges: it splits its range in halves down to
+// grain, keeps working on one half and pushes the other, which idle
+// workers may steal from the opposite end.
+//
+// pool_start_pinned() instead pins one worker per physical core, so
+// workers keep their caches and results are repeatable across runs.
+
+#include "thread-sync.h"
+#include "topology.h"
+
+#define POOL_MAX_WORKERS 64
+#define POOL_DEQUE_SIZE  64  // enough for log2(n / grain) halves
+
+// Sense-reversing barrier: the last thread to arrive flips the sense,
+// releasing everyone waiting for it; the barrier is then ready for the
+// next round. Each thread keeps its own sense (initially 0).
+typedef struct {
+    int count;   // number of threads
+    int arrived;
+    int sense;
+} barrier_t;
+
+static inline void barrier_init(barrier_t *b, int count) {
+    *b = (barrier_t) { .count = count };
+}
+
+static inline void barrier_wait(barrier_t *b, int *local_sense) {
+    int sense = *local_sense = !*local_sense;
+    if (__atomic_add_fetch(&b->arrived, 1, __ATOMIC_ACQ_REL) == b->count) {
+        b->arrived = 0;
+        __atomic_store_n(&b->sense, sense, __ATOMIC_RELEASE);
+        futex_wake(&b->sense, INT_MAX);
+        return;
+    }
+    for (int spins = 0; __atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) != sense; spins++) {
+        if (spins < SPIN_LIMIT) {
+            cpu_relax();
+        } else {
+            futex_wait(&b->sense, !sense);
+        }
+    }
+}
+
+struct pool_range {
+    long begin, end;
+};
+
+// Owner pushes and pops at the bottom, thieves take from the top. top and
+// bottom change only under the lock, but thieves peek at them without.
+struct pool_deque {
+    spinlock_t lock;
+    int top, bottom;
+    struct pool_range ranges[POOL_DEQUE_SIZE];
+};
+
+struct pool_worker {
+    pthread_t thread;
+    int id;
+    int cpu;  // pinned to, or -1
+    int sense;
+    unsigned seed;
+    struct pool_deque deque;
+};
+
+// One pool per program: defined in thread.c so every file that includes
+// this header runs its parallel_for on the same workers.
+struct pool {
+    int nworkers;  // including the caller of parallel_for (worker 0)
+    struct pool_worker workers[POOL_MAX_WORKERS];
+    mutex_t lock;  // one parallel_for at a time
+    barrier_t done;
+    int generation;  // bumped for each job (and to stop)
+    int stop;
+
+    // The current job
+    void (*fn)(void *ctx, long begin, long end);
+    void *ctx;
+    long grain;
+    long pending;  // iterations not yet done
+    int progress;  // bumped (with a wake) on a push or the end of the job
+    int sleepers;  // workers parked on progress
+};
+
+extern struct pool pool_;
+extern __thread int pool_in_job_;  // running inside a job: nested loops go serial
+
+// Wake parked workers, if any, after making work (or the end of the job)
+// visible. Pairs with the sleepers/progress check in pool_park_().
+static inline void pool_notify_() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool_.sleepers, __ATOMIC_RELAXED) > 0) {
+        __atomic_fetch_add(&pool_.progress, 1, __ATOMIC_RELEASE);
+        futex_wake(&pool_.progress, INT_MAX);
+    }
+}
+
+static inline int pool_push_(struct pool_deque *d, struct pool_range r) {
+    spin_lock(&d->lock);
+    int ok = d->bottom - d->top < POOL_DEQUE_SIZE;
+    if (ok) {
+        d->ranges[d->bottom % POOL_DEQUE_SIZE] = r;
+        __atomic_store_n(&d->bottom, d->bottom + 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&d->lock);
+    if (ok) {
+        pool_notify_();
+    }
+    return ok;
+}
+
+static inline int pool_pop_(struct pool_deque *d, struct pool_range *r) {
+    spin_lock(&d->lock);
+    int ok = d->bottom > d->top;
+    if (ok) {
+        __atomic_store_n(&d->bottom, d->bottom - 1, __ATOMIC_RELAXED);
+        *r = d->ranges[d->bottom % POOL_DEQUE_SIZE];
+    }
+    spin_unlock(&d->lock);
+    return ok;
+}
+
+static inline int pool_steal_(struct pool_deque *d, struct pool_range *r) {
+    if (__atomic_load_n(&d->bottom, __ATOMIC_RELAXED) ==
+        __atomic_load_n(&d->top, __ATOMIC_RELAXED)) {
+        return 0;  // Don't take the lock of an empty deque.
+    }
+    spin_lock(&d->lock);
+    int ok = d->bottom > d->top;
+    if (ok) {
+        *r = d->ranges[d->top % POOL_DEQUE_SIZE];
+        __atomic_store_n(&d->top, d->top + 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&d->lock);
+    return ok;
+}
+
+static inline void pool_run_range_(struct pool_worker *w, struct pool_range r) {
+    while (r.end - r.begin > pool_.grain) {
+        long mid = r.begin + (r.end - r.begin) / 2;
+        if (!pool_push_(&w->deque, (struct pool_range) { mid, r.end })) {
+            break;
+        }
+        r.end = mid;
+    }
+    pool_.fn(pool_.ctx, r.begin, r.end);
+    if (__atomic_sub_fetch(&pool_.pending, r.end - r.begin, __ATOMIC_ACQ_REL) == 0) {
+        pool_notify_();
+    }
+}
+
+// Sleep until another worker pushes a range or the job is done. With
+// nothing to steal, the ranges left are running elsewhere, maybe on a
+// thread that waits for our CPU: spinning (or sched_yield(), which keeps
+// our fair share of it) would only slow that thread down.
+static inline void pool_park_() {
+    __atomic_fetch_add(&pool_.sleepers, 1, __ATOMIC_SEQ_CST);
+    int seen = __atomic_load_n(&pool_.progress, __ATOMIC_ACQUIRE);
+    int idle = __atomic_load_n(&pool_.pending, __ATOMIC_ACQUIRE) > 0;
+    for (int i = 0; i < pool_.nworkers && idle; i++) {
+        struct pool_deque *d = &pool_.workers[i].deque;
+        idle = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) ==
+               __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    }
+    if (idle) {
+        futex_wait(&pool_.progress, seen);
+    }
+    __atomic_fetch_sub(&pool_.sleepers, 1, __ATOMIC_RELAXED);
+}
+
+// Work on the current job until all of its iterations are done.
+static inline void pool_work_(struct pool_worker *w) {
+    struct pool_range r;
+    pool_in_job_ = 1;
+    for (int spins = 0; __atomic_load_n(&pool_.pending, __ATOMIC_ACQUIRE) > 0; ) {
+        if (pool_pop_(&w->deque, &r)) {
+            pool_run_range_(w, r);
+            spins = 0;
+            continue;
+        }
+        // Steal, starting from a random victim.
+        int n = pool_.nworkers, victim = rand_r(&w->seed) % n, found = 0;
+        for (int i = 0; i < n && !found; i++) {
+            struct pool_worker *v = &pool_.workers[(victim + i) % n];
+            found = v != w && pool_steal_(&v->deque, &r);
+        }
+        if (found) {
+            pool_run_range_(w, r);
+            spins = 0;
+        } else if (++spins < SPIN_LIMIT) {
+            cpu_relax();
+        } else {
+            spins = 0;
+            pool_park_();
+        }
+    }
+    pool_in_job_ = 0;
+}
+
+static inline void *pool_worker_main_(void *arg) {
+    struct pool_worker *w = arg;
+    int seen = 0;
+    while (1) {
+        // Wait for the next job.
+        for (int spins = 0; __atomic_load_n(&pool_.generation, __ATOMIC_ACQUIRE) == seen; spins++) {
+            if (spins < SPIN_LIMIT) {
+                cpu_relax();
+            } else {
+                futex_wait(&pool_.generation, seen);
+            }
+        }
+        seen = __atomic_load_n(&pool_.generation, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&pool_.stop, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        pool_work_(w);
+        barrier_wait(&pool_.done, &w->sense);
+    }
+}
+
+static inline void pool_start_(int nworkers, const int *cpus) {
+    pool_.nworkers = nworkers;
+    pool_.stop = 0;
+    barrier_init(&pool_.done, nworkers);
+    for (int i = 0; i < nworkers; i++) {
+        struct pool_worker *w = &pool_.workers[i];
+        *w = (struct pool_worker) { .id = i, .cpu = cpus ? cpus[i] : -1, .seed = i + 1 };
+        if (i == 0) {
+            if (w->cpu >= 0) {
+                topo_pin(w->cpu);
+            }
+            continue;
+        }
+        // Pinned from the start: the thread never runs anywhere else.
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (w->cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        pthread_create(&w->thread, &attr, pool_worker_main_, w);
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// Start the pool with nworkers threads in total (including the caller);
+// 0 means one per online CPU.
+static inline void pool_start(int nworkers) {
+    if (nworkers <= 0) {
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nworkers > POOL_MAX_WORKERS) {
+        nworkers = POOL_MAX_WORKERS;
+    }
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    pool_start_(nworkers, NULL);
+}
+
+// Start the pool with one worker per physical core we may run on, each
+// pinned to it, placed by order; the caller is pinned as worker 0. Falls
+// back to pool_start(0) if the topology is unknown.
+static inline void pool_start_pinned(enum topo_order order) {
+    static struct topology topo;
+    int cpus[POOL_MAX_WORKERS];
+    if (topo_load(&topo) < 0) {
+        pool_start(0);
+        return;
+    }
+    int n = topo.ncores < POOL_MAX_WORKERS ? topo.ncores : POOL_MAX_WORKERS;
+    pool_start_(topo_placement(&topo, order, cpus, n), cpus);
+}
+
+// Stop and join all workers.
+static inline void pool_stop() {
+    if (pool_.nworkers == 0) {
+        return;
+    }
+    __atomic_store_n(&pool_.stop, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&pool_.generation, 1, __ATOMIC_RELEASE);
+    futex_wake(&pool_.generation, INT_MAX);
+    for (int i = 1; i < pool_.nworkers; i++) {
+        pthread_join(pool_.workers[i].thread, NULL);
+    }
+    pool_.nworkers = 0;
+    pool_.generation = 0;
+}
+
+// Call fn(ctx, lo, hi) on disjoint ranges covering [begin, end), each at
+// most grain long (unless a deque is full), from all workers; returns
+// when all are done. Called from inside fn, it just runs serially.
+static inline void parallel_for(long begin, long end, long grain,
+                                void (*fn)(void *ctx, long begin, long end), void *ctx) {
+    if (end <= begin) {
+        return;
+    }
+    if (pool_in_job_) {
+        fn(ctx, begin, end);
+        return;
+    }
+
+    mutex_lock(&pool_.lock);
+    if (pool_.nworkers == 0) {
+        pool_start(0);
+    }
+    int n = pool_.nworkers;
+    if (n == 1 || end - begin <= grain) {
+        mutex_unlock(&pool_.lock);
+        fn(ctx, begin, end);
+        return;
+    }
+
+    pool_.fn = fn;
+    pool_.ctx = ctx;
+    pool_.grain = grain > 0 ? grain : 1;
+    pool_.pending = end - begin;
+
+    // Hand every worker an equal share to start with.
+    for (int i = 0; i < n; i++) {
+        struct pool_deque *d = &pool_.workers[i].deque;
+        long lo = begin + (end - begin) * i / n, hi = begin + (end - begin) * (i + 1) / n;
+        d->top = d->bottom = 0;
+        if (hi > lo) {
+            pool_push_(d, (struct pool_range) { lo, hi });
+        }
+    }
+
+    __atomic_fetch_add(&pool_.generation, 1, __ATOMIC_RELEASE);
+    futex_wake(&pool_.generation, INT_MAX);
+
+    pool_work_(&pool_.workers[0]);
+    barrier_wait(&pool_.done, &pool_.workers[0].sense);
+    mutex_unlock(&pool_.lock);
+}
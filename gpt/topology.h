@@ -0,0 +1,288 @@
+#pragma once
+
+// CPU topology from sysfs (/sys/devices/system/cpu), for placing threads:
+// which CPUs are SMT siblings of one physical core, which cores share a
+// last-level cache, and which NUMA node each belongs to.
+//
+//   struct topology topo;
+//   int cpus[8];
+//   topo_load(&topo);
+//   int n = topo_placement(&topo, TOPO_COMPACT, cpus, 8);
+//   // pin thread i to cpus[i] (i < n), e.g., with topo_pin()
+//
+// Needs _GNU_SOURCE (cpu_set_t, pthread_setaffinity_np).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define TOPO_SYSFS "/sys/devices/system/cpu"
+#define TOPO_MAX_CPUS CPU_SETSIZE
+
+struct topo_cpu {
+    int cpu;   // CPU number, as in sched_setaffinity()
+    int core;  // physical core; the ids below are dense: 0, 1, ...
+    int smt;   // 0 for the first hardware thread of its core, 1, ...
+    int llc;   // group of CPUs sharing the last-level cache
+    int node;  // NUMA node
+};
+
+struct topology {
+    int ncpus, ncores, nllcs, nnodes;
+    struct topo_cpu cpus[TOPO_MAX_CPUS];  // by ascending CPU number
+};
+
+enum topo_order {
+    TOPO_COMPACT,  // neighbours share caches: fill an LLC, then the next
+    TOPO_SCATTER,  // spread over LLCs and nodes for cache capacity and bandwidth
+};
+
+static inline int topo_read_(char *buf, int size, const char *fmt, ...) {
+    char path[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(path, sizeof(path), fmt, ap);
+    va_end(ap);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    buf[0] = '\0';
+    int ok = fgets(buf, size, fp) != NULL;
+    fclose(fp);
+    buf[strcspn(buf, "\n")] = '\0';
+    return ok ? 0 : -1;
+}
+
+// Parse a CPU list like "0-3,8,10-11" into set; returns the number of
+// CPUs, or -1 if malformed.
+static inline int topo_parse_cpulist(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s) {
+                return -1;
+            }
+        }
+        if (lo < 0 || hi < lo || hi >= TOPO_MAX_CPUS) {
+            return -1;
+        }
+        for (long cpu = lo; cpu <= hi; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        s = end;
+        if (*s == ',') {
+            s++;
+        } else if (*s) {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set);
+}
+
+// The lowest CPU in the list file, which names the group it describes.
+static inline int topo_first_cpu_(const char *path, int cpu) {
+    char buf[4096];
+    cpu_set_t set;
+    if (topo_read_(buf, sizeof(buf), path, cpu) < 0 || topo_parse_cpulist(buf, &set) <= 0) {
+        return cpu;  // a group of its own
+    }
+    for (int i = 0; i < TOPO_MAX_CPUS; i++) {
+        if (CPU_ISSET(i, &set)) {
+            return i;
+        }
+    }
+    return cpu;
+}
+
+// The highest-level data or unified cache shared by cpu.
+static inline int topo_llc_of_(const char *root, int cpu) {
+    char buf[64], path[512];
+    int best_level = 0, llc = cpu;
+    for (int i = 0; ; i++) {
+        if (topo_read_(buf, sizeof(buf), "%s/cpu%d/cache/index%d/level", root, cpu, i) < 0) {
+            break;
+        }
+        int level = atoi(buf);
+        if (topo_read_(buf, sizeof(buf), "%s/cpu%d/cache/index%d/type", root, cpu, i) == 0 &&
+            strcmp(buf, "Instruction") == 0) {
+            continue;
+        }
+        if (level > best_level) {
+            best_level = level;
+            snprintf(path, sizeof(path), "%s/cpu%%d/cache/index%d/shared_cpu_list", root, i);
+            llc = topo_first_cpu_(path, cpu);
+        }
+    }
+    return llc;
+}
+
+// cpuN has a "nodeM" link for its NUMA node.
+static inline int topo_node_of_(const char *root, int cpu) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/cpu%d", root, cpu);
+    DIR *dir = opendir(path);
+    int node = 0;
+    if (dir) {
+        struct dirent *d;
+        while ((d = readdir(dir)) != NULL) {
+            if (strncmp(d->d_name, "node", 4) == 0 && d->d_name[4] >= '0' && d->d_name[4] <= '9') {
+                node = atoi(d->d_name + 4);
+                break;
+            }
+        }
+        closedir(dir);
+    }
+    return node;
+}
+
+// Replace raw ids (e.g., a group's first CPU) with 0, 1, ... in order of
+// appearance; returns the number of distinct ids.
+static inline int topo_dense_ids_(const int *raw, int *ids, int n) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        ids[i] = -1;
+        for (int j = 0; j < i && ids[i] < 0; j++) {
+            if (raw[j] == raw[i]) {
+                ids[i] = ids[j];
+            }
+        }
+        if (ids[i] < 0) {
+            ids[i] = count++;
+        }
+    }
+    return count;
+}
+
+// Load the topology under root for the CPUs in allowed (all online CPUs
+// if NULL). Returns 0, or -1 if no CPU is found.
+static inline int topo_load_from(struct topology *t, const char *root, const cpu_set_t *allowed) {
+    char buf[4096];
+    cpu_set_t online;
+    if (topo_read_(buf, sizeof(buf), "%s/online", root) < 0 || topo_parse_cpulist(buf, &online) <= 0) {
+        return -1;
+    }
+    if (allowed) {
+        CPU_AND(&online, &online, allowed);
+    }
+
+    // Raw ids first: the lowest CPU of the group, or the node number.
+    char path[512];
+    int raw_core[TOPO_MAX_CPUS], raw_llc[TOPO_MAX_CPUS], raw_node[TOPO_MAX_CPUS];
+    t->ncpus = 0;
+    for (int cpu = 0; cpu < TOPO_MAX_CPUS; cpu++) {
+        if (!CPU_ISSET(cpu, &online)) {
+            continue;
+        }
+        int i = t->ncpus++;
+        t->cpus[i] = (struct topo_cpu) { .cpu = cpu };
+        snprintf(path, sizeof(path), "%s/cpu%%d/topology/core_cpus_list", root);
+        raw_core[i] = topo_first_cpu_(path, cpu);
+        if (raw_core[i] == cpu) {
+            // Older kernels only have the deprecated name.
+            snprintf(path, sizeof(path), "%s/cpu%%d/topology/thread_siblings_list", root);
+            raw_core[i] = topo_first_cpu_(path, cpu);
+        }
+        raw_llc[i] = topo_llc_of_(root, cpu);
+        raw_node[i] = topo_node_of_(root, cpu);
+    }
+    if (t->ncpus == 0) {
+        return -1;
+    }
+
+    int core[TOPO_MAX_CPUS], llc[TOPO_MAX_CPUS], node[TOPO_MAX_CPUS];
+    t->ncores = topo_dense_ids_(raw_core, core, t->ncpus);
+    t->nllcs = topo_dense_ids_(raw_llc, llc, t->ncpus);
+    t->nnodes = topo_dense_ids_(raw_node, node, t->ncpus);
+    for (int i = 0; i < t->ncpus; i++) {
+        t->cpus[i].core = core[i];
+        t->cpus[i].llc = llc[i];
+        t->cpus[i].node = node[i];
+    }
+    for (int i = 0; i < t->ncpus; i++) {
+        for (int j = 0; j < i; j++) {
+            t->cpus[i].smt += t->cpus[j].core == t->cpus[i].core;
+        }
+    }
+    return 0;
+}
+
+// The CPUs this process may run on.
+static inline int topo_load(struct topology *t) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return topo_load_from(t, TOPO_SYSFS, NULL);
+    }
+    return topo_load_from(t, TOPO_SYSFS, &allowed);
+}
+
+static inline int topo_key_cmp_(const int *a, const int *b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Choose CPUs for n threads: one per physical core first (in order),
+// SMT siblings only when all cores are taken. Fills cpus[] and returns
+// how many were chosen (at most n and ncpus).
+static inline int topo_placement(const struct topology *t, enum topo_order order, int *cpus, int n) {
+    // Sort keys, most significant first.
+    enum { K = 4 };
+    int keys[TOPO_MAX_CPUS][K], idx[TOPO_MAX_CPUS];
+    for (int i = 0; i < t->ncpus; i++) {
+        const struct topo_cpu *c = &t->cpus[i];
+        int rank = 0;  // of the core within its LLC
+        for (int j = 0; j < t->ncpus; j++) {
+            const struct topo_cpu *d = &t->cpus[j];
+            rank += d->smt == 0 && d->llc == c->llc && d->core < c->core;
+        }
+        if (order == TOPO_SCATTER) {
+            int spread[K] = { c->smt, rank, c->node, c->llc };
+            memcpy(keys[i], spread, sizeof(spread));
+        } else {
+            int compact[K] = { c->smt, c->node, c->llc, c->core };
+            memcpy(keys[i], compact, sizeof(compact));
+        }
+        idx[i] = i;
+    }
+
+    // Insertion sort, stable: ties keep ascending CPU numbers.
+    for (int i = 1; i < t->ncpus; i++) {
+        int x = idx[i], j = i;
+        while (j > 0 && topo_key_cmp_(keys[idx[j - 1]], keys[x], K) > 0) {
+            idx[j] = idx[j - 1];
+            j--;
+        }
+        idx[j] = x;
+    }
+    if (n > t->ncpus) {
+        n = t->ncpus;
+    }
+    for (int i = 0; i < n; i++) {
+        cpus[i] = t->cpus[idx[i]].cpu;
+    }
+    return n;
+}
+
+// Pin the calling thread to one CPU.
+static inline int topo_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
@@ -4,32 +4,11 @@
 import argparse
 import curses
 import os
-import subprocess
 import sys
 import tempfile
 import shutil
-from pathlib import Path
 
-
-def find_labyrinth_executable():
-    current_dir = Path.cwd()
-
-    # Search upward
-    dir_to_check = current_dir
-    while dir_to_check != dir_to_check.parent:  # Until reaching root directory
-        executable = dir_to_check / "labyrinth"
-        if executable.exists() and os.access(executable, os.X_OK):
-            return executable
-        dir_to_check = dir_to_check.parent
-
-    # Recursively search downward
-    for root, dirs, files in os.walk(current_dir):
-        if "labyrinth" in files:
-            executable = Path(root) / "labyrinth"
-            if os.access(executable, os.X_OK):
-                return executable
-
-    return None
+from labyrinth_process import LabyrinthProcess, find_labyrinth_executable
 
 
 def run_game(stdscr, map_file):
@@ -43,8 +22,9 @@ def run_game(stdscr, map_file):
         print("Error: Map must contain positions for players 0 and 1")
         return
 
-    # Create temporary map file
+    # Create temporary map file and start the game server on it
     temp_map_file = create_temp_map_file(map_file)
+    game = LabyrinthProcess(labyrinth_path, temp_map_file)
 
     curses.curs_set(0)  # Hide cursor
     stdscr.clear()
@@ -54,7 +34,7 @@ def run_game(stdscr, map_file):
     player2_id = 1
 
     # Get initial map state
-    map_state = get_map_state(labyrinth_path, temp_map_file)
+    map_state = game.state()
 
     # Display initial map and controls
     display_map(stdscr, map_state)
@@ -71,30 +51,30 @@ def run_game(stdscr, map_file):
 
         # Player 1 controls (WASD)
         if key == ord("w"):
-            move_player(labyrinth_path, temp_map_file, player1_id, "up")
+            game.move(player1_id, "up")
         elif key == ord("a"):
-            move_player(labyrinth_path, temp_map_file, player1_id, "left")
+            game.move(player1_id, "left")
         elif key == ord("s"):
-            move_player(labyrinth_path, temp_map_file, player1_id, "down")
+            game.move(player1_id, "down")
         elif key == ord("d"):
-            move_player(labyrinth_path, temp_map_file, player1_id, "right")
+            game.move(player1_id, "right")
 
         # Player 2 controls (HJKL)
         elif key == ord("k"):
-            move_player(labyrinth_path, temp_map_file, player2_id, "up")
+            game.move(player2_id, "up")
         elif key == ord("h"):
-            move_player(labyrinth_path, temp_map_file, player2_id, "left")
+            game.move(player2_id, "left")
         elif key == ord("j"):
-            move_player(labyrinth_path, temp_map_file, player2_id, "down")
+            game.move(player2_id, "down")
         elif key == ord("l"):
-            move_player(labyrinth_path, temp_map_file, player2_id, "right")
+            game.move(player2_id, "right")
 
         # Exit game
         elif key == ord("q"):
             break
 
         # Update map state and display
-        map_state = get_map_state(labyrinth_path, temp_map_file)
+        map_state = game.state()
         display_map(stdscr, map_state)
 
         # Redisplay control instructions
@@ -103,7 +83,8 @@ def run_game(stdscr, map_file):
         stdscr.addstr(len(map_state) + 4, 0, "Press Q to quit")
         stdscr.refresh()
 
-    # Clean up temporary files
+    # Stop the game server and clean up temporary files
+    game.close()
     try:
         os.unlink(temp_map_file)
     except:
@@ -119,21 +100,6 @@ def create_temp_map_file(original_map_file):
     return temp_path
 
 
-def get_map_state(labyrinth_path, map_file):
-    print(f"Executing command: {labyrinth_path} --map {map_file} --player 0")
-    result = subprocess.run([str(labyrinth_path), "--map", map_file, "--player", "0"], capture_output=True, text=True)
-    if result.returncode != 0:
-        print(f"Error: {result.stderr}")
-    return result.stdout.strip().split("\n")
-
-
-def move_player(labyrinth_path, map_file, player_id, direction):
-    print(f"Executing command: {labyrinth_path} --map {map_file} --player {player_id} --move {direction}")
-    result = subprocess.run([str(labyrinth_path), "--map", map_file, "--player", str(player_id), "--move", direction], capture_output=True, text=True)
-    if result.returncode != 0:
-        print(f"Movement error: {result.stderr}")
-
-
 def display_map(stdscr, map_state):
     stdscr.clear()
     for i, line in enumerate(map_state):
@@ -0,0 +1,127 @@
+"""Running the labyrinth game server for the frontends (hotseat.py, online.py).
+
+`labyrinth --serve` keeps the map in memory and answers line commands:
+"move <id> <direction>" and "state". It talks either over its stdin/stdout
+(one client) or, with --socket, over a Unix socket (one connection per
+client, handled concurrently).
+"""
+
+import os
+import socket
+import subprocess
+import time
+from pathlib import Path
+
+
+def find_labyrinth_executable():
+    current_dir = Path.cwd()
+
+    # Search upward
+    dir_to_check = current_dir
+    while dir_to_check != dir_to_check.parent:  # Until reaching root directory
+        executable = dir_to_check / "labyrinth"
+        if executable.exists() and os.access(executable, os.X_OK):
+            return executable
+        dir_to_check = dir_to_check.parent
+
+    # Recursively search downward
+    for root, dirs, files in os.walk(current_dir):
+        if "labyrinth" in files:
+            executable = Path(root) / "labyrinth"
+            if os.access(executable, os.X_OK):
+                return executable
+
+    return None
+
+
+class LabyrinthSession:
+    """The command protocol, over a pair of line-buffered text files."""
+
+    def __init__(self, reader, writer):
+        self.reader = reader
+        self.writer = writer
+
+    def command(self, line):
+        self.writer.write(line + "\n")
+        self.writer.flush()
+        return self.reader.readline().strip()
+
+    def move(self, player_id, direction):
+        return self.command(f"move {player_id} {direction}") == "ok"
+
+    def state(self):
+        header = self.command("state").split()
+        if len(header) != 3 or header[0] != "map":
+            return []
+        return [self.reader.readline().rstrip("\n") for _ in range(int(header[1]))]
+
+
+class LabyrinthConnection(LabyrinthSession):
+    """One session with a `--serve --socket` server; the players it moves
+    are its own until it is closed."""
+
+    def __init__(self, socket_path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(socket_path)
+        self.file = self.sock.makefile("rw", buffering=1)
+        super().__init__(self.file, self.file)
+
+    def close(self):
+        try:
+            self.command("quit")
+        except Exception:
+            pass
+        self.file.close()
+        self.sock.close()
+
+
+class LabyrinthProcess(LabyrinthSession):
+    """A long-running `labyrinth --serve` process holding the map in memory.
+
+    Without socket_path, commands go over the process's stdin/stdout.
+    With it, the process serves a Unix socket instead, and every client
+    gets its own connection from connect().
+    """
+
+    def __init__(self, labyrinth_path, map_file, socket_path=None):
+        self.socket_path = socket_path
+        args = [str(labyrinth_path), "--map", map_file, "--serve"]
+        if socket_path is None:
+            self.proc = subprocess.Popen(
+                args, stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True, bufsize=1
+            )
+            super().__init__(self.proc.stdout, self.proc.stdin)
+            return
+
+        self.proc = subprocess.Popen(args + ["--socket", socket_path])
+        deadline = time.time() + 5.0
+        while not os.path.exists(socket_path):
+            if self.proc.poll() is not None or time.time() > deadline:
+                raise RuntimeError("labyrinth server did not start")
+            time.sleep(0.01)
+
+    def command(self, line):
+        if self.socket_path is not None:
+            raise RuntimeError("a socket server takes commands over connect()")
+        return super().command(line)
+
+    def connect(self):
+        if self.socket_path is None:
+            raise RuntimeError("not serving a socket")
+        return LabyrinthConnection(self.socket_path)
+
+    def close(self):
+        if self.socket_path is None:
+            try:
+                self.command("quit")
+                self.proc.wait(timeout=2.0)
+            except Exception:
+                self.proc.kill()
+            return
+
+        # SIGTERM makes the server save the map and exit
+        self.proc.terminate()
+        try:
+            self.proc.wait(timeout=2.0)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
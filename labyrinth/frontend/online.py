@@ -4,14 +4,14 @@
 
 import argparse
 import os
-import subprocess
 import sys
 import tempfile
 import shutil
 import socket
 import threading
 import time
-from pathlib import Path
+
+from labyrinth_process import LabyrinthProcess, find_labyrinth_executable
 
 try:
     import paramiko
@@ -21,27 +21,6 @@ except ImportError:
     sys.exit(1)
 
 
-def find_labyrinth_executable():
-    current_dir = Path.cwd()
-
-    # Search upward
-    dir_to_check = current_dir
-    while dir_to_check != dir_to_check.parent:  # Until reaching root directory
-        executable = dir_to_check / "labyrinth"
-        if executable.exists() and os.access(executable, os.X_OK):
-            return executable
-        dir_to_check = dir_to_check.parent
-
-    # Recursively search downward
-    for root, dirs, files in os.walk(current_dir):
-        if "labyrinth" in files:
-            executable = Path(root) / "labyrinth"
-            if os.access(executable, os.X_OK):
-                return executable
-
-    return None
-
-
 class LabyrinthServer(paramiko.ServerInterface):
     def __init__(self, map_file):
         self.map_file = map_file
@@ -57,6 +36,11 @@ class LabyrinthServer(paramiko.ServerInterface):
             print("Error: Could not find labyrinth executable")
             sys.exit(1)
 
+        # One game process for all players, one connection per player;
+        # self.lock only guards the player table
+        self.socket_path = self.temp_map_file + ".sock"
+        self.game = LabyrinthProcess(self.labyrinth_path, self.temp_map_file, self.socket_path)
+
         print(f"Available player positions in map: {self.available_player_ids}")
 
     def get_available_player_ids(self):
@@ -101,21 +85,8 @@ def create_temp_map_file(original_map_file):
     return temp_path
 
 
-def get_map_state(labyrinth_path, map_file):
-    result = subprocess.run([str(labyrinth_path), "--map", map_file, "--player", "0"], capture_output=True, text=True)
-    if result.returncode != 0:
-        print(f"Error getting map state: {result.stderr}")
-    return result.stdout.strip().split("\n")
-
-
-def move_player(labyrinth_path, map_file, player_id, direction):
-    result = subprocess.run([str(labyrinth_path), "--map", map_file, "--player", str(player_id), "--move", direction], capture_output=True, text=True)
-    if result.returncode != 0:
-        print(f"Error moving player {player_id}: {result.stderr}")
-    return result.returncode == 0
-
-
 def handle_client(client, server, addr, shutdown_flag):
+    game = None
     try:
         transport = paramiko.Transport(client)
         host_key = paramiko.RSAKey.generate(2048)
@@ -157,9 +128,11 @@ def handle_client(client, server, addr, shutdown_flag):
         channel.send(f"Welcome to Labyrinth Online! You are player {player_id}.\r\n")
         channel.send("Use WASD keys to move. Press Q to quit.\r\n\r\n")
 
+        # A connection of our own, so our moves never wait for other players
+        game = server.game.connect()
+
         # Get initial map state and display it
-        with server.lock:
-            current_map_state = get_map_state(server.labyrinth_path, server.temp_map_file)
+        current_map_state = game.state()
 
         # Display initial map
         display_map(channel, current_map_state)
@@ -175,8 +148,7 @@ def handle_client(client, server, addr, shutdown_flag):
                 # Check if map has changed due to other players
                 if not shutdown_flag.is_set():  # Only check if not shutting down
                     try:
-                        with server.lock:
-                            new_map_state = get_map_state(server.labyrinth_path, server.temp_map_file)
+                        new_map_state = game.state()
 
                         # Only update if the map has changed
                         if new_map_state != current_map_state:
@@ -200,22 +172,20 @@ def handle_client(client, server, addr, shutdown_flag):
                 # Process movement
                 moved = False
                 if not shutdown_flag.is_set():  # Only process if not shutting down
-                    with server.lock:
-                        if key == "w":
-                            moved = move_player(server.labyrinth_path, server.temp_map_file, player_id, "up")
-                        elif key == "a":
-                            moved = move_player(server.labyrinth_path, server.temp_map_file, player_id, "left")
-                        elif key == "s":
-                            moved = move_player(server.labyrinth_path, server.temp_map_file, player_id, "down")
-                        elif key == "d":
-                            moved = move_player(server.labyrinth_path, server.temp_map_file, player_id, "right")
-                        elif key == "q":
-                            break
+                    if key == "w":
+                        moved = game.move(player_id, "up")
+                    elif key == "a":
+                        moved = game.move(player_id, "left")
+                    elif key == "s":
+                        moved = game.move(player_id, "down")
+                    elif key == "d":
+                        moved = game.move(player_id, "right")
+                    elif key == "q":
+                        break
 
                     # Update map state if player moved
                     if moved:
-                        with server.lock:
-                            current_map_state = get_map_state(server.labyrinth_path, server.temp_map_file)
+                        current_map_state = game.state()
                         display_map(channel, current_map_state)
             except Exception as e:
                 if not shutdown_flag.is_set():  # Only print if not shutting down
@@ -233,6 +203,8 @@ def handle_client(client, server, addr, shutdown_flag):
         if not shutdown_flag.is_set():  # Only print if not shutting down
             print(f"Error handling client: {e}")
     finally:
+        if game:
+            game.close()
         try:
             # Remove player from active players
             with server.lock:
@@ -331,7 +303,8 @@ def main():
         for thread in active_threads:
             thread.join(timeout=2.0)  # Wait up to 2 seconds for each thread
 
-        # Remove temporary file
+        # Stop the game server and remove temporary file
+        server.game.close()
         try:
             if os.path.exists(temp_map_file):
                 os.unlink(temp_map_file)
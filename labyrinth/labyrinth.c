@@ -2,8 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
 #include <assert.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
 #include <testkit.h>
 #include "labyrinth.h"
 
@@ -11,11 +26,29 @@ int main(int argc, char *argv[]) {
     char *mapFile = NULL;
     char playerId = '\0';
     char *moveDirection = NULL;
+    bool serve = false;
+    char *movesFile = NULL;
+    bool report = false;
+    char *pathTo = NULL;
+    char *socketPath = NULL;
+    char *generate = NULL;
+    char *algo = "dfs";
+    uint64_t seed = 1;
+    char *benchmark = NULL;
     
     static struct option long_options[] = {
         {"map",     required_argument, 0, 'm'},
         {"player",  required_argument, 0, 'p'},
         {"move",    required_argument, 0, 'x'},
+        {"serve",   no_argument,       0, 's'},
+        {"moves",   required_argument, 0, 'b'},
+        {"report",  no_argument,       0, 'r'},
+        {"path-to", required_argument, 0, 't'},
+        {"socket",  required_argument, 0, 'u'},
+        {"generate", required_argument, 0, 'g'},
+        {"algo",    required_argument, 0, 'a'},
+        {"seed",    required_argument, 0, 'e'},
+        {"benchmark", required_argument, 0, 'k'},
         {"version", no_argument,       0, 'v'},
         {0,         0,                 0,  0 }
     };
@@ -34,6 +67,33 @@ int main(int argc, char *argv[]) {
             case 'x':
                 moveDirection = optarg;
                 break;
+            case 's':
+                serve = true;
+                break;
+            case 'b':
+                movesFile = optarg;
+                break;
+            case 'r':
+                report = true;
+                break;
+            case 't':
+                pathTo = optarg;
+                break;
+            case 'u':
+                socketPath = optarg;
+                break;
+            case 'g':
+                generate = optarg;
+                break;
+            case 'a':
+                algo = optarg;
+                break;
+            case 'e':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                benchmark = optarg;
+                break;
             case 'v':
                 if (argc > 2) {
                     printf("Error: --version option cannot be combined with other options.\n");
@@ -51,6 +111,64 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    // Benchmark mode: generate, load, validate, move and render mazes
+    if (benchmark) {
+        return runBenchmark(benchmark);
+    }
+
+    // Generator mode: write a new connected maze to the map file
+    if (generate) {
+        int rows, cols;
+        char extra;
+        MazeAlgorithm method = parseMazeAlgorithm(algo);
+        if (!mapFile || playerId || method == MAZE_INVALID ||
+            sscanf(generate, "%dx%d%c", &rows, &cols, &extra) != 2) {
+            printUsage();
+            return 1;
+        }
+        Labyrinth labyrinth;
+        if (!generateMaze(&labyrinth, rows, cols, method, seed)) {
+            printf("Error: Failed to generate a %s maze.\n", generate);
+            return 1;
+        }
+        bool ok = saveMap(&labyrinth, mapFile);
+        freeMap(&labyrinth);
+        if (!ok) {
+            printf("Error: Failed to save map to %s.\n", mapFile);
+            return 1;
+        }
+        return 0;
+    }
+
+    // Serve mode: keep the map in memory and take commands from stdin,
+    // or from any number of clients on a Unix socket
+    if (serve || socketPath) {
+        if (!serve || !mapFile || playerId || moveDirection) {
+            printUsage();
+            return 1;
+        }
+        Labyrinth labyrinth;
+        if (!loadMap(&labyrinth, mapFile)) {
+            printf("Error: Failed to load map from %s.\n", mapFile);
+            return 1;
+        }
+        if (socketPath) {
+            return serveSocket(&labyrinth, mapFile, socketPath);
+        }
+        bool ok = serveGame(&labyrinth, mapFile, stdin, stdout);
+        freeMap(&labyrinth);
+        return ok ? 0 : 1;
+    }
+
+    // Batch mode: apply a whole move script in memory
+    if (movesFile) {
+        if (!mapFile || playerId || moveDirection || serve) {
+            printUsage();
+            return 1;
+        }
+        return runBatch(mapFile, movesFile, report);
+    }
+
     // Check for required parameters
     if (!mapFile || !playerId) {
         printUsage();
@@ -75,15 +193,33 @@ int main(int argc, char *argv[]) {
     
     // If player is not on the map, place them in the first empty space
     if (playerPos.row == -1 && playerPos.col == -1) {
-        playerPos = findFirstEmptySpace(&labyrinth);
-        if (playerPos.row != -1 && playerPos.col != -1) {
-            labyrinth.map[playerPos.row][playerPos.col] = playerId;
-        } else {
+        playerPos = placePlayer(&labyrinth, playerId);
+        if (playerPos.row == -1 || playerPos.col == -1) {
             printf("Error: No empty space to place player.\n");
             return 1;
         }
     }
     
+    // Path query: print a shortest path from the player to ROW,COL
+    if (pathTo) {
+        Position target;
+        char extra;
+        if (moveDirection || sscanf(pathTo, "%d,%d%c", &target.row, &target.col, &extra) != 2) {
+            printUsage();
+            return 1;
+        }
+        PathFinder finder = {0};
+        long len = findPath(&finder, &labyrinth, playerPos, target);
+        if (len < 0) {
+            printf("Error: No path to %d,%d.\n", target.row, target.col);
+            return 1;
+        }
+        printf("path %ld %s\n", len, finder.path);
+        freePathFinder(&finder);
+        freeMap(&labyrinth);
+        return 0;
+    }
+
     // If a move direction is specified, move the player
     if (moveDirection) {
         if (!movePlayer(&labyrinth, playerId, moveDirection)) {
@@ -99,9 +235,8 @@ int main(int argc, char *argv[]) {
     }
     
     // Print the map
-    for (int i = 0; i < labyrinth.rows; i++) {
-        printf("%s\n", labyrinth.map[i]);
-    }
+    printMap(&labyrinth, stdout);
+    freeMap(&labyrinth);
     
     return 0;
 }
@@ -111,6 +246,11 @@ void printUsage() {
     printf("  labyrinth --map map.txt --player id\n");
     printf("  labyrinth -m map.txt -p id\n");
     printf("  labyrinth --map map.txt --player id --move direction\n");
+    printf("  labyrinth --map map.txt --serve [--socket path]\n");
+    printf("  labyrinth --map map.txt --moves script.txt [--report]\n");
+    printf("  labyrinth --map map.txt --player id --path-to row,col\n");
+    printf("  labyrinth --map map.txt --generate RxC [--algo dfs|cave] [--seed n]\n");
+    printf("  labyrinth --benchmark 100,1000,10000\n");
     printf("  labyrinth --version\n");
 }
 
@@ -118,94 +258,231 @@ bool isValidPlayer(char playerId) {
     return playerId >= '0' && playerId <= '9';
 }
 
-bool loadMap(Labyrinth *labyrinth, const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
+// Wall layouts are numbered process-wide, so a cache keyed on the number
+// can tell two maps apart even if one reuses the other's buffer
+static uint64_t nextGeneration(void) {
+    static uint64_t generation;
+    return __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+}
+
+// Allocate a rows x cols map filled with walls (including the border)
+bool allocMap(Labyrinth *labyrinth, int rows, int cols) {
+    if (rows < 0 || cols < 0 || cols > INT_MAX - 2 * MAP_ALIGN) {
         return false;
     }
-    
-    char line[MAX_COLS + 2]; // +2 to leave space for newline and null terminator
-    int row = 0;
-    int expectedCols = -1;
-    
-    while (fgets(line, sizeof(line), file) && row < MAX_ROWS) {
-        // Remove newline character
-        size_t len = strlen(line);
-        if (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
-            line[--len] = '\0';
+    int stride = (cols + 2 + MAP_ALIGN - 1) / MAP_ALIGN * MAP_ALIGN;
+    size_t size = ((size_t)rows + 2) * stride;
+    char *cells = aligned_alloc(MAP_ALIGN, size);
+    uint64_t *dirty = calloc(((size_t)rows * cols + 63) / 64 + 1, sizeof(uint64_t));
+    if (!cells || !dirty) {
+        free(cells);
+        free(dirty);
+        return false;
+    }
+    memset(cells, '#', size);
+
+    labyrinth->cells = cells;
+    labyrinth->rows = rows;
+    labyrinth->cols = cols;
+    labyrinth->stride = stride;
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        labyrinth->players[i] = (Position){-1, -1};
+    }
+    labyrinth->freeCursor = 0;
+    labyrinth->conn = (Connectivity){0};
+    labyrinth->file = (MapFile){ .size = -1, .dirty = dirty };
+    labyrinth->claimed = 0;
+    labyrinth->generation = nextGeneration();
+    return true;
+}
+
+void freeMap(Labyrinth *labyrinth) {
+    invalidateConnectivity(labyrinth);
+    free(labyrinth->cells);
+    free(labyrinth->file.dirty);
+    labyrinth->cells = NULL;
+    labyrinth->file.dirty = NULL;
+    labyrinth->rows = labyrinth->cols = 0;
+}
+
+// Parse newline-separated rows from a buffer (without checking connectivity)
+bool parseMap(Labyrinth *labyrinth, const char *data, size_t size) {
+    // First pass: count rows and check that each line has the same length
+    int rows = 0;
+    long expectedCols = -1;
+    long newline = 0; // length of the line terminator, -1 if it varies
+    for (const char *p = data, *end = data + size; p < end; ) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+        long len = (nl ? nl : end) - p;
+        if (len > 0 && p[len - 1] == '\r') {
+            len--; // Remove carriage return
+        }
+        if (nl) {
+            long terminator = next - p - len;
+            newline = newline == 0 || newline == terminator ? terminator : -1;
         }
-        
-        // Check if each line has the same length
         if (expectedCols == -1) {
             expectedCols = len;
         } else if (len != expectedCols) {
-            fclose(file);
             return false; // Inconsistent line length
         }
-        
-        // Check if line length is within range
-        if (len > MAX_COLS) {
-            fclose(file);
+        if (rows == INT_MAX) {
             return false; // Map too large
         }
-        
-        // Copy to map
-        strcpy(labyrinth->map[row], line);
-        row++;
+        rows++;
+        p = next;
     }
-    
-    labyrinth->rows = row;
-    labyrinth->cols = expectedCols;
-    
-    fclose(file);
-    
-    // Check map validity
-    for (int i = 0; i < labyrinth->rows; i++) {
-        for (int j = 0; j < labyrinth->cols; j++) {
-            char c = labyrinth->map[i][j];
-            if (c != '#' && c != '.' && !(c >= '0' && c <= '9')) {
+
+    if (rows == 0 || expectedCols <= 0 || expectedCols > INT_MAX) {
+        return false; // Ensure map is not empty
+    }
+    if (!allocMap(labyrinth, rows, expectedCols)) {
+        return false;
+    }
+    if (newline >= 0) {
+        labyrinth->file.lineStride = expectedCols + (newline ? newline : 1);
+    }
+
+    // Second pass: copy rows into the padded grid and check map validity
+    const char *p = data;
+    for (int i = 0; i < rows; i++) {
+        char *row = cellAt(labyrinth, i, 0);
+        memcpy(row, p, expectedCols);
+        for (int j = 0; j < expectedCols; j++) {
+            char c = row[j];
+            if (c >= '0' && c <= '9') {
+                // Index the player (the first one wins if it appears twice)
+                Position *pos = &labyrinth->players[c - '0'];
+                if (pos->row == -1) {
+                    *pos = (Position){i, j};
+                }
+            } else if (c != '#' && c != '.') {
+                freeMap(labyrinth);
                 return false; // Invalid character
             }
         }
+        const char *nl = memchr(p, '\n', data + size - p);
+        p = nl ? nl + 1 : data + size;
     }
-    
+    return true;
+}
+
+bool loadMap(Labyrinth *labyrinth, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Map the whole file at once instead of reading it line by line
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    bool ok = parseMap(labyrinth, data, st.st_size);
+    munmap((void *)data, st.st_size);
+    if (!ok) {
+        return false;
+    }
+    labyrinth->file.size = st.st_size;
+    labyrinth->file.dev = st.st_dev;
+    labyrinth->file.ino = st.st_ino;
+
     // Check connectivity
     if (!isConnected(labyrinth)) {
+        freeMap(labyrinth);
         return false;
     }
-    
-    return row > 0 && expectedCols > 0; // Ensure map is not empty
+
+    return true;
+}
+
+// Print the rows of the map, one per line
+void printMap(Labyrinth *labyrinth, FILE *file) {
+    for (int i = 0; i < labyrinth->rows; i++) {
+        fwrite(cellAt(labyrinth, i, 0), 1, labyrinth->cols, file);
+        fputc('\n', file);
+    }
 }
 
 Position findPlayer(Labyrinth *labyrinth, char playerId) {
+    if (!isValidPlayer(playerId)) {
+        return (Position){-1, -1};
+    }
+    return labyrinth->players[playerId - '0'];
+}
+
+// Find the first empty cell in row-major order, resuming from the free
+// cursor: cells before it are known to be non-empty, and movePlayer()
+// pulls the cursor back when it frees a cell before it.
+Position findFirstEmptySpace(Labyrinth *labyrinth) {
     Position pos = {-1, -1};
+    size_t cols = labyrinth->cols;
+    if (cols == 0) {
+        return pos;
+    }
     
-    for (int i = 0; i < labyrinth->rows; i++) {
-        for (int j = 0; j < labyrinth->cols; j++) {
-            if (labyrinth->map[i][j] == playerId) {
-                pos.row = i;
-                pos.col = j;
-                return pos;
-            }
+    for (size_t i = labyrinth->freeCursor / cols; i < (size_t)labyrinth->rows; i++) {
+        size_t start = i == labyrinth->freeCursor / cols ? labyrinth->freeCursor % cols : 0;
+        const char *row = cellAt(labyrinth, i, 0);
+        const char *found = memchr(row + start, '.', cols - start);
+        if (found) {
+            pos.row = i;
+            pos.col = found - row;
+            labyrinth->freeCursor = i * cols + pos.col;
+            return pos;
         }
     }
     
+    labyrinth->freeCursor = (size_t)labyrinth->rows * cols;
     return pos;
 }
 
-Position findFirstEmptySpace(Labyrinth *labyrinth) {
-    Position pos = {-1, -1};
-    
-    for (int i = 0; i < labyrinth->rows; i++) {
-        for (int j = 0; j < labyrinth->cols; j++) {
-            if (labyrinth->map[i][j] == '.') {
-                pos.row = i;
-                pos.col = j;
-                return pos;
-            }
-        }
+// Remember a changed cell for the next saveMap(). Every cell has its
+// own bit, set atomically, so shared movers need no lock for it; a bit
+// that is already set is not written again.
+static void markDirty(Labyrinth *labyrinth, Position pos) {
+    size_t cell = (size_t)pos.row * labyrinth->cols + pos.col;
+    uint64_t *word = &labyrinth->file.dirty[cell / 64];
+    uint64_t bit = 1ull << (cell % 64);
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit)) {
+        __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+    }
+}
+
+static size_t dirtyWords(Labyrinth *labyrinth) {
+    return ((size_t)labyrinth->rows * labyrinth->cols + 63) / 64;
+}
+
+// Number of cells changed since the last save
+size_t countDirtyCells(Labyrinth *labyrinth) {
+    size_t count = 0;
+    for (size_t w = 0; w < dirtyWords(labyrinth); w++) {
+        count += __builtin_popcountll(labyrinth->file.dirty[w]);
+    }
+    return count;
+}
+
+// Put a player that is not on the map yet into the first empty space
+Position placePlayer(Labyrinth *labyrinth, char playerId) {
+    Position pos = findPlayer(labyrinth, playerId);
+    if (!isValidPlayer(playerId) || pos.row != -1) {
+        return (Position){-1, -1};
     }
     
+    pos = findFirstEmptySpace(labyrinth);
+    if (pos.row != -1) {
+        *cellAt(labyrinth, pos.row, pos.col) = playerId;
+        labyrinth->players[playerId - '0'] = pos;
+        markDirty(labyrinth, pos);
+    }
     return pos;
 }
 
@@ -215,120 +492,1493 @@ bool isEmptySpace(Labyrinth *labyrinth, int row, int col) {
         return false;
     }
     
-    return labyrinth->map[row][col] == '.';
+    return *cellAt(labyrinth, row, col) == '.';
+}
+
+// Parse "up"/"down"/"left"/"right" or their first letters. One switch
+// on the first character picks the candidate, so at most one comparison
+// is made per direction.
+Direction parseDirection(const char *text, size_t len) {
+    static const char *const names[] = {
+        [DIR_UP] = "up", [DIR_DOWN] = "down", [DIR_LEFT] = "left", [DIR_RIGHT] = "right",
+    };
+    Direction dir;
+    switch (len > 0 ? text[0] : '\0') {
+        case 'u': case 'U': dir = DIR_UP; break;
+        case 'd': case 'D': dir = DIR_DOWN; break;
+        case 'l': case 'L': dir = DIR_LEFT; break;
+        case 'r': case 'R': dir = DIR_RIGHT; break;
+        default: return DIR_INVALID;
+    }
+    if (len == 1 || (len == strlen(names[dir]) && memcmp(text, names[dir], len) == 0)) {
+        return dir;
+    }
+    return DIR_INVALID;
 }
 
 bool movePlayer(Labyrinth *labyrinth, char playerId, const char *direction) {
+    return movePlayerDir(labyrinth, playerId, parseDirection(direction, strlen(direction)));
+}
+
+static const int dRow[] = { [DIR_UP] = -1, [DIR_DOWN] = 1, [DIR_LEFT] = 0, [DIR_RIGHT] = 0 };
+static const int dCol[] = { [DIR_UP] = 0, [DIR_DOWN] = 0, [DIR_LEFT] = -1, [DIR_RIGHT] = 1 };
+
+bool movePlayerDir(Labyrinth *labyrinth, char playerId, Direction dir) {
+    if (dir == DIR_INVALID) {
+        return false; // Invalid direction
+    }
+
     // Find the player's current position
     Position pos = findPlayer(labyrinth, playerId);
     if (pos.row == -1 || pos.col == -1) {
         return false; // Player not on the map
     }
     
-    int newRow = pos.row;
-    int newCol = pos.col;
-    
     // Calculate the new position
-    if (strcmp(direction, "up") == 0) {
-        newRow--;
-    } else if (strcmp(direction, "down") == 0) {
-        newRow++;
-    } else if (strcmp(direction, "left") == 0) {
-        newCol--;
-    } else if (strcmp(direction, "right") == 0) {
-        newCol++;
-    } else {
-        return false; // Invalid direction
-    }
+    int newRow = pos.row + dRow[dir];
+    int newCol = pos.col + dCol[dir];
     
-    // Check if the new position is valid
-    if (newRow < 0 || newRow >= labyrinth->rows || newCol < 0 || newCol >= labyrinth->cols) {
-        return false; // Out of bounds
+    // Check if the new position is movable (the border is all walls,
+    // so stepping off the map needs no separate bounds check)
+    char *target = cellAt(labyrinth, newRow, newCol);
+    if (*target == '#' || (*target >= '0' && *target <= '9')) {
+        return false; // Wall, other player or out of bounds
     }
     
-    // Check if the new position is movable
-    char target = labyrinth->map[newRow][newCol];
-    if (target == '#' || (target >= '0' && target <= '9')) {
-        return false; // Wall or other player
-    }
+    // Move the player and keep the index in sync
+    *cellAt(labyrinth, pos.row, pos.col) = '.';
+    *target = playerId;
+    labyrinth->players[playerId - '0'] = (Position){newRow, newCol};
+    markDirty(labyrinth, pos);
+    markDirty(labyrinth, (Position){newRow, newCol});
     
-    // Move the player
-    labyrinth->map[pos.row][pos.col] = '.';
-    labyrinth->map[newRow][newCol] = playerId;
+    size_t freed = (size_t)pos.row * labyrinth->cols + pos.col;
+    if (freed < labyrinth->freeCursor) {
+        labyrinth->freeCursor = freed;
+    }
     
     return true;
 }
 
-bool saveMap(Labyrinth *labyrinth, const char *filename) {
-    FILE *file = fopen(filename, "w");
-    if (!file) {
+// Shared moves. Any number of threads may call claimPlayer() and
+// movePlayerShared() at once, each for players it has claimed, so a
+// player only ever has one writer. A move first reserves its target
+// cell, turning '.' into the player's reservation mark with a
+// compare-and-swap, then commits, swapping the mark for the player's
+// digit, and only then frees the old cell: a player is never lost, and
+// moves into different cells never write the same memory.
+//
+// Moves racing for one cell are decided by player id, not by which CAS
+// lands first: a reservation is taken over by any lower id until it is
+// committed, and a move whose reservation was taken fails as if the
+// cell had been occupied. So of the moves whose reservations overlap,
+// the lowest id always wins, and the outcome equals some serial order
+// of the moves.
+
+// Reservation mark of a player, 'A' to 'J'; never a map character
+static inline char reservationOf(char playerId) {
+    return 'A' + (playerId - '0');
+}
+
+static inline bool isReservation(char c) {
+    return c >= 'A' && c < 'A' + MAX_PLAYERS;
+}
+
+// Lower the free cursor to a cell that was just freed
+static void lowerFreeCursor(Labyrinth *labyrinth, size_t freed) {
+    size_t cursor = __atomic_load_n(&labyrinth->freeCursor, __ATOMIC_RELAXED);
+    while (freed < cursor &&
+           !__atomic_compare_exchange_n(&labyrinth->freeCursor, &cursor, freed, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// placePlayer() for concurrent movers. Candidates are found with a plain
+// scan and re-checked by the CAS; the free cursor is only read here,
+// since lowering it is always safe but raising it could skip a cell
+// that another thread frees meanwhile.
+static bool placePlayerShared(Labyrinth *labyrinth, char playerId) {
+    size_t cols = labyrinth->cols;
+    size_t start = __atomic_load_n(&labyrinth->freeCursor, __ATOMIC_RELAXED);
+    if (cols == 0) {
         return false;
     }
-    
-    for (int i = 0; i < labyrinth->rows; i++) {
-        fprintf(file, "%s\n", labyrinth->map[i]);
+
+    for (size_t i = start / cols; i < (size_t)labyrinth->rows; i++) {
+        char *row = cellAt(labyrinth, i, 0);
+        for (size_t j = i == start / cols ? start % cols : 0; j < cols; j++) {
+            char *found = memchr(row + j, '.', cols - j);
+            if (!found) {
+                break;
+            }
+            char expected = '.';
+            j = found - row;
+            if (__atomic_compare_exchange_n(found, &expected, playerId, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                Position pos = {i, j};
+                labyrinth->players[playerId - '0'] = pos;
+                markDirty(labyrinth, pos);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Claim a player for the calling thread, placing it in the first empty
+// space if it is not on the map yet. Fails if the player is already
+// claimed or there is no room for it.
+bool claimPlayer(Labyrinth *labyrinth, char playerId) {
+    if (!isValidPlayer(playerId)) {
+        return false;
+    }
+    uint32_t bit = 1u << (playerId - '0');
+    if (__atomic_fetch_or(&labyrinth->claimed, bit, __ATOMIC_ACQUIRE) & bit) {
+        return false;
+    }
+    if (labyrinth->players[playerId - '0'].row == -1 && !placePlayerShared(labyrinth, playerId)) {
+        releasePlayer(labyrinth, playerId);
+        return false;
     }
-    
-    fclose(file);
     return true;
 }
 
-// Check if all empty spaces are connected using DFS
-void dfs(Labyrinth *labyrinth, int row, int col, bool visited[MAX_ROWS][MAX_COLS]) {
-    // Check boundaries
-    if (row < 0 || row >= labyrinth->rows || col < 0 || col >= labyrinth->cols) {
-        return;
+void releasePlayer(Labyrinth *labyrinth, char playerId) {
+    if (isValidPlayer(playerId)) {
+        __atomic_fetch_and(&labyrinth->claimed, ~(1u << (playerId - '0')), __ATOMIC_RELEASE);
     }
-    
-    // Check if it's a wall or already visited
-    char cell = labyrinth->map[row][col];
-    if (cell == '#' || visited[row][col]) {
-        return;
+}
+
+// Target cell of a shared move, or NULL if the player is not on the map
+static char *moveTarget(Labyrinth *labyrinth, char playerId, Direction dir, Position *from) {
+    if (dir == DIR_INVALID || !isValidPlayer(playerId)) {
+        return NULL;
     }
-    
-    // Mark as visited
-    visited[row][col] = true;
-    
-    // Explore four directions
-    dfs(labyrinth, row + 1, col, visited); // Down
-    dfs(labyrinth, row - 1, col, visited); // Up
-    dfs(labyrinth, row, col + 1, visited); // Right
-    dfs(labyrinth, row, col - 1, visited); // Left
+    *from = labyrinth->players[playerId - '0'];
+    if (from->row == -1) {
+        return NULL;
+    }
+    return cellAt(labyrinth, from->row + dRow[dir], from->col + dCol[dir]);
 }
 
-bool isConnected(Labyrinth *labyrinth) {
-    bool visited[MAX_ROWS][MAX_COLS] = {false};
-    Position start = {-1, -1};
-    
-    // Find the first empty space or player as the starting point
-    for (int i = 0; i < labyrinth->rows && start.row == -1; i++) {
-        for (int j = 0; j < labyrinth->cols; j++) {
-            char cell = labyrinth->map[i][j];
-            if (cell == '.' || (cell >= '0' && cell <= '9')) {
-                start.row = i;
-                start.col = j;
-                break;
-            }
+// First half of movePlayerShared(): reserve the target cell. Fails on a
+// wall, another player or a reservation of a lower id. Every reservation
+// must be followed by commitMoveShared().
+bool reserveMoveShared(Labyrinth *labyrinth, char playerId, Direction dir) {
+    Position from;
+    char *target = moveTarget(labyrinth, playerId, dir, &from);
+    if (!target) {
+        return false;
+    }
+    char mark = reservationOf(playerId), seen = '.';
+    while (!__atomic_compare_exchange_n(target, &seen, mark, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (!isReservation(seen) || seen < mark) {
+            return false; // Wall, other player, out of bounds or a lower id
         }
     }
-    
-    // If there are no empty spaces or players, the map is invalid
-    if (start.row == -1) {
+    return true;
+}
+
+// Second half: take the reserved cell and free the old one. Fails if the
+// reservation was not made or a lower id has taken it over.
+bool commitMoveShared(Labyrinth *labyrinth, char playerId, Direction dir) {
+    Position from;
+    char *target = moveTarget(labyrinth, playerId, dir, &from);
+    char expected = reservationOf(playerId);
+    if (!target || !__atomic_compare_exchange_n(target, &expected, playerId, false,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    Position to = {from.row + dRow[dir], from.col + dCol[dir]};
+    __atomic_store_n(cellAt(labyrinth, from.row, from.col), '.', __ATOMIC_RELEASE);
+    labyrinth->players[playerId - '0'] = to;
+
+    lowerFreeCursor(labyrinth, (size_t)from.row * labyrinth->cols + from.col);
+    markDirty(labyrinth, from);
+    markDirty(labyrinth, to);
+    return true;
+}
+
+// Move a player claimed by the calling thread
+bool movePlayerShared(Labyrinth *labyrinth, char playerId, Direction dir) {
+    return reserveMoveShared(labyrinth, playerId, dir) &&
+           commitMoveShared(labyrinth, playerId, dir);
+}
+
+// Patch the dirty cells into the file the map was loaded from. Fails
+// without writing anything if the file layout is unknown or the file
+// has been replaced or resized since.
+static bool patchMap(Labyrinth *labyrinth, const char *filename) {
+    MapFile *file = &labyrinth->file;
+    if (file->lineStride == 0 || file->size < 0 || countDirtyCells(labyrinth) > MAP_DIRTY_MAX) {
+        return false;
+    }
+
+    int fd = open(filename, O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size == file->size &&
+              (uint64_t)st.st_dev == file->dev && (uint64_t)st.st_ino == file->ino;
+    for (size_t w = 0; ok && w < dirtyWords(labyrinth); w++) {
+        for (uint64_t bits = file->dirty[w]; ok && bits; bits &= bits - 1) {
+            size_t cell = w * 64 + __builtin_ctzll(bits);
+            int row = cell / labyrinth->cols, col = cell % labyrinth->cols;
+            off_t offset = (off_t)row * file->lineStride + col;
+            ok = pwrite(fd, cellAt(labyrinth, row, col), 1, offset) == 1;
+        }
+    }
+    if (close(fd) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+// Write the whole map to a temporary file next to it and rename it over
+// the original, so readers see either the old or the new map
+static bool replaceMap(Labyrinth *labyrinth, const char *filename) {
+    size_t len = strlen(filename);
+    char *tmpName = malloc(len + sizeof(".XXXXXX"));
+    if (!tmpName) {
+        return false;
+    }
+    memcpy(tmpName, filename, len);
+    memcpy(tmpName + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(tmpName);
+    if (fd < 0) {
+        free(tmpName);
+        return false;
+    }
+
+    // Keep the permissions of the map being replaced
+    struct stat st;
+    fchmod(fd, stat(filename, &st) == 0 ? st.st_mode & 07777 : 0644);
+
+    FILE *out = fdopen(fd, "w");
+    bool ok = out != NULL;
+    if (ok) {
+        printMap(labyrinth, out);
+        ok = fflush(out) == 0 && fsync(fd) == 0 && fstat(fd, &st) == 0;
+        ok = fclose(out) == 0 && ok;
+    } else {
+        close(fd);
+    }
+    if (ok && rename(tmpName, filename) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmpName);
+    }
+    free(tmpName);
+
+    if (ok) {
+        MapFile *file = &labyrinth->file;
+        file->lineStride = (size_t)labyrinth->cols + 1;
+        file->size = st.st_size;
+        file->dev = st.st_dev;
+        file->ino = st.st_ino;
+    }
+    return ok;
+}
+
+// Save the map. When only a few cells changed since the map was loaded
+// (a move changes two), just those bytes are rewritten in place;
+// otherwise the file is replaced as a whole.
+bool saveMap(Labyrinth *labyrinth, const char *filename) {
+    if (!patchMap(labyrinth, filename) && !replaceMap(labyrinth, filename)) {
+        return false;
+    }
+    memset(labyrinth->file.dirty, 0, dirtyWords(labyrinth) * sizeof(uint64_t));
+    return true;
+}
+
+// Connectivity is checked by an iterative flood fill over a bit-packed
+// mask: bit (col % 64) of word (col / 64) in a row is set when the cell
+// is not a wall. Each row is filled 64 cells at a time with shifts, and
+// a worklist of rows replaces recursion, so the depth no longer grows
+// with the map size.
+
+#define WORD_BITS 64
+
+// Kogge-Stone occluded fill: spread the seed bits towards higher bit
+// positions (higher columns) through runs of set bits in "open".
+static inline uint64_t fillUp(uint64_t seed, uint64_t open) {
+    seed &= open;
+    seed |= open & (seed << 1);  open &= open << 1;
+    seed |= open & (seed << 2);  open &= open << 2;
+    seed |= open & (seed << 4);  open &= open << 4;
+    seed |= open & (seed << 8);  open &= open << 8;
+    seed |= open & (seed << 16); open &= open << 16;
+    seed |= open & (seed << 32);
+    return seed;
+}
+
+// The same towards lower bit positions (lower columns)
+static inline uint64_t fillDown(uint64_t seed, uint64_t open) {
+    seed &= open;
+    seed |= open & (seed >> 1);  open &= open >> 1;
+    seed |= open & (seed >> 2);  open &= open >> 2;
+    seed |= open & (seed >> 4);  open &= open >> 4;
+    seed |= open & (seed >> 8);  open &= open >> 8;
+    seed |= open & (seed >> 16); open &= open >> 16;
+    seed |= open & (seed >> 32);
+    return seed;
+}
+
+// Extend the reached bits of one row along its open runs, carrying
+// across word boundaries: a forward pass fills every run from its
+// lowest reached cell to its end, a backward pass back to its start.
+// The row was closed under this fill before new bits were added to
+// words [*lo, *hi], so each pass stops at the first unchanged word past
+// that range instead of sweeping the whole row. [*lo, *hi] is widened
+// to every word that changed.
+static void fillRow(uint64_t *reach, const uint64_t *open, int words, int *lo, int *hi) {
+    uint64_t carry = 0;
+    for (int w = *lo; w < words; w++) {
+        uint64_t r = fillUp(reach[w] | (carry & open[w]), open[w]);
+        if (r != reach[w]) {
+            reach[w] = r;
+            *hi = w > *hi ? w : *hi;
+        } else if (w > *hi) {
+            break;
+        }
+        carry = r >> (WORD_BITS - 1);
+    }
+    carry = 0;
+    for (int w = *hi; w >= 0; w--) {
+        uint64_t r = fillDown(reach[w] | ((carry << (WORD_BITS - 1)) & open[w]), open[w]);
+        if (r != reach[w]) {
+            reach[w] = r;
+            *lo = w < *lo ? w : *lo;
+        } else if (w < *lo) {
+            break;
+        }
+        carry = r & 1;
+    }
+}
+
+// Check if all empty spaces (and players) are connected, without labels
+static bool floodConnected(Labyrinth *labyrinth) {
+    int rows = labyrinth->rows, cols = labyrinth->cols;
+    int words = (cols + WORD_BITS - 1) / WORD_BITS;
+    if (rows <= 0 || cols <= 0) {
         return true; // An empty map is considered connected by default
     }
-    
-    // Start DFS from the starting point
-    dfs(labyrinth, start.row, start.col, visited);
-    
-    // Check if all non-wall positions have been visited
-    for (int i = 0; i < labyrinth->rows; i++) {
-        for (int j = 0; j < labyrinth->cols; j++) {
-            char cell = labyrinth->map[i][j];
-            if ((cell == '.' || (cell >= '0' && cell <= '9')) && !visited[i][j]) {
-                return false; // Found an unvisited non-wall position
+
+    uint64_t *open = calloc((size_t)rows * words, sizeof(uint64_t));
+    uint64_t *reach = calloc((size_t)rows * words, sizeof(uint64_t));
+    int *stack = malloc(rows * sizeof(int));
+    int *pending = malloc(2 * rows * sizeof(int)); // words to pull, per queued row
+    if (!open || !reach || !stack || !pending) {
+        free(open); free(reach); free(stack); free(pending);
+        return false;
+    }
+    for (int i = 0; i < rows; i++) {
+        pending[2 * i] = words; // Not queued: empty range
+        pending[2 * i + 1] = -1;
+    }
+
+    // Build the open-cell mask and find the first open cell as the start
+    Position start = {-1, -1};
+    for (int i = 0; i < rows; i++) {
+        uint64_t *row = open + (size_t)i * words;
+        const char *cells = cellAt(labyrinth, i, 0);
+        for (int j = 0; j < cols; j++) {
+            if (cells[j] != '#') {
+                row[j / WORD_BITS] |= 1ULL << (j % WORD_BITS);
+                if (start.row == -1) {
+                    start = (Position){i, j};
+                }
             }
         }
     }
-    
-    return true;
-}
\ No newline at end of file
+
+    if (start.row != -1) {
+        // Seed the start row, then keep a worklist of rows whose
+        // neighbours changed, with the range of words that changed;
+        // each row pulls reached bits in that range from the rows above
+        // and below and fills horizontally.
+        int r = start.row, lo = start.col / WORD_BITS, hi = lo;
+        int top = 0;
+        reach[(size_t)r * words + lo] = 1ULL << (start.col % WORD_BITS);
+        fillRow(reach + (size_t)r * words, open + (size_t)r * words, words, &lo, &hi);
+
+        while (true) {
+            // Queue the neighbours of row r over words [lo, hi]
+            for (int d = -1; d <= 1; d += 2) {
+                int n = r + d;
+                if (n < 0 || n >= rows) {
+                    continue;
+                }
+                if (pending[2 * n] > pending[2 * n + 1]) {
+                    stack[top++] = n;
+                }
+                pending[2 * n] = lo < pending[2 * n] ? lo : pending[2 * n];
+                pending[2 * n + 1] = hi > pending[2 * n + 1] ? hi : pending[2 * n + 1];
+            }
+
+            // Take the next row that pulls in new cells
+            bool pulled = false;
+            while (!pulled && top > 0) {
+                r = stack[--top];
+                int from = pending[2 * r], to = pending[2 * r + 1];
+                pending[2 * r] = words;
+                pending[2 * r + 1] = -1;
+
+                uint64_t *rr = reach + (size_t)r * words;
+                const uint64_t *ro = open + (size_t)r * words;
+                const uint64_t *above = r > 0 ? rr - words : NULL;
+                const uint64_t *below = r + 1 < rows ? rr + words : NULL;
+                lo = words;
+                hi = -1;
+                for (int w = from; w <= to; w++) {
+                    uint64_t v = (above ? above[w] : 0) | (below ? below[w] : 0);
+                    v &= ro[w] & ~rr[w];
+                    if (v) {
+                        rr[w] |= v;
+                        lo = w < lo ? w : lo;
+                        hi = w;
+                    }
+                }
+                if (hi >= 0) {
+                    fillRow(rr, ro, words, &lo, &hi);
+                    pulled = true;
+                }
+            }
+            if (!pulled) {
+                break;
+            }
+        }
+    }
+
+    // Check if all non-wall positions have been reached
+    bool connected = memcmp(open, reach, (size_t)rows * words * sizeof(uint64_t)) == 0;
+
+    free(open);
+    free(reach);
+    free(stack);
+    free(pending);
+    return connected;
+}
+
+void invalidateConnectivity(Labyrinth *labyrinth) {
+    Connectivity *conn = &labyrinth->conn;
+    free(conn->label);
+    free(conn->runStart);
+    free(conn->rowRuns);
+    free(conn->cellLabel);
+    *conn = (Connectivity){0};
+    labyrinth->generation = nextGeneration();
+}
+
+// Check if all empty spaces (and players) are connected. The answer is
+// cached until the walls change; labelling (isReachable) fills it too.
+bool isConnected(Labyrinth *labyrinth) {
+    Connectivity *conn = &labyrinth->conn;
+    if (!conn->checked) {
+        conn->connected = floodConnected(labyrinth);
+        conn->checked = true;
+    }
+    return conn->connected;
+}
+
+// Union-find over run ids. Roots always have the smallest id of their
+// set, so parent[x] <= x holds throughout.
+static uint32_t ufFind(uint32_t *parent, uint32_t x) {
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]]; // Path halving
+        x = parent[x];
+    }
+    return x;
+}
+
+static void ufUnion(uint32_t *parent, uint32_t a, uint32_t b) {
+    a = ufFind(parent, a);
+    b = ufFind(parent, b);
+    if (a < b) {
+        parent[b] = a;
+    } else if (b < a) {
+        parent[a] = b;
+    }
+}
+
+// Label connected components. The union-find runs over horizontal runs
+// of non-wall cells rather than cells, which keeps it a fraction of the
+// map size; runs in adjacent rows are joined where their columns
+// overlap. The run labels are then copied to every cell, so a
+// reachability query is two loads and a compare.
+static bool labelComponents(Labyrinth *labyrinth) {
+    Connectivity *conn = &labyrinth->conn;
+    int rows = labyrinth->rows, cols = labyrinth->cols;
+    if (conn->label) {
+        return true;
+    }
+
+    // Count runs first so that every array is allocated exactly once
+    size_t runs = 0;
+    for (int i = 0; i < rows; i++) {
+        const char *row = cellAt(labyrinth, i, 0);
+        for (int j = 0; j < cols; j++) {
+            runs += row[j] != '#' && row[j - 1] == '#'; // row[-1] is border
+        }
+    }
+    if (runs >= UINT32_MAX) {
+        return false;
+    }
+
+    uint32_t *label = malloc((runs + 1) * sizeof(uint32_t));
+    uint32_t *runStart = malloc((runs + 1) * sizeof(uint32_t));
+    uint32_t *runEnd = malloc((runs + 1) * sizeof(uint32_t));
+    size_t *rowRuns = malloc(((size_t)rows + 1) * sizeof(size_t));
+    if (!label || !runStart || !runEnd || !rowRuns) {
+        free(label); free(runStart); free(runEnd); free(rowRuns);
+        return false;
+    }
+
+    size_t n = 0;
+    for (int i = 0; i < rows; i++) {
+        const char *row = cellAt(labyrinth, i, 0);
+        rowRuns[i] = n;
+        for (int j = 0; j < cols; j++) {
+            if (row[j] != '#' && row[j - 1] == '#') {
+                runStart[n] = j;
+                label[n] = n;
+                n++;
+            }
+            if (row[j] != '#' && row[j + 1] == '#') {
+                runEnd[n - 1] = j; // row[cols] is border
+            }
+        }
+
+        // Join with overlapping runs of the previous row (two pointers)
+        if (i > 0) {
+            size_t a = rowRuns[i - 1], b = rowRuns[i];
+            while (a < rowRuns[i] && b < n) {
+                if (runStart[a] <= runEnd[b] && runStart[b] <= runEnd[a]) {
+                    ufUnion(label, a, b);
+                }
+                if (runEnd[a] < runEnd[b]) {
+                    a++;
+                } else {
+                    b++;
+                }
+            }
+        }
+    }
+    rowRuns[rows] = n;
+    free(runEnd);
+
+    // Flatten to roots, then number the roots densely in run order:
+    // since parent <= id, every root is numbered before its members.
+    for (size_t k = 0; k < n; k++) {
+        label[k] = label[label[k]];
+    }
+    int components = 0;
+    for (size_t k = 0; k < n; k++) {
+        uint32_t root = label[k];
+        label[k] = root == k ? (uint32_t)components++ : label[root];
+    }
+
+    // Spread the run labels over their cells, for lookups in O(1)
+    uint32_t *cellLabel = malloc(((size_t)rows * cols + 1) * sizeof(uint32_t));
+    if (!cellLabel) {
+        free(label); free(runStart); free(rowRuns);
+        return false;
+    }
+    memset(cellLabel, 0xff, (size_t)rows * cols * sizeof(uint32_t));
+    for (int i = 0; i < rows; i++) {
+        const char *row = cellAt(labyrinth, i, 0);
+        uint32_t *cellRow = cellLabel + (size_t)i * cols;
+        for (size_t k = rowRuns[i]; k < rowRuns[i + 1]; k++) {
+            for (int j = runStart[k]; row[j] != '#'; j++) { // row[cols] is border
+                cellRow[j] = label[k];
+            }
+        }
+    }
+
+    conn->label = label;
+    conn->runStart = runStart;
+    conn->rowRuns = rowRuns;
+    conn->cellLabel = cellLabel;
+    conn->components = components;
+    conn->connected = components <= 1;
+    conn->checked = true;
+    return true;
+}
+
+// Check if "to" can be reached from "from" through non-wall cells
+// (players are not obstacles). Labels are computed on first use.
+bool isReachable(Labyrinth *labyrinth, Position from, Position to) {
+    Position ends[] = {from, to};
+    for (int i = 0; i < 2; i++) {
+        Position p = ends[i];
+        if (p.row < 0 || p.row >= labyrinth->rows || p.col < 0 || p.col >= labyrinth->cols ||
+            *cellAt(labyrinth, p.row, p.col) == '#') {
+            return false;
+        }
+    }
+    if (!labelComponents(labyrinth)) {
+        return false;
+    }
+    const uint32_t *cellLabel = labyrinth->conn.cellLabel;
+    int cols = labyrinth->cols;
+    return cellLabel[from.row * cols + from.col] == cellLabel[to.row * cols + to.col];
+}
+
+// Shortest paths run over cell offsets in the padded grid, where the
+// four neighbours of a cell are at -stride, +stride, -1 and +1 and the
+// border stops the search without bounds checks. Players are not
+// obstacles, as for isReachable().
+
+static const char dirLetters[] = { [DIR_UP] = 'u', [DIR_DOWN] = 'd', [DIR_LEFT] = 'l', [DIR_RIGHT] = 'r' };
+
+static inline size_t offsetOf(Labyrinth *labyrinth, Position pos) {
+    return cellAt(labyrinth, pos.row, pos.col) - labyrinth->cells;
+}
+
+static inline void stepDeltas(Labyrinth *labyrinth, long delta[4]) {
+    delta[DIR_UP] = -labyrinth->stride;
+    delta[DIR_DOWN] = labyrinth->stride;
+    delta[DIR_LEFT] = -1;
+    delta[DIR_RIGHT] = 1;
+}
+
+static bool reservePath(PathFinder *finder, size_t len) {
+    if (len + 1 > finder->pathCap) {
+        char *path = realloc(finder->path, len + 1);
+        if (!path) {
+            return false;
+        }
+        finder->path = path;
+        finder->pathCap = len + 1;
+    }
+    return true;
+}
+
+static bool pushQueue(PathFinder *finder, size_t *head, size_t *tail, uint32_t offset) {
+    if (*tail - *head == finder->queueCap) {
+        // Full: unwrap into a buffer twice the size
+        size_t cap = finder->queueCap ? finder->queueCap * 2 : 1024;
+        uint32_t *queue = malloc(cap * sizeof(uint32_t));
+        if (!queue) {
+            return false;
+        }
+        for (size_t i = *head; i < *tail; i++) {
+            queue[i - *head] = finder->queue[i & (finder->queueCap - 1)];
+        }
+        free(finder->queue);
+        finder->queue = queue;
+        finder->queueCap = cap;
+        *tail -= *head;
+        *head = 0;
+    }
+    finder->queue[(*tail)++ & (finder->queueCap - 1)] = offset;
+    return true;
+}
+
+static void dropDistanceCache(PathFinder *finder) {
+    free(finder->openId);
+    free(finder->dist);
+    finder->openId = NULL;
+    finder->dist = NULL;
+    finder->openCount = 0;
+    finder->cachedFor = 0;
+}
+
+// Build the all-pairs distance table for small maps: one BFS per
+// non-wall cell. Returns false if the map is too large for it.
+static bool buildDistanceCache(PathFinder *finder, Labyrinth *labyrinth) {
+    if (finder->cachedFor == labyrinth->generation) {
+        return finder->dist != NULL;
+    }
+    dropDistanceCache(finder);
+    finder->cachedFor = labyrinth->generation;
+
+    size_t cells = ((size_t)labyrinth->rows + 2) * labyrinth->stride;
+    int n = 0;
+    for (size_t i = 0; i < cells && n <= PATH_CACHE_MAX_CELLS; i++) {
+        n += labyrinth->cells[i] != '#';
+    }
+    if (n > PATH_CACHE_MAX_CELLS) {
+        return false;
+    }
+
+    int32_t *openId = malloc(cells * sizeof(int32_t));
+    uint32_t *offsets = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *queue = malloc((n + 1) * sizeof(uint32_t));
+    uint16_t *dist = malloc(((size_t)n * n + 1) * sizeof(uint16_t));
+    if (!openId || !offsets || !queue || !dist) {
+        free(openId); free(offsets); free(queue); free(dist);
+        return false;
+    }
+    for (size_t i = 0, id = 0; i < cells; i++) {
+        openId[i] = labyrinth->cells[i] != '#' ? (int32_t)id : -1;
+        if (openId[i] >= 0) {
+            offsets[id++] = i;
+        }
+    }
+
+    long delta[4];
+    stepDeltas(labyrinth, delta);
+    for (int s = 0; s < n; s++) {
+        uint16_t *row = dist + (size_t)s * n;
+        memset(row, 0xff, n * sizeof(uint16_t));
+        int head = 0, tail = 0;
+        row[s] = 0;
+        queue[tail++] = offsets[s];
+        while (head < tail) {
+            uint32_t cur = queue[head++];
+            uint16_t d = row[openId[cur]];
+            for (int k = 0; k < 4; k++) {
+                int32_t id = openId[cur + delta[k]];
+                if (id >= 0 && row[id] == UINT16_MAX) {
+                    row[id] = d + 1;
+                    queue[tail++] = cur + delta[k];
+                }
+            }
+        }
+    }
+    free(queue);
+    free(offsets);
+
+    finder->openId = openId;
+    finder->dist = dist;
+    finder->openCount = n;
+    return true;
+}
+
+// Breadth-first search from "from" until "to" is dequeued; the step
+// array records how each visited cell was entered.
+static bool searchPath(PathFinder *finder, Labyrinth *labyrinth, size_t src, size_t dst) {
+    size_t cells = ((size_t)labyrinth->rows + 2) * labyrinth->stride;
+    if (cells > finder->cells) {
+        free(finder->visited);
+        free(finder->step);
+        finder->visited = malloc((cells + 63) / 64 * sizeof(uint64_t));
+        finder->step = malloc(cells);
+        finder->cells = finder->visited && finder->step ? cells : 0;
+        if (!finder->cells) {
+            return false;
+        }
+    }
+    memset(finder->visited, 0, (cells + 63) / 64 * sizeof(uint64_t));
+
+    long delta[4];
+    stepDeltas(labyrinth, delta);
+    const char *grid = labyrinth->cells;
+    uint64_t *visited = finder->visited;
+    size_t head = 0, tail = 0;
+
+    visited[src / 64] |= 1ULL << (src % 64);
+    if (!pushQueue(finder, &head, &tail, src)) {
+        return false;
+    }
+    while (head < tail) {
+        uint32_t cur = finder->queue[head++ & (finder->queueCap - 1)];
+        if (cur == dst) {
+            return true;
+        }
+        for (int k = 0; k < 4; k++) {
+            size_t next = cur + delta[k];
+            uint64_t bit = 1ULL << (next % 64);
+            if (grid[next] != '#' && !(visited[next / 64] & bit)) {
+                visited[next / 64] |= bit;
+                finder->step[next] = k;
+                if (!pushQueue(finder, &head, &tail, next)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Find a shortest path between two non-wall cells. Returns its length,
+// or -1 if there is none; the directions are left in finder->path as a
+// string of 'u'/'d'/'l'/'r'. Small maps answer from the distance table
+// by walking downhill; larger ones run a BFS with the reusable buffers.
+long findPath(PathFinder *finder, Labyrinth *labyrinth, Position from, Position to) {
+    if (!isReachable(labyrinth, from, to)) {
+        return -1; // Also rejects walls and positions off the map
+    }
+    size_t src = offsetOf(labyrinth, from), dst = offsetOf(labyrinth, to);
+    long delta[4];
+    stepDeltas(labyrinth, delta);
+
+    if (buildDistanceCache(finder, labyrinth)) {
+        const uint16_t *toDst = finder->dist + (size_t)finder->openId[dst] * finder->openCount;
+        long len = toDst[finder->openId[src]];
+        if (!reservePath(finder, len)) {
+            return -1;
+        }
+        for (long i = 0, cur = src; i < len; i++) {
+            for (int k = 0; k < 4; k++) {
+                int32_t id = finder->openId[cur + delta[k]];
+                if (id >= 0 && toDst[id] == len - i - 1) {
+                    finder->path[i] = dirLetters[k];
+                    cur += delta[k];
+                    break;
+                }
+            }
+        }
+        finder->path[len] = '\0';
+        return len;
+    }
+
+    if (!searchPath(finder, labyrinth, src, dst)) {
+        return -1;
+    }
+    long len = 0;
+    for (size_t cur = dst; cur != src; cur -= delta[finder->step[cur]]) {
+        len++;
+    }
+    if (!reservePath(finder, len)) {
+        return -1;
+    }
+    finder->path[len] = '\0';
+    long i = len;
+    for (size_t cur = dst; cur != src; cur -= delta[finder->step[cur]]) {
+        finder->path[--i] = dirLetters[finder->step[cur]];
+    }
+    return len;
+}
+
+void freePathFinder(PathFinder *finder) {
+    dropDistanceCache(finder);
+    free(finder->queue);
+    free(finder->visited);
+    free(finder->step);
+    free(finder->path);
+    *finder = (PathFinder){0};
+}
+
+// Maze generation. Both generators start from an all-wall map and only
+// ever produce maps whose open cells form one component.
+
+static uint64_t nextRandom(uint64_t *state) {
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Randomised depth-first search on the rooms at even (row, col). The
+// direction back to each room's parent is kept in a byte per room, so
+// backtracking needs no explicit stack.
+static bool generateDfs(Labyrinth *labyrinth, uint64_t *rng) {
+    size_t roomRows = (labyrinth->rows + 1) / 2, roomCols = (labyrinth->cols + 1) / 2;
+    uint8_t *parent = malloc(roomRows * roomCols);
+    if (!parent) {
+        return false;
+    }
+
+    int row = 0, col = 0;
+    *cellAt(labyrinth, 0, 0) = '.';
+    parent[0] = DIR_INVALID;
+    while (true) {
+        // Pick a random unvisited neighbour room
+        Direction options[4];
+        int n = 0;
+        for (Direction dir = DIR_UP; dir <= DIR_RIGHT; dir++) {
+            int r = row + 2 * dRow[dir], c = col + 2 * dCol[dir];
+            if (r >= 0 && r < labyrinth->rows && c >= 0 && c < labyrinth->cols &&
+                *cellAt(labyrinth, r, c) == '#') {
+                options[n++] = dir;
+            }
+        }
+
+        if (n > 0) {
+            Direction dir = options[nextRandom(rng) % n];
+            *cellAt(labyrinth, row + dRow[dir], col + dCol[dir]) = '.';
+            row += 2 * dRow[dir];
+            col += 2 * dCol[dir];
+            *cellAt(labyrinth, row, col) = '.';
+            parent[(size_t)(row / 2) * roomCols + col / 2] = dir ^ 1; // DIR_UP <-> DIR_DOWN, ...
+        } else {
+            Direction back = parent[(size_t)(row / 2) * roomCols + col / 2];
+            if (back == DIR_INVALID) {
+                break; // Back at the start: every room is visited
+            }
+            row += 2 * dRow[back];
+            col += 2 * dCol[back];
+        }
+    }
+    free(parent);
+    return true;
+}
+
+// Caves by cellular automaton: start from 45% random walls, then a cell
+// becomes a wall when at least 5 cells of its 3x3 block are walls. The
+// result usually has a few separate pockets; all but the largest
+// component are filled in.
+static bool generateCave(Labyrinth *labyrinth, uint64_t *rng) {
+    int rows = labyrinth->rows, cols = labyrinth->cols;
+    size_t size = ((size_t)rows + 2) * labyrinth->stride;
+    char *next = aligned_alloc(MAP_ALIGN, size);
+    uint8_t *colWalls = malloc(cols + 2);
+    if (!next || !colWalls) {
+        free(next);
+        free(colWalls);
+        return false;
+    }
+
+    for (int i = 0; i < rows; i++) {
+        char *row = cellAt(labyrinth, i, 0);
+        for (int j = 0; j < cols; j++) {
+            row[j] = nextRandom(rng) % 100 < 45 ? '#' : '.';
+        }
+    }
+
+    memcpy(next, labyrinth->cells, size); // Keeps the border
+    for (int step = 0; step < 4; step++) {
+        for (int i = 0; i < rows; i++) {
+            // Walls per column over rows i - 1 .. i + 1, then a sliding
+            // window of three columns
+            const char *above = cellAt(labyrinth, i - 1, -1);
+            const char *row = cellAt(labyrinth, i, -1);
+            const char *below = cellAt(labyrinth, i + 1, -1);
+            for (int j = 0; j < cols + 2; j++) {
+                colWalls[j] = (above[j] == '#') + (row[j] == '#') + (below[j] == '#');
+            }
+            char *out = next + (size_t)(i + 1) * labyrinth->stride + 1;
+            for (int j = 0; j < cols; j++) {
+                out[j] = colWalls[j] + colWalls[j + 1] + colWalls[j + 2] >= 5 ? '#' : '.';
+            }
+        }
+        char *swap = labyrinth->cells;
+        labyrinth->cells = next;
+        next = swap;
+    }
+    free(next);
+    free(colWalls);
+
+    // Keep the largest component
+    invalidateConnectivity(labyrinth);
+    if (!labelComponents(labyrinth)) {
+        return false;
+    }
+    Connectivity *conn = &labyrinth->conn;
+    size_t *sizes = calloc(conn->components + 1, sizeof(size_t));
+    if (!sizes) {
+        return false;
+    }
+    for (int i = 0; i < rows; i++) {
+        const char *row = cellAt(labyrinth, i, 0);
+        for (size_t k = conn->rowRuns[i]; k < conn->rowRuns[i + 1]; k++) {
+            const char *start = row + conn->runStart[k];
+            sizes[conn->label[k]] += (const char *)memchr(start, '#', cols + 1) - start;
+        }
+    }
+    uint32_t largest = 0;
+    for (int c = 1; c < conn->components; c++) {
+        if (sizes[c] > sizes[largest]) {
+            largest = c;
+        }
+    }
+    for (int i = 0; i < rows; i++) {
+        char *row = cellAt(labyrinth, i, 0);
+        for (size_t k = conn->rowRuns[i]; k < conn->rowRuns[i + 1]; k++) {
+            if (conn->label[k] != largest) {
+                char *start = row + conn->runStart[k];
+                memset(start, '#', (char *)memchr(start, '#', cols + 1) - start);
+            }
+        }
+    }
+    free(sizes);
+    invalidateConnectivity(labyrinth);
+    return true;
+}
+
+MazeAlgorithm parseMazeAlgorithm(const char *name) {
+    if (strcmp(name, "dfs") == 0) {
+        return MAZE_DFS;
+    } else if (strcmp(name, "cave") == 0) {
+        return MAZE_CAVE;
+    }
+    return MAZE_INVALID;
+}
+
+// Generate a connected rows x cols maze without players. The same seed
+// always gives the same maze.
+bool generateMaze(Labyrinth *labyrinth, int rows, int cols, MazeAlgorithm algo, uint64_t seed) {
+    if (rows <= 0 || cols <= 0 || algo == MAZE_INVALID || !allocMap(labyrinth, rows, cols)) {
+        return false;
+    }
+    uint64_t rng = seed * 0x9E3779B97F4A7C15ULL + 1; // xorshift state must be non-zero
+    bool ok = algo == MAZE_DFS ? generateDfs(labyrinth, &rng) : generateCave(labyrinth, &rng);
+    if (!ok || !isConnected(labyrinth) || findFirstEmptySpace(labyrinth).row == -1) {
+        freeMap(labyrinth);
+        return false;
+    }
+    return true;
+}
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+#define BENCH_MOVES 2000000
+
+// Benchmark one map size in the calling process: generate, save, then
+// time loading (which includes validation), validation alone, random
+// moves and rendering
+static bool benchmarkSize(int rows, int cols, const char *path) {
+    Labyrinth labyrinth;
+    double t0 = nowMs();
+    if (!generateMaze(&labyrinth, rows, cols, MAZE_DFS, 1)) {
+        printf("Error: Failed to generate a %dx%d maze.\n", rows, cols);
+        return false;
+    }
+    double genMs = nowMs() - t0;
+    bool saved = saveMap(&labyrinth, path);
+    freeMap(&labyrinth);
+    if (!saved) {
+        printf("Error: Failed to save map to %s.\n", path);
+        return false;
+    }
+
+    t0 = nowMs();
+    if (!loadMap(&labyrinth, path)) {
+        printf("Error: Generated %dx%d maze does not load.\n", rows, cols);
+        return false;
+    }
+    double loadMs = nowMs() - t0;
+
+    invalidateConnectivity(&labyrinth);
+    t0 = nowMs();
+    bool connected = isConnected(&labyrinth);
+    double validateMs = nowMs() - t0;
+    if (!connected) {
+        printf("Error: Generated %dx%d maze is not connected.\n", rows, cols);
+        return false;
+    }
+
+    uint64_t rng = 1;
+    placePlayer(&labyrinth, '0');
+    t0 = nowMs();
+    long moved = 0;
+    for (long i = 0; i < BENCH_MOVES; i++) {
+        moved += movePlayerDir(&labyrinth, '0', nextRandom(&rng) >> 62);
+    }
+    double moveMs = nowMs() - t0;
+
+    FILE *null = fopen("/dev/null", "w");
+    t0 = nowMs();
+    printMap(&labyrinth, null);
+    fflush(null);
+    double renderMs = nowMs() - t0;
+    fclose(null);
+    freeMap(&labyrinth);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    char size[32];
+    snprintf(size, sizeof(size), "%dx%d", rows, cols);
+    printf("%11s %10.1f %10.1f %10.1f %10.1f %10.1f %10ld\n", size, genMs, loadMs, validateMs,
+           BENCH_MOVES / moveMs / 1e3, renderMs, usage.ru_maxrss / 1024);
+    fflush(stdout);
+    return moved > 0;
+}
+
+// --benchmark 100,1000,10000: one row per size (N or RxC), each measured
+// in its own process so that the peak RSS belongs to that size alone.
+// Exits non-zero if any generated map fails to load or validate.
+int runBenchmark(const char *sizes) {
+    char path[] = "/tmp/labyrinth-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Error: Failed to create a temporary map file.\n");
+        return 1;
+    }
+    close(fd);
+
+    printf("%11s %10s %10s %10s %10s %10s %10s\n", "size", "gen ms", "load ms", "valid ms",
+           "Mmoves/s", "render ms", "maxrss MB");
+    fflush(stdout);
+    int status = 0;
+    for (const char *p = sizes; *p && status == 0; ) {
+        int rows, cols, len;
+        if (sscanf(p, "%dx%d%n", &rows, &cols, &len) != 2) {
+            if (sscanf(p, "%d%n", &rows, &len) != 1) {
+                printf("Error: Bad benchmark size at \"%s\".\n", p);
+                status = 1;
+                break;
+            }
+            cols = rows;
+        }
+        p += len + (p[len] == ',');
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            exit(benchmarkSize(rows, cols, path) ? 0 : 1);
+        }
+        int wstatus;
+        if (pid < 0 || waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) ||
+            WEXITSTATUS(wstatus) != 0) {
+            status = 1;
+        }
+    }
+    unlink(path);
+    return status;
+}
+
+// Place the player in the first empty space if it is not on the map yet
+static bool ensurePlayer(Labyrinth *labyrinth, char playerId) {
+    return findPlayer(labyrinth, playerId).row != -1 ||
+           placePlayer(labyrinth, playerId).row != -1;
+}
+
+// A game served to one or more sessions
+typedef struct {
+    Labyrinth *labyrinth;
+    const char *filename;
+    bool shared; // sessions run concurrently: moves use movePlayerShared()
+    bool dirty; // the map changed since it was last saved
+    pthread_rwlock_t lock; // moves hold it shared, other commands exclusively
+} Game;
+
+// Long-running game server: one command per input line, one reply each.
+//
+//   move <id> <direction>   -> "ok" | "err <reason>"
+//   state                   -> "map <rows> <cols>" followed by the rows
+//   connected               -> "yes" | "no"
+//   reachable <r> <c> <r> <c> -> "yes" | "no" (walls only; cached labels)
+//   path <id> <row> <col>   -> "path <length> <udlr...>" | "err no path"
+//   save                    -> "ok" | "err <reason>"
+//   quit                    -> "ok" (ends the session)
+//
+// A session claims each player it moves until it ends; moving a player
+// claimed by another session fails with "err player taken".
+static void serveSession(Game *game, FILE *in, FILE *out) {
+    Labyrinth *labyrinth = game->labyrinth;
+    char line[256];
+    bool done = false;
+    uint32_t owned = 0;
+    PathFinder finder = {0};
+
+    while (!done && fgets(line, sizeof(line), in)) {
+        char cmd[16] = "", arg1[16] = "", arg2[16] = "";
+        int n = sscanf(line, "%15s %15s %15s", cmd, arg1, arg2);
+        Position from, to;
+        if (n <= 0) {
+            continue; // Blank line
+        }
+
+        bool isMove = strcmp(cmd, "move") == 0;
+        if (isMove) {
+            pthread_rwlock_rdlock(&game->lock);
+        } else {
+            pthread_rwlock_wrlock(&game->lock);
+        }
+
+        if (isMove) {
+            char playerId = arg1[0];
+            bool valid = n == 3 && arg1[1] == '\0' && isValidPlayer(playerId);
+            uint32_t bit = valid ? 1u << (playerId - '0') : 0;
+            Direction dir = parseDirection(arg2, strlen(arg2));
+            if (!valid) {
+                fprintf(out, "err invalid player\n");
+            } else if (!(owned & bit) && !claimPlayer(labyrinth, playerId)) {
+                bool taken = __atomic_load_n(&labyrinth->claimed, __ATOMIC_RELAXED) & bit;
+                fprintf(out, taken ? "err player taken\n" : "err no empty space\n");
+            } else {
+                owned |= bit;
+                bool moved = game->shared ? movePlayerShared(labyrinth, playerId, dir)
+                                          : movePlayerDir(labyrinth, playerId, dir);
+                if (moved) {
+                    __atomic_store_n(&game->dirty, true, __ATOMIC_RELAXED);
+                    fprintf(out, "ok\n");
+                } else {
+                    fprintf(out, "err invalid move\n");
+                }
+            }
+        } else if (strcmp(cmd, "state") == 0) {
+            fprintf(out, "map %d %d\n", labyrinth->rows, labyrinth->cols);
+            printMap(labyrinth, out);
+        } else if (strcmp(cmd, "connected") == 0) {
+            fprintf(out, "%s\n", isConnected(labyrinth) ? "yes" : "no");
+        } else if (strcmp(cmd, "reachable") == 0) {
+            if (sscanf(line, "%*s %d %d %d %d", &from.row, &from.col, &to.row, &to.col) != 4) {
+                fprintf(out, "err usage: reachable row col row col\n");
+            } else {
+                fprintf(out, "%s\n", isReachable(labyrinth, from, to) ? "yes" : "no");
+            }
+        } else if (strcmp(cmd, "path") == 0) {
+            if (sscanf(line, "%*s %c %d %d", &arg1[0], &to.row, &to.col) != 3 ||
+                !isValidPlayer(arg1[0])) {
+                fprintf(out, "err usage: path id row col\n");
+            } else {
+                long len = findPath(&finder, labyrinth, findPlayer(labyrinth, arg1[0]), to);
+                if (len < 0) {
+                    fprintf(out, "err no path\n");
+                } else {
+                    fprintf(out, "path %ld %s\n", len, finder.path);
+                }
+            }
+        } else if (strcmp(cmd, "save") == 0) {
+            if (saveMap(labyrinth, game->filename)) {
+                game->dirty = false;
+                fprintf(out, "ok\n");
+            } else {
+                fprintf(out, "err save failed\n");
+            }
+        } else if (strcmp(cmd, "quit") == 0) {
+            fprintf(out, "ok\n");
+            done = true;
+        } else {
+            fprintf(out, "err unknown command\n");
+        }
+
+        pthread_rwlock_unlock(&game->lock);
+        fflush(out);
+    }
+    fflush(out);
+    freePathFinder(&finder);
+
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        if (owned & (1u << i)) {
+            releasePlayer(labyrinth, '0' + i);
+        }
+    }
+}
+
+// Serve one session on in/out. The map is kept in memory and only
+// written on save, quit and EOF.
+bool serveGame(Labyrinth *labyrinth, const char *filename, FILE *in, FILE *out) {
+    Game game = { labyrinth, filename, false, false, PTHREAD_RWLOCK_INITIALIZER };
+    serveSession(&game, in, out);
+
+    if (game.dirty && !saveMap(labyrinth, filename)) {
+        fprintf(stderr, "Error: Failed to save map to %s.\n", filename);
+        return false;
+    }
+    return true;
+}
+
+static volatile sig_atomic_t stopServer;
+
+static void onStopSignal(int sig) {
+    (void)sig;
+    stopServer = 1;
+}
+
+typedef struct {
+    Game *game;
+    int fd;
+} Connection;
+
+static void *serveConnection(void *arg) {
+    Connection *conn = arg;
+    int outFd = dup(conn->fd);
+    FILE *in = fdopen(conn->fd, "r");
+    FILE *out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+    if (in && out) {
+        serveSession(conn->game, in, out);
+    }
+
+    if (out) {
+        fclose(out);
+    } else if (outFd >= 0) {
+        close(outFd);
+    }
+    if (in) {
+        fclose(in);
+    } else {
+        close(conn->fd);
+    }
+    free(conn);
+    return NULL;
+}
+
+// Serve the game on a Unix socket with one thread per connection, until
+// SIGINT or SIGTERM. Every connection is a serveGame() session, but all
+// of them run at once: moves of different players proceed in parallel,
+// while state, path and save queries wait for in-flight moves and see
+// the map between moves. "quit" only closes its connection. The map is
+// saved when the server stops.
+int serveSocket(Labyrinth *labyrinth, const char *filename, const char *socketPath) {
+    // Detached connection threads may still refer to the game at exit
+    static Game game;
+    game = (Game){ labyrinth, filename, true, false, PTHREAD_RWLOCK_INITIALIZER };
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        printf("Error: Socket path %s is too long.\n", socketPath);
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd, SOMAXCONN) < 0) {
+        printf("Error: Failed to listen on %s.\n", socketPath);
+        if (listenFd >= 0) {
+            close(listenFd);
+        }
+        return 1;
+    }
+
+    // No SA_RESTART, so a stop signal interrupts accept()
+    struct sigaction sa = { .sa_handler = onStopSignal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Connection threads leave the stop signals to this thread
+    sigset_t stopSignals, oldMask;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+
+    while (!stopServer) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            printf("Error: accept failed: %s.\n", strerror(errno));
+            break;
+        }
+
+        Connection *conn = malloc(sizeof(Connection));
+        pthread_t thread;
+        pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+        if (conn) {
+            *conn = (Connection){ &game, fd };
+        }
+        if (!conn || pthread_create(&thread, NULL, serveConnection, conn) != 0) {
+            close(fd);
+            free(conn);
+        } else {
+            pthread_detach(thread);
+        }
+        pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    }
+    close(listenFd);
+    unlink(socketPath);
+
+    // Save with the lock held and keep it: connections still open stop
+    // at their next command and end with the process
+    pthread_rwlock_wrlock(&game.lock);
+    if (game.dirty && !saveMap(labyrinth, filename)) {
+        printf("Error: Failed to save map to %s.\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+// Apply a script of moves in memory. Moves are a player digit followed
+// by a direction, separated by any whitespace: "0 up\n1 left\n" and
+// "0u 1l" are the same script. Players missing from the map are placed
+// first, like the --move option does. If report is given, one character
+// per move is written to it ('1' moved, '0' blocked), then a newline.
+// Returns the number of successful moves, or -1 on a malformed script.
+long runMoves(Labyrinth *labyrinth, const char *script, size_t size, FILE *report) {
+    const char *p = script, *end = script + size;
+    long moved = 0;
+
+    while (true) {
+        while (p < end && isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        char playerId = *p++;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const char *word = p;
+        while (p < end && isalpha((unsigned char)*p)) {
+            p++;
+        }
+        Direction dir = parseDirection(word, p - word);
+        if (!isValidPlayer(playerId) || dir == DIR_INVALID) {
+            fprintf(stderr, "Error: Bad move at offset %zu.\n", (size_t)(word - script));
+            return -1;
+        }
+
+        bool ok = ensurePlayer(labyrinth, playerId) && movePlayerDir(labyrinth, playerId, dir);
+        moved += ok;
+        if (report) {
+            putc_unlocked(ok ? '1' : '0', report);
+        }
+    }
+
+    if (report) {
+        putc('\n', report);
+    }
+    return moved;
+}
+
+// Read a whole file (or stdin for "-") into memory
+static char *readAll(const char *filename, size_t *size) {
+    FILE *file = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    if (!file) {
+        return NULL;
+    }
+
+    size_t cap = 1 << 16, len = 0;
+    char *buf = malloc(cap);
+    while (buf) {
+        len += fread(buf + len, 1, cap - len, file);
+        if (len < cap) {
+            break;
+        }
+        char *bigger = realloc(buf, cap * 2);
+        if (!bigger) {
+            free(buf);
+            buf = NULL;
+        }
+        buf = bigger;
+        cap *= 2;
+    }
+
+    if (file != stdin) {
+        fclose(file);
+    }
+    *size = len;
+    return buf;
+}
+
+// --moves: apply a move script, save once, print the map
+int runBatch(const char *mapFile, const char *movesFile, bool report) {
+    Labyrinth labyrinth;
+    if (!loadMap(&labyrinth, mapFile)) {
+        printf("Error: Failed to load map from %s.\n", mapFile);
+        return 1;
+    }
+
+    size_t size;
+    char *script = readAll(movesFile, &size);
+    if (!script) {
+        printf("Error: Failed to read moves from %s.\n", movesFile);
+        return 1;
+    }
+
+    long moved = runMoves(&labyrinth, script, size, report ? stdout : NULL);
+    free(script);
+    if (moved < 0) {
+        printf("Error: Invalid move script.\n");
+        return 1;
+    }
+
+    if (!saveMap(&labyrinth, mapFile)) {
+        printf("Error: Failed to save map to %s.\n", mapFile);
+        return 1;
+    }
+
+    printMap(&labyrinth, stdout);
+    freeMap(&labyrinth);
+    return 0;
+}
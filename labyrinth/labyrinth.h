@@ -1,25 +1,139 @@
-#define MAX_ROWS 100
-#define MAX_COLS 100
 #define VERSION_INFO "Labyrinth Game"
 
+// Rows are padded to a multiple of this many bytes (one cache line)
+#define MAP_ALIGN 64
+
+#define MAX_PLAYERS 10
+
+typedef struct {
+    int row;
+    int col;
+} Position;
+
+typedef enum {
+    DIR_UP,
+    DIR_DOWN,
+    DIR_LEFT,
+    DIR_RIGHT,
+    DIR_INVALID,
+} Direction;
+
+// Wall connectivity, computed once per wall layout. Moves never change
+// walls, so this stays valid for a whole game; code that edits walls
+// through cellAt() must call invalidateConnectivity(), which also gives
+// the map a new generation so findPath() drops its distance table.
+typedef struct {
+    bool checked;   // "connected" is up to date
+    bool connected; // all non-wall cells form one component
+    int components; // number of components, once labelled
+    uint32_t *label; // component of each horizontal run of non-wall cells
+    uint32_t *runStart; // first column of each run
+    size_t *rowRuns; // runs of row i are [rowRuns[i], rowRuns[i + 1])
+    uint32_t *cellLabel; // component of cell (row, col) at row * cols + col, UINT32_MAX for walls
+} Connectivity;
+
+// Cells changed since the last save, beyond which a save rewrites the
+// whole file
+#define MAP_DIRTY_MAX 64
+
+// Layout of the file the map was loaded from. While the file is
+// unchanged on disk and every line has the same length, cell (row, col)
+// lives at byte row * lineStride + col, and saveMap() only rewrites the
+// dirty cells there instead of the whole file.
 typedef struct {
-    char map[MAX_ROWS][MAX_COLS];
+    size_t lineStride; // bytes per line including "\n" or "\r\n", 0 if lines differ
+    int64_t size; // file size when loaded or last saved, -1 if unknown
+    uint64_t dev, ino; // identity of the file, to notice it was replaced
+    uint64_t *dirty; // one bit per cell (row * cols + col) changed since the last save
+} MapFile;
+
+// The map is one row-major buffer surrounded by a one-cell border of
+// walls ('#'), so the neighbours of every map cell can be read without
+// bounds checks. Use cellAt() to address cell (row, col); row and col
+// may be -1 or rows/cols to reach the border.
+//
+// Player positions and the first empty cell are indexed so that player
+// operations do not scan the map; change players only through
+// placePlayer() and movePlayer() to keep the index in sync.
+//
+// Several threads may move players at once through claimPlayer() and
+// movePlayerShared(); each player is moved only by the thread that
+// claimed it, cells are taken with atomic compare-and-swap, and moves
+// racing for one cell go to the lowest player id.
+typedef struct {
+    char *cells; // (rows + 2) * stride bytes, including the border
     int rows;
     int cols;
+    int stride; // bytes between vertically adjacent cells
+    Position players[MAX_PLAYERS]; // where player '0' + i is, or {-1, -1}
+    size_t freeCursor; // no empty cell before row-major index freeCursor
+    Connectivity conn;
+    MapFile file;
+    uint32_t claimed; // bit i is set while player '0' + i is claimed
+    uint64_t generation; // new for every map and wall change, never reused
 } Labyrinth;
 
+// Maps with at most this many non-wall cells get an all-pairs distance
+// table (2 bytes per pair) on the first path query
+#define PATH_CACHE_MAX_CELLS 2048
+
+// Reusable state for findPath(). Search buffers are sized for the
+// largest map seen and kept between queries; zero-initialise before
+// first use and release with freePathFinder().
 typedef struct {
-    int row;
-    int col;
-} Position;
+    uint32_t *queue; // BFS frontier: ring buffer of cell offsets
+    size_t queueCap; // power of two
+    uint64_t *visited; // one bit per cell of the padded grid
+    uint8_t *step; // direction taken into each visited cell
+    size_t cells; // capacity of visited and step, in cells
+    char *path; // last path found, as 'u'/'d'/'l'/'r' letters
+    size_t pathCap;
+    uint64_t cachedFor; // map generation the distance table belongs to, 0 if none
+    int32_t *openId; // dense id of each non-wall cell, -1 for walls
+    uint16_t *dist; // dist[a * openCount + b], UINT16_MAX if unreachable
+    int openCount;
+} PathFinder;
+
+typedef enum {
+    MAZE_DFS, // corridors one cell wide, exactly one path between cells
+    MAZE_CAVE, // open caves grown by a cellular automaton
+    MAZE_INVALID,
+} MazeAlgorithm;
 
+static inline char *cellAt(Labyrinth *labyrinth, int row, int col) {
+    return labyrinth->cells + (size_t)(row + 1) * labyrinth->stride + (col + 1);
+}
 
 bool isValidPlayer(char playerId);
+bool allocMap(Labyrinth *labyrinth, int rows, int cols);
+void freeMap(Labyrinth *labyrinth);
+bool parseMap(Labyrinth *labyrinth, const char *data, size_t size);
 bool loadMap(Labyrinth *labyrinth, const char *filename);
+void printMap(Labyrinth *labyrinth, FILE *file);
 Position findPlayer(Labyrinth *labyrinth, char playerId);
 Position findFirstEmptySpace(Labyrinth *labyrinth);
+Position placePlayer(Labyrinth *labyrinth, char playerId);
 bool isEmptySpace(Labyrinth *labyrinth, int row, int col);
+Direction parseDirection(const char *text, size_t len);
 bool movePlayer(Labyrinth *labyrinth, char playerId, const char *direction);
+bool movePlayerDir(Labyrinth *labyrinth, char playerId, Direction dir);
+bool claimPlayer(Labyrinth *labyrinth, char playerId);
+void releasePlayer(Labyrinth *labyrinth, char playerId);
+bool movePlayerShared(Labyrinth *labyrinth, char playerId, Direction dir);
+bool reserveMoveShared(Labyrinth *labyrinth, char playerId, Direction dir);
+bool commitMoveShared(Labyrinth *labyrinth, char playerId, Direction dir);
+long runMoves(Labyrinth *labyrinth, const char *script, size_t size, FILE *report);
+int runBatch(const char *mapFile, const char *movesFile, bool report);
 bool saveMap(Labyrinth *labyrinth, const char *filename);
+size_t countDirtyCells(Labyrinth *labyrinth);
 bool isConnected(Labyrinth *labyrinth);
+bool isReachable(Labyrinth *labyrinth, Position from, Position to);
+void invalidateConnectivity(Labyrinth *labyrinth);
+long findPath(PathFinder *finder, Labyrinth *labyrinth, Position from, Position to);
+void freePathFinder(PathFinder *finder);
+MazeAlgorithm parseMazeAlgorithm(const char *name);
+bool generateMaze(Labyrinth *labyrinth, int rows, int cols, MazeAlgorithm algo, uint64_t seed);
+int runBenchmark(const char *sizes);
+bool serveGame(Labyrinth *labyrinth, const char *filename, FILE *in, FILE *out);
+int serveSocket(Labyrinth *labyrinth, const char *filename, const char *socketPath);
 void printUsage();
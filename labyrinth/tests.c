@@ -1,4 +1,8 @@
 #include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "testkit.h"
 #include "labyrinth.h"
 
@@ -58,6 +62,36 @@ SystemTest(test_invalid_player,
 }
 
 
+// Build a map from newline-terminated rows
+static Labyrinth makeMap(const char *rows) {
+    Labyrinth lab;
+    tk_assert(parseMap(&lab, rows, strlen(rows)), "Should parse test map");
+    return lab;
+}
+
+// Test batch moves from a script file
+static void setup_moves_script() {
+    setup_test_map();
+    FILE *f = fopen("test.moves", "w");
+    tk_assert(f != NULL, "Should be able to create moves file");
+    fprintf(f, "1 right\n1d 1u\n2l\n");
+    fclose(f);
+}
+
+static void cleanup_moves_script() {
+    cleanup_test_map();
+    remove("test.moves");
+}
+
+SystemTest(test_batch_moves,
+    ((const char *[]){ "--map", "test.map", "--moves", "test.moves", "--report" }),
+    .init = setup_moves_script,
+    .fini = cleanup_moves_script) {
+    tk_assert(result->exit_status == 0, "Must exit 0");
+    tk_assert(strncmp(result->output, "1110\n", 5) == 0, "Must report per-move outcomes");
+    tk_assert(strstr(result->output, "21..\n") != NULL, "Must print the final map");
+}
+
 UnitTest(example_test) {
     tk_assert(1 == 1, "This should never fail.");
 }
@@ -72,15 +106,11 @@ UnitTest(test_valid_player_id) {
 }
 
 UnitTest(test_empty_space) {
-    Labyrinth lab = {
-        .rows = 3,
-        .cols = 3,
-        .map = {
-            "..#",
-            "#..",
-            "..."
-        }
-    };
+    Labyrinth lab = makeMap(
+        "..#\n"
+        "#..\n"
+        "...\n"
+    );
 
     tk_assert(isEmptySpace(&lab, 0, 0) == true, "Should be an empty space");
     tk_assert(isEmptySpace(&lab, 0, 2) == false, "Wall position should not be empty");
@@ -91,41 +121,29 @@ UnitTest(test_empty_space) {
 // Test maze connectivity check
 UnitTest(test_maze_connectivity) {
     // Test connected maze
-    Labyrinth connected = {
-        .rows = 3,
-        .cols = 3,
-        .map = {
-            "...",
-            ".#.",
-            "..."
-        }
-    };
+    Labyrinth connected = makeMap(
+        "...\n"
+        ".#.\n"
+        "...\n"
+    );
     tk_assert(isConnected(&connected) == true, "Connected maze should return true");
 
     // Test disconnected maze
-    Labyrinth disconnected = {
-        .rows = 3,
-        .cols = 3,
-        .map = {
-            "..#",
-            "###",
-            "#.."
-        }
-    };
+    Labyrinth disconnected = makeMap(
+        "..#\n"
+        "###\n"
+        "#..\n"
+    );
     tk_assert(isConnected(&disconnected) == false, "Disconnected maze should return false");
 }
 
 
 UnitTest(test_find_player) {
-    Labyrinth lab = {
-        .rows = 3,
-        .cols = 3,
-        .map = {
-            "..1",
-            "...",
-            "..."
-        }
-    };
+    Labyrinth lab = makeMap(
+        "..1\n"
+        "...\n"
+        "...\n"
+    );
 
     Position pos = findPlayer(&lab, '1');
     tk_assert(pos.row == 0 && pos.col == 2, "Should find correct player position");
@@ -136,15 +154,744 @@ UnitTest(test_find_player) {
 
 
 UnitTest(test_find_first_empty) {
-    Labyrinth lab = {
-        .rows = 2,
-        .cols = 2,
-        .map = {
-            "#.",
-            "##"
-        }
-    };
+    Labyrinth lab = makeMap(
+        "#.\n"
+        "##\n"
+    );
 
     Position pos = findFirstEmptySpace(&lab);
     tk_assert(pos.row == 0 && pos.col == 1, "Should find first empty position");
 }
+
+// Test the long-running --serve command loop
+UnitTest(test_serve_commands, .init = setup_test_map, .fini = cleanup_test_map) {
+    Labyrinth lab;
+    tk_assert(loadMap(&lab, "test.map"), "Should load test map");
+
+    char input[] = "move 1 right\nstate\nmove 1 up\nmove X up\nbogus\nquit\n";
+    char output[512] = {0};
+    FILE *in = fmemopen(input, strlen(input), "r");
+    FILE *out = fmemopen(output, sizeof(output), "w");
+    tk_assert(serveGame(&lab, "test.map", in, out), "Serve loop should succeed");
+    fclose(in);
+    fclose(out);
+
+    tk_assert(strcmp(output,
+        "ok\n"
+        "map 3 4\n"
+        ".1..\n"
+        "....\n"
+        "....\n"
+        "err invalid move\n"
+        "err invalid player\n"
+        "err unknown command\n"
+        "ok\n") == 0, "Unexpected serve output:\n%s", output);
+
+    Labyrinth saved;
+    tk_assert(loadMap(&saved, "test.map"), "Should reload saved map");
+    Position pos = findPlayer(&saved, '1');
+    tk_assert(pos.row == 0 && pos.col == 1, "Map should be saved on quit");
+}
+
+// Player positions and the first empty cell are maintained incrementally
+UnitTest(test_player_index) {
+    Labyrinth lab = makeMap(
+        "#.0\n"
+        "...\n"
+    );
+    Position pos = findPlayer(&lab, '0');
+    tk_assert(pos.row == 0 && pos.col == 2, "Player from the map should be indexed");
+
+    pos = placePlayer(&lab, '1');
+    tk_assert(pos.row == 0 && pos.col == 1, "Should place in the first empty space");
+    tk_assert(placePlayer(&lab, '1').row == -1, "Should not place a player twice");
+    pos = placePlayer(&lab, '2');
+    tk_assert(pos.row == 1 && pos.col == 0, "Should place in the next empty space");
+
+    tk_assert(movePlayer(&lab, '1', "down"), "Move down should succeed");
+    pos = findPlayer(&lab, '1');
+    tk_assert(pos.row == 1 && pos.col == 1 && *cellAt(&lab, 1, 1) == '1',
+              "Index should follow the move");
+    pos = findFirstEmptySpace(&lab);
+    tk_assert(pos.row == 0 && pos.col == 1, "Freed cell should become the first empty space");
+
+    tk_assert(!movePlayer(&lab, '1', "left"), "Should not move onto another player");
+    tk_assert(!movePlayer(&lab, '3', "left"), "Should not move a missing player");
+    freeMap(&lab);
+}
+
+// Reachability comes from cached component labels
+UnitTest(test_reachable) {
+    Labyrinth lab = makeMap(
+        "..#..\n"
+        "#.#.#\n"
+        "..#..\n"
+        "####.\n"
+        "1...0\n"
+    );
+    tk_assert(isReachable(&lab, (Position){0, 0}, (Position){2, 0}), "Left side is connected");
+    tk_assert(isReachable(&lab, (Position){0, 3}, (Position){4, 0}), "Right side reaches the bottom");
+    tk_assert(!isReachable(&lab, (Position){0, 0}, (Position){0, 4}), "Sides are separated");
+    tk_assert(!isReachable(&lab, (Position){0, 0}, (Position){0, 2}), "Walls are unreachable");
+    tk_assert(!isReachable(&lab, (Position){0, 0}, (Position){5, 0}), "Outside is unreachable");
+    tk_assert(lab.conn.components == 2 && !isConnected(&lab), "Map has two components");
+
+    // Labels stay valid across moves: players are not obstacles
+    tk_assert(movePlayer(&lab, '1', "right"), "Move should succeed");
+    tk_assert(isReachable(&lab, (Position){4, 1}, (Position){4, 4}), "Players are not walls");
+    freeMap(&lab);
+}
+
+UnitTest(test_parse_direction) {
+    tk_assert(parseDirection("up", 2) == DIR_UP, "up");
+    tk_assert(parseDirection("down", 4) == DIR_DOWN, "down");
+    tk_assert(parseDirection("l", 1) == DIR_LEFT, "l");
+    tk_assert(parseDirection("R", 1) == DIR_RIGHT, "R");
+    tk_assert(parseDirection("righ", 4) == DIR_INVALID, "Prefixes are not directions");
+    tk_assert(parseDirection("upward", 6) == DIR_INVALID, "Longer words are not directions");
+    tk_assert(parseDirection("x", 1) == DIR_INVALID, "x");
+    tk_assert(parseDirection("", 0) == DIR_INVALID, "Empty string");
+}
+
+// Batch scripts accept both "id direction" lines and compact "idd" tokens
+UnitTest(test_run_moves) {
+    Labyrinth lab = makeMap(
+        "0..\n"
+        ".#.\n"
+        "...\n"
+    );
+    const char script[] = "0 right\n0r 0d\n0 down\n1u 1l";
+    char report[64] = {0};
+    FILE *out = fmemopen(report, sizeof(report), "w");
+    long moved = runMoves(&lab, script, strlen(script), out);
+    fclose(out);
+
+    tk_assert(moved == 4, "Expected 4 successful moves, got %ld", moved);
+    tk_assert(strcmp(report, "111100\n") == 0, "Unexpected report: %s", report);
+    Position pos = findPlayer(&lab, '0');
+    tk_assert(pos.row == 2 && pos.col == 2, "Player 0 should end at (2,2)");
+    pos = findPlayer(&lab, '1');
+    tk_assert(pos.row == 0 && pos.col == 0, "Player 1 should be placed at (0,0)");
+
+    tk_assert(runMoves(&lab, "0 sideways", 10, NULL) == -1, "Bad direction should be rejected");
+    tk_assert(runMoves(&lab, "x up", 4, NULL) == -1, "Bad player should be rejected");
+    freeMap(&lab);
+}
+
+// Reference connectivity check: plain BFS over the grid
+static bool referenceConnected(Labyrinth *lab) {
+    int rows = lab->rows, cols = lab->cols;
+    int *queue = malloc(sizeof(int) * rows * cols);
+    bool *seen = calloc(rows * cols, sizeof(bool));
+    int head = 0, tail = 0, open = 0;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            if (*cellAt(lab, i, j) != '#') {
+                if (open++ == 0) {
+                    seen[i * cols + j] = true;
+                    queue[tail++] = i * cols + j;
+                }
+            }
+        }
+    }
+    while (head < tail) {
+        int r = queue[head] / cols, c = queue[head] % cols;
+        head++;
+        int dr[] = {1, -1, 0, 0}, dc[] = {0, 0, 1, -1};
+        for (int k = 0; k < 4; k++) {
+            int nr = r + dr[k], nc = c + dc[k];
+            if (nr >= 0 && nr < rows && nc >= 0 && nc < cols &&
+                *cellAt(lab, nr, nc) != '#' && !seen[nr * cols + nc]) {
+                seen[nr * cols + nc] = true;
+                queue[tail++] = nr * cols + nc;
+            }
+        }
+    }
+    free(queue);
+    free(seen);
+    return tail == open;
+}
+
+// Random map number n around the percolation threshold, where both
+// outcomes are common: mostly small, with some wide and tall ones
+// beyond 64 columns
+static void randomMap(Labyrinth *lab, int n, unsigned *seed) {
+    int rows = 1 + (n * 7) % (n % 10 == 0 ? 500 : 100);
+    int cols = 1 + (n * 13) % (n % 10 == 5 ? 500 : 100);
+    tk_assert(allocMap(lab, rows, cols), "Should allocate map");
+    int wallPercent = 10 + n % 40;
+    for (int i = 0; i < lab->rows; i++) {
+        for (int j = 0; j < lab->cols; j++) {
+            *seed = *seed * 1103515245 + 12345;
+            *cellAt(lab, i, j) = (*seed >> 16) % 100 < wallPercent ? '#' : '.';
+        }
+    }
+}
+
+// Cross-check isConnected and the union-find labels against a BFS
+UnitTest(test_connectivity_random, .timeout_ms = 5000) {
+    unsigned seed = 12345;
+    int connected = 0, maps = 2000;
+
+    for (int n = 0; n < maps; n++) {
+        Labyrinth lab;
+        randomMap(&lab, n, &seed);
+        bool got = isConnected(&lab);
+        bool want = referenceConnected(&lab);
+        tk_assert(got == want, "Map %d (%dx%d): isConnected=%d, reference=%d",
+                  n, lab.rows, lab.cols, got, want);
+
+        // Union-find labels must agree with the flood fill
+        invalidateConnectivity(&lab);
+        Position open = {0, 0};
+        while (open.col < lab.cols && *cellAt(&lab, 0, open.col) == '#') {
+            open.col++;
+        }
+        isReachable(&lab, open, open);
+        if (open.col < lab.cols) {
+            tk_assert(lab.conn.connected == want, "Map %d: %d components, reference=%d",
+                      n, lab.conn.components, want);
+
+            // ... and so must the per-cell labels
+            bool all = true;
+            for (int i = 0; i < lab.rows; i++) {
+                for (int j = 0; j < lab.cols; j++) {
+                    if (*cellAt(&lab, i, j) != '#') {
+                        all &= isReachable(&lab, open, (Position){i, j});
+                    }
+                }
+            }
+            tk_assert(all == want, "Map %d: reachability disagrees with the reference", n);
+        }
+        connected += got;
+        freeMap(&lab);
+    }
+    tk_assert(connected > 0 && connected < maps, "Random maps should cover both outcomes");
+}
+
+// The same random maps, built once per benchmark process
+#define BENCH_RANDOM_MAPS 200
+static Labyrinth benchRandomMaps[BENCH_RANDOM_MAPS];
+
+static void setup_bench_random_maps() {
+    unsigned seed = 12345;
+    for (int n = 0; n < BENCH_RANDOM_MAPS; n++) {
+        randomMap(&benchRandomMaps[n], n, &seed);
+    }
+}
+
+BenchTest(bench_connectivity_random, .init = setup_bench_random_maps) {
+    for (long i = 0; i < bench->iters; i++) {
+        Labyrinth *lab = &benchRandomMaps[i % BENCH_RANDOM_MAPS];
+        invalidateConnectivity(lab);
+        TK_KEEP(isConnected(lab));
+    }
+}
+
+BenchTest(bench_connectivity_reference, .init = setup_bench_random_maps) {
+    for (long i = 0; i < bench->iters; i++) {
+        TK_KEEP(referenceConnected(&benchRandomMaps[i % BENCH_RANDOM_MAPS]));
+    }
+}
+
+// Maps beyond the old 100x100 limit, with a sentinel border of walls
+static void setup_large_map() {
+    FILE *f = fopen("large.map", "w");
+    tk_assert(f != NULL, "Should be able to create large map file");
+    for (int i = 0; i < 300; i++) {
+        for (int j = 0; j < 1000; j++) {
+            fputc(i % 2 == 1 && j % 4 != (i % 4 == 1 ? 0 : 3) ? '#' : '.', f);
+        }
+        fputs("\r\n", f);
+    }
+    fclose(f);
+}
+
+static void cleanup_large_map() {
+    remove("large.map");
+}
+
+UnitTest(test_large_map, .init = setup_large_map, .fini = cleanup_large_map) {
+    Labyrinth lab;
+    tk_assert(loadMap(&lab, "large.map"), "Should load a 300x1000 map");
+    tk_assert(lab.rows == 300 && lab.cols == 1000, "Wrong size %dx%d", lab.rows, lab.cols);
+    tk_assert(lab.stride % MAP_ALIGN == 0 && lab.stride >= lab.cols + 2, "Bad stride %d", lab.stride);
+    tk_assert(*cellAt(&lab, -1, -1) == '#' && *cellAt(&lab, 300, 1000) == '#' &&
+              *cellAt(&lab, 0, -1) == '#' && *cellAt(&lab, 0, 1000) == '#',
+              "Border should be walls");
+    tk_assert(*cellAt(&lab, 1, 0) == '.' && *cellAt(&lab, 1, 1) == '#', "Cells should be copied");
+    freeMap(&lab);
+
+    tk_assert(!parseMap(&lab, "...\n..\n", 7), "Ragged rows should be rejected");
+    tk_assert(!parseMap(&lab, "..x\n", 4), "Invalid characters should be rejected");
+    tk_assert(!parseMap(&lab, "", 0), "Empty map should be rejected");
+}
+
+// Check that a path found by findPath is walkable and ends at the target
+static void checkPath(Labyrinth *lab, const char *path, Position from, Position to) {
+    Position pos = from;
+    for (const char *p = path; *p; p++) {
+        switch (*p) {
+            case 'u': pos.row--; break;
+            case 'd': pos.row++; break;
+            case 'l': pos.col--; break;
+            case 'r': pos.col++; break;
+            default: tk_assert(false, "Bad step '%c'", *p);
+        }
+        tk_assert(*cellAt(lab, pos.row, pos.col) != '#', "Path walks into a wall at %d,%d",
+                  pos.row, pos.col);
+    }
+    tk_assert(pos.row == to.row && pos.col == to.col, "Path ends at %d,%d", pos.row, pos.col);
+}
+
+UnitTest(test_find_path_small) {
+    Labyrinth lab = makeMap(
+        "0.#....\n"
+        "#.#.##.\n"
+        "#...#..\n"
+        "###.#.#\n"
+        "..#...#\n"
+    );
+    PathFinder finder = {0};
+    Position from = {0, 0}, to = {0, 3};
+    tk_assert(findPath(&finder, &lab, from, to) == 7, "Expected a 7-step path, got %s", finder.path);
+    checkPath(&lab, finder.path, from, to);
+    tk_assert(finder.dist != NULL, "Small maps should use the distance table");
+
+    tk_assert(findPath(&finder, &lab, from, (Position){4, 0}) == -1, "Enclosed cell is unreachable");
+    tk_assert(findPath(&finder, &lab, from, (Position){0, 2}) == -1, "Wall is unreachable");
+    tk_assert(findPath(&finder, &lab, from, from) == 0 && finder.path[0] == '\0', "Empty path");
+    freePathFinder(&finder);
+    freeMap(&lab);
+}
+
+// The distance table follows wall edits (after invalidateConnectivity)
+// and is not mistaken for another map's
+UnitTest(test_find_path_after_wall_edit) {
+    Labyrinth lab = makeMap(
+        "....\n"
+        "....\n"
+        "....\n"
+    );
+    PathFinder finder = {0};
+    Position from = {0, 0}, to = {2, 0};
+    tk_assert(findPath(&finder, &lab, from, to) == 2, "Expected a 2-step path, got %s", finder.path);
+
+    for (int col = 0; col < 3; col++) {
+        *cellAt(&lab, 1, col) = '#';
+    }
+    invalidateConnectivity(&lab);
+    tk_assert(findPath(&finder, &lab, from, to) == 8, "Expected an 8-step detour, got %s", finder.path);
+    checkPath(&lab, finder.path, from, to);
+    freeMap(&lab);
+
+    // A new map, possibly in the same buffer
+    lab = makeMap(
+        "..\n"
+        "#.\n"
+    );
+    tk_assert(findPath(&finder, &lab, from, (Position){1, 1}) == 2, "Expected a 2-step path, got %s",
+              finder.path);
+    checkPath(&lab, finder.path, from, (Position){1, 1});
+    freePathFinder(&finder);
+    freeMap(&lab);
+}
+
+// A serpentine corridor too large for the distance table: BFS path
+UnitTest(test_find_path_large) {
+    Labyrinth lab;
+    int rows = 201, cols = 200;
+    tk_assert(allocMap(&lab, rows, cols), "Should allocate map");
+    for (int i = 0; i < rows; i += 2) {
+        memset(cellAt(&lab, i, 0), '.', cols);
+        if (i + 1 < rows) {
+            *cellAt(&lab, i + 1, (i / 2) % 2 == 0 ? cols - 1 : 0) = '.';
+        }
+    }
+
+    PathFinder finder = {0};
+    Position from = {0, 0}, to = {rows - 1, cols - 1};
+    long len = findPath(&finder, &lab, from, to);
+    tk_assert(finder.dist == NULL, "Large maps should not build the distance table");
+    tk_assert(len == (long)(rows / 2) * (cols + 1) + (cols - 1),
+              "Serpentine path has the wrong length %ld", len);
+    checkPath(&lab, finder.path, from, to);
+
+    // Buffers are reused by the next query
+    len = findPath(&finder, &lab, to, (Position){2, 5});
+    checkPath(&lab, finder.path, to, (Position){2, 5});
+    freePathFinder(&finder);
+    freeMap(&lab);
+}
+
+// Read a whole test file into buf
+static size_t readFile(const char *filename, char *buf, size_t size) {
+    FILE *f = fopen(filename, "r");
+    tk_assert(f != NULL, "Should open %s", filename);
+    size_t len = fread(buf, 1, size - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+    return len;
+}
+
+static void writeFile(const char *filename, const char *text) {
+    FILE *f = fopen(filename, "w");
+    tk_assert(f != NULL, "Should create %s", filename);
+    fputs(text, f);
+    fclose(f);
+}
+
+// A move rewrites only the changed cells, in place, keeping CRLF lines
+UnitTest(test_save_patches_in_place, .fini = cleanup_test_map) {
+    writeFile("test.map", "1..#\r\n....\r\n#..2\r\n");
+    struct stat before, after;
+    tk_assert(stat("test.map", &before) == 0, "Should stat map");
+
+    Labyrinth lab;
+    tk_assert(loadMap(&lab, "test.map"), "Should load CRLF map");
+    tk_assert(lab.file.lineStride == 6, "CRLF lines are 6 bytes");
+    tk_assert(movePlayer(&lab, '1', "down") && movePlayer(&lab, '2', "left"), "Should move");
+    tk_assert(countDirtyCells(&lab) == 4, "Two moves dirty four cells");
+    tk_assert(saveMap(&lab, "test.map"), "Should save");
+    tk_assert(countDirtyCells(&lab) == 0, "Save clears the dirty cells");
+
+    char buf[64];
+    readFile("test.map", buf, sizeof(buf));
+    tk_assert(strcmp(buf, "...#\r\n1...\r\n#.2.\r\n") == 0, "Unexpected map: %s", buf);
+    tk_assert(stat("test.map", &after) == 0 && after.st_ino == before.st_ino,
+              "Small saves must not replace the file");
+    freeMap(&lab);
+}
+
+// Saves fall back to replacing the whole file when patching is unsafe
+UnitTest(test_save_replaces_file, .fini = cleanup_test_map) {
+    writeFile("test.map", "1...\n....\n....\n");
+    Labyrinth lab;
+    tk_assert(loadMap(&lab, "test.map"), "Should load map");
+
+    // The file changed size behind our back: rewrite it from memory
+    writeFile("test.map", "1...\n....\n....\n....\n");
+    tk_assert(movePlayer(&lab, '1', "right"), "Should move");
+    tk_assert(saveMap(&lab, "test.map"), "Should save");
+    char buf[256];
+    readFile("test.map", buf, sizeof(buf));
+    tk_assert(strcmp(buf, ".1..\n....\n....\n") == 0, "Unexpected map: %s", buf);
+
+    // Moving back and forth keeps the dirty cells few
+    for (int i = 0; i < MAP_DIRTY_MAX; i++) {
+        tk_assert(movePlayer(&lab, '1', i % 2 ? "up" : "down"), "Should move");
+    }
+    tk_assert(countDirtyCells(&lab) == 2, "Repeated cells are counted once");
+    freeMap(&lab);
+
+    // Too many changed cells to patch
+    char row[2 * MAP_DIRTY_MAX + 2];
+    memset(row, '.', sizeof(row) - 1);
+    row[0] = '1';
+    row[sizeof(row) - 1] = '\0';
+    writeFile("test.map", row);
+    tk_assert(loadMap(&lab, "test.map"), "Should load map");
+    for (int i = 0; i < MAP_DIRTY_MAX; i++) {
+        tk_assert(movePlayer(&lab, '1', "right"), "Should move");
+    }
+    tk_assert(countDirtyCells(&lab) > MAP_DIRTY_MAX, "Too many cells to patch");
+    tk_assert(saveMap(&lab, "test.map"), "Should save");
+    readFile("test.map", buf, sizeof(buf));
+    tk_assert(buf[MAP_DIRTY_MAX] == '1' && buf[sizeof(row) - 1] == '\n', "Unexpected map: %s", buf);
+
+    // Nothing is left behind by the temporary file
+    DIR *dir = opendir(".");
+    for (struct dirent *e; (e = readdir(dir)); ) {
+        tk_assert(strncmp(e->d_name, "test.map.", 9) != 0, "Stray file %s", e->d_name);
+    }
+    closedir(dir);
+    freeMap(&lab);
+}
+
+// Claiming, moving and releasing shared players: racing moves go to the
+// lowest id, a move into a taken cell fails, and claims place new
+// players like placePlayer()
+UnitTest(test_shared_claim_and_move) {
+    Labyrinth lab = makeMap("0.1\n");
+    tk_assert(claimPlayer(&lab, '0') && claimPlayer(&lab, '1'), "Should claim both players");
+    tk_assert(!claimPlayer(&lab, '0'), "A claimed player cannot be claimed again");
+
+    // The higher id reserves the cell first, yet the lower id gets it
+    tk_assert(reserveMoveShared(&lab, '1', DIR_LEFT), "Should reserve the empty cell");
+    tk_assert(reserveMoveShared(&lab, '0', DIR_RIGHT), "A lower id takes the reservation over");
+    tk_assert(!reserveMoveShared(&lab, '1', DIR_LEFT), "A higher id cannot take it back");
+    tk_assert(!commitMoveShared(&lab, '1', DIR_LEFT), "The higher id's move fails");
+    tk_assert(commitMoveShared(&lab, '0', DIR_RIGHT), "The lower id's move wins");
+    tk_assert(!movePlayerShared(&lab, '1', DIR_LEFT), "A committed cell is taken");
+    tk_assert(strncmp(cellAt(&lab, 0, 0), ".01", 3) == 0, "Unexpected map");
+
+    releasePlayer(&lab, '0');
+    tk_assert(claimPlayer(&lab, '0'), "Released players can be claimed again");
+    tk_assert(claimPlayer(&lab, '2'), "New players are placed in the first empty space");
+    tk_assert(*cellAt(&lab, 0, 0) == '2', "Unexpected map");
+    tk_assert(!claimPlayer(&lab, '3'), "No empty space to place a new player");
+    tk_assert(!(lab.claimed & (1u << 3)), "A failed claim must not hold the player");
+    freeMap(&lab);
+}
+
+// Shared moves count each changed cell once, like movePlayer()
+UnitTest(test_shared_moves_dirty_cells, .fini = cleanup_test_map) {
+    writeFile("test.map", "0...\n....\n");
+    Labyrinth lab;
+    tk_assert(loadMap(&lab, "test.map"), "Should load map");
+    tk_assert(claimPlayer(&lab, '0'), "Should claim player");
+    for (int i = 0; i < 4 * MAP_DIRTY_MAX; i++) {
+        tk_assert(movePlayerShared(&lab, '0', i % 2 ? DIR_UP : DIR_DOWN), "Should move");
+    }
+    tk_assert(countDirtyCells(&lab) == 2, "Repeated cells are counted once");
+    tk_assert(saveMap(&lab, "test.map"), "Should save");
+    char buf[256];
+    readFile("test.map", buf, sizeof(buf));
+    tk_assert(strcmp(buf, "0...\n....\n") == 0, "Unexpected map: %s", buf);
+    freeMap(&lab);
+}
+
+#define STRESS_MOVES 200000
+
+struct mover {
+    Labyrinth *lab;
+    pthread_barrier_t *start;
+    char playerId;
+    long moved;
+};
+
+static void *moveRandomly(void *arg) {
+    struct mover *m = arg;
+    unsigned seed = m->playerId;
+    tk_assert(claimPlayer(m->lab, m->playerId), "Should claim player %c", m->playerId);
+    pthread_barrier_wait(m->start);
+    for (int i = 0; i < STRESS_MOVES; i++) {
+        m->moved += movePlayerShared(m->lab, m->playerId, rand_r(&seed) % 4);
+    }
+    releasePlayer(m->lab, m->playerId);
+    return NULL;
+}
+
+// All ten players move at random in a small room at once: afterwards
+// every player is on the map exactly once, where the index says
+UnitTest(test_shared_moves_stress) {
+    Labyrinth lab = makeMap(
+        "0.1.2.3.4\n"
+        ".........\n"
+        "..#...#..\n"
+        ".........\n"
+        "5.6.7.8.9\n"
+    );
+    long open = 0;
+    for (int i = 0; i < lab.rows; i++) {
+        for (int j = 0; j < lab.cols; j++) {
+            open += *cellAt(&lab, i, j) != '#';
+        }
+    }
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, MAX_PLAYERS);
+    pthread_t threads[MAX_PLAYERS];
+    struct mover movers[MAX_PLAYERS];
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        movers[i] = (struct mover){ &lab, &start, '0' + i, 0 };
+        pthread_create(&threads[i], NULL, moveRandomly, &movers[i]);
+    }
+    long moved = 0;
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        pthread_join(threads[i], NULL);
+        moved += movers[i].moved;
+    }
+    pthread_barrier_destroy(&start);
+    tk_assert(moved > 0, "Some moves should succeed");
+
+    int seen[MAX_PLAYERS] = {0};
+    long empty = 0;
+    for (int i = 0; i < lab.rows; i++) {
+        for (int j = 0; j < lab.cols; j++) {
+            char c = *cellAt(&lab, i, j);
+            if (c >= '0' && c <= '9') {
+                seen[c - '0']++;
+                Position pos = findPlayer(&lab, c);
+                tk_assert(pos.row == i && pos.col == j, "Player %c is not where indexed", c);
+            }
+            empty += c == '.';
+        }
+    }
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        tk_assert(seen[i] == 1, "Player %d appears %d times", i, seen[i]);
+    }
+    tk_assert(empty == open - MAX_PLAYERS, "Empty cells were lost or created");
+    tk_assert(lab.claimed == 0, "All players should be released");
+    freeMap(&lab);
+}
+
+#define STRESS_ROUNDS 1000
+
+struct bidder {
+    Labyrinth *lab;
+    pthread_barrier_t *step;
+    char playerId;
+    Direction dir; // this round's move
+    bool moved;
+};
+
+static void *bidRandomly(void *arg) {
+    struct bidder *b = arg;
+    unsigned seed = b->playerId;
+    for (int r = 0; r < STRESS_ROUNDS; r++) {
+        pthread_barrier_wait(b->step); // Everyone bids on the same map
+        b->dir = rand_r(&seed) % 4;
+        reserveMoveShared(b->lab, b->playerId, b->dir);
+        pthread_barrier_wait(b->step); // All reservations overlap
+        b->moved = commitMoveShared(b->lab, b->playerId, b->dir);
+        pthread_barrier_wait(b->step); // The round is checked
+    }
+    return NULL;
+}
+
+// Rounds in which all ten players move at once, every reservation made
+// before any commit: a contested cell always goes to the lowest id,
+// whatever order the threads ran in
+UnitTest(test_shared_moves_lowest_id_wins) {
+    Labyrinth lab = makeMap(
+        "0.1.2\n"
+        ".3.4.\n"
+        "5.6.7\n"
+        ".8.9.\n"
+    );
+    size_t size = ((size_t)lab.rows + 2) * lab.stride;
+    char *before = malloc(size);
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        tk_assert(claimPlayer(&lab, '0' + i), "Should claim player %d", i);
+    }
+
+    pthread_barrier_t step;
+    pthread_barrier_init(&step, NULL, MAX_PLAYERS + 1);
+    pthread_t threads[MAX_PLAYERS];
+    struct bidder bidders[MAX_PLAYERS];
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        bidders[i] = (struct bidder){ &lab, &step, '0' + i, DIR_INVALID, false };
+        pthread_create(&threads[i], NULL, bidRandomly, &bidders[i]);
+    }
+
+    long contested = 0;
+    for (int r = 0; r < STRESS_ROUNDS; r++) {
+        Position from[MAX_PLAYERS];
+        memcpy(before, lab.cells, size);
+        memcpy(from, lab.players, sizeof(from));
+        for (int k = 0; k < 3; k++) {
+            pthread_barrier_wait(&step);
+        }
+
+        // Replay the round: a move wins if its target was empty and no
+        // lower id bid for it
+        for (int i = 0; i < MAX_PLAYERS; i++) {
+            Direction dir = bidders[i].dir;
+            Position to = { from[i].row + (dir == DIR_DOWN) - (dir == DIR_UP),
+                            from[i].col + (dir == DIR_RIGHT) - (dir == DIR_LEFT) };
+            size_t target = cellAt(&lab, to.row, to.col) - lab.cells;
+            bool wins = before[target] == '.';
+            for (int j = 0; j < MAX_PLAYERS && wins; j++) {
+                Direction other = bidders[j].dir;
+                Position toj = { from[j].row + (other == DIR_DOWN) - (other == DIR_UP),
+                                 from[j].col + (other == DIR_RIGHT) - (other == DIR_LEFT) };
+                if (j != i && toj.row == to.row && toj.col == to.col) {
+                    contested += j > i;
+                    wins = j > i;
+                }
+            }
+            tk_assert(bidders[i].moved == wins, "Round %d: player %d %s", r, i,
+                      wins ? "should have won its cell" : "should have lost its cell");
+            Position now = lab.players[i];
+            tk_assert(*cellAt(&lab, now.row, now.col) == '0' + i &&
+                      (wins ? now.row == to.row && now.col == to.col
+                            : now.row == from[i].row && now.col == from[i].col),
+                      "Round %d: player %d is not where it should be", r, i);
+        }
+    }
+    for (int i = 0; i < MAX_PLAYERS; i++) {
+        pthread_join(threads[i], NULL);
+        releasePlayer(&lab, '0' + i);
+    }
+    pthread_barrier_destroy(&step);
+    tk_assert(contested > 0, "Some rounds should have contested cells");
+    free(before);
+    freeMap(&lab);
+}
+
+// Generated mazes are connected and reproducible; DFS mazes are trees
+UnitTest(test_generate_mazes) {
+    static const int sizes[][2] = { {1, 1}, {2, 2}, {1, 40}, {31, 47}, {200, 300} };
+    for (MazeAlgorithm algo = MAZE_DFS; algo <= MAZE_CAVE; algo++) {
+        for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+            int rows = sizes[k][0], cols = sizes[k][1];
+            Labyrinth a, b;
+            if (!generateMaze(&a, rows, cols, algo, 42)) {
+                tk_assert(algo == MAZE_CAVE && rows * cols < 100, "Should generate %dx%d", rows, cols);
+                continue;
+            }
+            tk_assert(generateMaze(&b, rows, cols, algo, 42), "Should generate %dx%d again", rows, cols);
+            tk_assert(isConnected(&a), "Generated %dx%d maze must be connected", rows, cols);
+
+            long open = 0, edges = 0;
+            for (int i = 0; i < rows; i++) {
+                tk_assert(memcmp(cellAt(&a, i, 0), cellAt(&b, i, 0), cols) == 0,
+                          "Same seed must give the same maze");
+                for (int j = 0; j < cols; j++) {
+                    if (*cellAt(&a, i, j) != '#') {
+                        open++;
+                        edges += (*cellAt(&a, i + 1, j) != '#') + (*cellAt(&a, i, j + 1) != '#');
+                    }
+                }
+            }
+            tk_assert(open > 0, "Maze needs an open cell");
+            tk_assert(algo != MAZE_DFS || edges == open - 1, "DFS maze should be a tree");
+            freeMap(&a);
+            freeMap(&b);
+        }
+    }
+    tk_assert(parseMazeAlgorithm("cave") == MAZE_CAVE && parseMazeAlgorithm("x") == MAZE_INVALID,
+              "Algorithm names");
+}
+
+static void cleanup_generated_map() {
+    remove("test.gen");
+}
+
+SystemTest(test_generate_cli,
+    ((const char *[]){ "--map", "test.gen", "--generate", "21x33", "--algo", "cave", "--seed", "7" }),
+    .fini = cleanup_generated_map) {
+    tk_assert(result->exit_status == 0, "Must exit 0");
+    Labyrinth lab;
+    tk_assert(loadMap(&lab, "test.gen"), "Generated map must load");
+    tk_assert(lab.rows == 21 && lab.cols == 33, "Generated map has the wrong size");
+    freeMap(&lab);
+}
+
+SystemTest(bench_small_mazes, ((const char *[]){ "--benchmark", "100,200x300" })) {
+    tk_assert(result->exit_status == 0, "Benchmark must pass");
+    tk_assert(strstr(result->output, "200x300") != NULL, "Must report every size");
+}
+
+// Benchmarks on a generated maze, built once per benchmark process
+static Labyrinth benchMaze;
+
+static void setup_bench_maze() {
+    tk_assert(generateMaze(&benchMaze, 301, 301, MAZE_DFS, 1), "Should generate maze");
+    tk_assert(placePlayer(&benchMaze, '0').row != -1, "Should place player");
+}
+
+BenchTest(bench_move_player, .init = setup_bench_maze) {
+    static const Direction dirs[] = { DIR_DOWN, DIR_UP, DIR_RIGHT, DIR_LEFT };
+    for (long i = 0; i < bench->iters; i++) {
+        TK_KEEP(movePlayerDir(&benchMaze, '0', dirs[i & 3]));
+    }
+}
+
+BenchTest(bench_validate_maze, .init = setup_bench_maze) {
+    for (long i = 0; i < bench->iters; i++) {
+        invalidateConnectivity(&benchMaze);
+        TK_KEEP(isConnected(&benchMaze));
+    }
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# Synthetic procfs generator and pstree benchmark.
+#
+#   ./procgen.py gen /tmp/fakeproc -n 100000 --fanout 8 --chain 500
+#   ./pstree --proc-root /tmp/fakeproc --timing > /dev/null
+#
+#   ./procgen.py bench -n 1000 10000 100000    # scan/build/sort/render table
+
+import argparse
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+NAMES = ["bash", "sshd", "systemd", "kworker", "python3", "nginx", "postgres",
+         "cron", "dbus-daemon", "containerd", "node", "java", "sleep", "make"]
+
+
+def generate(root, n, fanout, chain, seed):
+    """Create root/<pid>/stat for n processes. pid 1 is init; a chain of
+    `chain` processes hangs below it, and the rest form a tree where every
+    process has at most `fanout` children (breadth-first)."""
+    rng = random.Random(seed)
+    root = Path(root)
+    root.mkdir(parents=True, exist_ok=True)
+
+    parents = {1: 0}
+    pid = 2
+
+    # A deep chain: 2 -> 3 -> ... (stresses recursion in build/sort/render)
+    prev = 1
+    while pid <= n and pid - 1 <= chain:
+        parents[pid] = prev
+        prev = pid
+        pid += 1
+
+    # A bushy tree below init with bounded fan-out
+    queue = [1]
+    head = 0
+    children = {}
+    while pid <= n:
+        parent = queue[head]
+        parents[pid] = parent
+        queue.append(pid)
+        children[parent] = children.get(parent, 0) + 1
+        if children[parent] >= fanout:
+            head += 1
+        pid += 1
+
+    for p, pp in parents.items():
+        name = "init" if p == 1 else f"{rng.choice(NAMES)}-{rng.randrange(1000)}"
+        d = root / str(p)
+        d.mkdir(exist_ok=True)
+        with open(d / "stat", "w") as f:
+            f.write(f"{p} ({name}) S {pp} {p} {p} 0 -1 4194560 0 0 0 0\n")
+
+
+def find_pstree():
+    here = Path(__file__).resolve().parent
+    for name in ("pstree-64", "pstree"):
+        executable = here / name
+        if executable.exists() and os.access(executable, os.X_OK):
+            return executable
+    return None
+
+
+def bench(sizes, fanout, chain, runs, flags):
+    pstree = find_pstree()
+    if not pstree:
+        print("Error: Could not find pstree executable")
+        sys.exit(1)
+
+    print(f"{'procs':>8} {'scan':>10} {'build':>10} {'sort':>10} {'render':>10}  (ms, best of {runs})")
+    for n in sizes:
+        tmp = tempfile.mkdtemp(prefix="fakeproc_")
+        try:
+            generate(tmp, n, fanout, chain, seed=n)
+            best = {}
+            for _ in range(runs):
+                r = subprocess.run([str(pstree), "--proc-root", tmp, "--timing", *flags],
+                                   stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+                if r.returncode != 0:
+                    print(f"Error: pstree exited with {r.returncode}: {r.stderr}")
+                    sys.exit(1)
+                for line in r.stderr.splitlines():
+                    key, _, val = line.partition(":")
+                    if val.strip().endswith("ms"):
+                        ms = float(val.split()[0])
+                        best[key] = min(best.get(key, ms), ms)
+            print(f"{n:>8} {best['scan']:>10.2f} {best['build']:>10.2f} "
+                  f"{best['sort']:>10.2f} {best['render']:>10.2f}")
+        finally:
+            shutil.rmtree(tmp, ignore_errors=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Synthetic /proc generator for pstree")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    g = sub.add_parser("gen", help="generate a fake procfs tree")
+    g.add_argument("root", help="output directory")
+    g.add_argument("-n", type=int, default=1000, help="number of processes")
+
+    b = sub.add_parser("bench", help="time pstree phases on generated trees")
+    b.add_argument("-n", type=int, nargs="+", default=[1000, 10000, 100000],
+                   help="process counts to benchmark")
+    b.add_argument("--runs", type=int, default=3, help="runs per size")
+    b.add_argument("--numeric-sort", action="store_true", help="pass -n to pstree")
+
+    for p in (g, b):
+        p.add_argument("--fanout", type=int, default=8, help="max children per process")
+        p.add_argument("--chain", type=int, default=100, help="length of a deep parent chain")
+    g.add_argument("--seed", type=int, default=0)
+
+    args = parser.parse_args()
+    if args.cmd == "gen":
+        generate(args.root, args.n, args.fanout, args.chain, args.seed)
+    else:
+        bench(args.n, args.fanout, args.chain, args.runs,
+              ["-n"] if args.numeric_sort else [])
+
+
+if __name__ == "__main__":
+    main()
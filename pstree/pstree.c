@@ -7,9 +7,12 @@
 #include <testkit.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <time.h>
 
 #define MAX_PID_NUM 4194304
+#define DEFAULT_PROC_ROOT "/proc"
 
 // Process structure
 typedef struct {
@@ -27,18 +30,27 @@ typedef struct ProcessNode {
 } ProcessNode;
 
 // Function prototypes
-Process* get_proc_info(int* count);
+Process* get_proc_info(const char* proc_root, int* count);
 ProcessNode* build_process_tree(Process* processes, int proc_count);
 ProcessNode* find_init_process(Process* processes, int proc_count);
-void print_process_tree(ProcessNode* node, bool show_pids, bool numeric_sort, int depth);
+void sort_process_tree(ProcessNode* node, bool numeric_sort);
+void print_process_tree(ProcessNode* node, bool show_pids, int depth);
 void free_process_tree(ProcessNode* node);
 
+// Monotonic clock in milliseconds, for --timing
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
 int main(int argc, char *argv[]) {
 
     // Default options
     bool show_pids = false;
     bool numeric_sort = false;
-    char choice = 0;
+    bool timing = false;
+    const char* proc_root = DEFAULT_PROC_ROOT;
 
     // Argument parsing
     for (int i = 1; i < argc; i++) {
@@ -46,6 +58,14 @@ int main(int argc, char *argv[]) {
             show_pids = true;
         } else if (strcmp(argv[i], "--numeric-sort") == 0 || strcmp(argv[i], "-n") == 0) {
             numeric_sort = true;
+        } else if (strcmp(argv[i], "--proc-root") == 0 || strcmp(argv[i], "-r") == 0) {
+            if (i + 1 >= argc) {
+                printf("Error: %s requires a directory argument.\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            proc_root = argv[++i];
+        } else if (strcmp(argv[i], "--timing") == 0) {
+            timing = true;
         } else if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-V") == 0) {
             if (argc > 2) {
                 printf("Error: --version option cannot be combined with other options.\n");
@@ -56,26 +76,44 @@ int main(int argc, char *argv[]) {
             }
         } else {
             printf("Unknown option: %s\n", argv[i]);
-            printf("Usage: %s [--show-pids|-s] [--numeric-sort|-n] [--version|-v]\n", argv[0]);
+            printf("Usage: %s [--show-pids|-s] [--numeric-sort|-n] [--proc-root|-r DIR] [--timing] [--version|-v]\n", argv[0]);
             return EXIT_FAILURE;
         }
     }
 
     // Get process information
+    double t0 = now_ms();
     int proc_count = 0;
-    Process* processes = get_proc_info(&proc_count);
+    Process* processes = get_proc_info(proc_root, &proc_count);
     if (!processes || proc_count == 0) {
         fprintf(stderr, "Error: Failed to get process information\n");
         return EXIT_FAILURE;
     }
-    
+
     // Build process tree
+    double t1 = now_ms();
     ProcessNode* root = build_process_tree(processes, proc_count);
-    
+
+    // Sort children of every node
+    double t2 = now_ms();
+    sort_process_tree(root, numeric_sort);
+
     // Print process tree
-    print_process_tree(root, show_pids, numeric_sort, 0);
+    double t3 = now_ms();
+    print_process_tree(root, show_pids, 0);
     printf("\n");
-    
+    fflush(stdout);
+    double t4 = now_ms();
+
+    // Report per-phase timings on stderr, so stdout can go to /dev/null
+    if (timing) {
+        fprintf(stderr, "processes: %d\n", proc_count);
+        fprintf(stderr, "scan:   %10.3f ms\n", t1 - t0);
+        fprintf(stderr, "build:  %10.3f ms\n", t2 - t1);
+        fprintf(stderr, "sort:   %10.3f ms\n", t3 - t2);
+        fprintf(stderr, "render: %10.3f ms\n", t4 - t3);
+    }
+
     // Clean up
     free_process_tree(root);
     free(processes);
@@ -83,8 +121,8 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
 }
 
-// Get process information from /proc directory
-Process* get_proc_info(int* count) {
+// Get process information from the /proc directory (or a copy of it under proc_root)
+Process* get_proc_info(const char* proc_root, int* count) {
     // Allocate memory for process array dynamically
     Process* processes = malloc(MAX_PID_NUM * sizeof(Process));
     if (!processes) {
@@ -93,9 +131,9 @@ Process* get_proc_info(int* count) {
     }
     
     int index = 0;
-    DIR* dir = opendir("/proc");
+    DIR* dir = opendir(proc_root);
     if (dir == NULL) {
-        perror("Failed to open /proc directory");
+        fprintf(stderr, "Failed to open %s: %s\n", proc_root, strerror(errno));
         free(processes);
         exit(EXIT_FAILURE);
     }
@@ -105,11 +143,14 @@ Process* get_proc_info(int* count) {
         if (isdigit(entry->d_name[0])) {
             // Get pid
             int pid = atoi(entry->d_name);
+            if (pid <= 0 || pid >= MAX_PID_NUM) {
+                continue;
+            }
             processes[index].pid = pid;
 
             // Get ppid and name
-            char path[256];
-            snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%d/stat", proc_root, pid);
             FILE* file = fopen(path, "r");
             if (file == NULL) {
                 // Skip this process if can't open file
@@ -214,7 +255,12 @@ ProcessNode* build_process_tree(Process* processes, int proc_count) {
     root->children_count = 0;
     
     // Create a map to keep track of nodes by PID for O(1) lookups
-    ProcessNode* node_map[MAX_PID_NUM] = {NULL};
+    // (on the heap: MAX_PID_NUM pointers do not fit on the stack)
+    ProcessNode** node_map = calloc(MAX_PID_NUM, sizeof(ProcessNode*));
+    if (!node_map) {
+        perror("Failed to allocate pid map");
+        exit(EXIT_FAILURE);
+    }
     node_map[root->process.pid] = root;
     
     // First pass: create all nodes
@@ -279,16 +325,17 @@ ProcessNode* build_process_tree(Process* processes, int proc_count) {
             root->children[root->children_count++] = child;
         }
     }
-    
+
+    free(node_map);
     return root;
 }
 
-// Recursively print process tree with box-drawing characters
-void print_process_tree(ProcessNode* node, bool show_pids, bool numeric_sort, int depth) {
+// Recursively sort children by name, or by PID if numeric sort requested
+void sort_process_tree(ProcessNode* node, bool numeric_sort) {
     if (node == NULL) {
         return;
     }
-    
+
     // Sort children if needed
     if (node->children_count > 0) {
         // Sort by PID if numeric sort requested
@@ -315,7 +362,18 @@ void print_process_tree(ProcessNode* node, bool show_pids, bool numeric_sort, in
             }
         }
     }
-    
+
+    for (int i = 0; i < node->children_count; i++) {
+        sort_process_tree(node->children[i], numeric_sort);
+    }
+}
+
+// Recursively print process tree with box-drawing characters
+void print_process_tree(ProcessNode* node, bool show_pids, int depth) {
+    if (node == NULL) {
+        return;
+    }
+
     // Print process name
     if (depth > 0) {
         // For non-root nodes, print appropriate indentation
@@ -340,7 +398,7 @@ void print_process_tree(ProcessNode* node, bool show_pids, bool numeric_sort, in
     
     // Recursively print all children
     for (int i = 0; i < node->children_count; i++) {
-        print_process_tree(node->children[i], show_pids, numeric_sort, depth + 1);
+        print_process_tree(node->children[i], show_pids, depth + 1);
     }
     
     // Add a vertical line after the last child
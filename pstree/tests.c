@@ -123,3 +123,139 @@ SystemTest(invalid_option,
               strstr(result->output, "Invalid") != NULL,
               "Output should mention invalid option or show usage");
 }
+
+// Check the output chunk by chunk as it is printed, without keeping it
+static long streamed_lines;
+
+static void count_lines(const char *chunk, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        tk_assert(chunk[i] != '\0', "Output should be text");
+        streamed_lines += chunk[i] == '\n';
+    }
+}
+
+SystemTest(show_pids_streamed,
+           ((const char *[]){"-p"}), .on_output = count_lines) {
+    tk_assert(result->exit_status == 0,
+              "pstree -p should exit with status 0, got %d",
+              result->exit_status);
+    tk_assert(streamed_lines > 0, "Output should have at least one line");
+}
+
+// ==================== Synthetic /proc (--proc-root) ====================
+
+#include <sys/stat.h>
+
+#define FAKE_PROC "fakeproc.test"
+
+static void fake_proc_entry(int pid, const char *name, int ppid) {
+    char path[256];
+    snprintf(path, sizeof(path), FAKE_PROC "/%d", pid);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), FAKE_PROC "/%d/stat", pid);
+    FILE *f = fopen(path, "w");
+    tk_assert(f != NULL, "Should be able to create %s", path);
+    fprintf(f, "%d (%s) S %d %d %d 0 -1\n", pid, name, ppid, pid, pid);
+    fclose(f);
+}
+
+static void setup_fake_proc() {
+    mkdir(FAKE_PROC, 0755);
+    fake_proc_entry(1, "init", 0);
+    fake_proc_entry(20, "zsh", 1);
+    fake_proc_entry(10, "bash", 1);
+    fake_proc_entry(30, "vim", 10);
+    fake_proc_entry(40, "orphan", 99);  // parent missing: attached to init
+}
+
+static void cleanup_fake_proc() {
+    system("rm -rf " FAKE_PROC);
+}
+
+SystemTest(proc_root_tree,
+           ((const char *[]){"--proc-root", FAKE_PROC, "-p"}),
+           .init = setup_fake_proc, .fini = cleanup_fake_proc) {
+    tk_assert(result->exit_status == 0,
+              "pstree --proc-root should exit with status 0, got %d",
+              result->exit_status);
+    const char *init = strstr(result->output, "init(1)");
+    const char *bash = strstr(result->output, "bash(10)");
+    const char *vim = strstr(result->output, "vim(30)");
+    const char *zsh = strstr(result->output, "zsh(20)");
+    tk_assert(init && bash && vim && zsh && strstr(result->output, "orphan(40)"),
+              "Output should contain every fake process");
+    tk_assert(init < bash && bash < vim && vim < zsh,
+              "Children should be sorted by name and nested under parents");
+}
+
+SystemTest(proc_root_numeric_sort,
+           ((const char *[]){"--proc-root", FAKE_PROC, "-n", "-p"}),
+           .init = setup_fake_proc, .fini = cleanup_fake_proc) {
+    tk_assert(result->exit_status == 0,
+              "pstree --proc-root -n should exit with status 0, got %d",
+              result->exit_status);
+    const char *bash = strstr(result->output, "bash(10)");
+    const char *zsh = strstr(result->output, "zsh(20)");
+    const char *orphan = strstr(result->output, "orphan(40)");
+    tk_assert(bash && zsh && orphan && bash < zsh && zsh < orphan,
+              "Children should be sorted by PID");
+}
+
+SystemTest(proc_root_missing,
+           ((const char *[]){"--proc-root"})) {
+    tk_assert(result->exit_status != 0,
+              "pstree --proc-root without a directory should fail");
+}
+
+SystemTest(proc_root_unreadable,
+           ((const char *[]){"--proc-root", "no-such-proc.test"})) {
+    tk_assert(result->exit_status != 0,
+              "pstree with a missing --proc-root directory should fail");
+    tk_assert(strstr(result->output, "no-such-proc.test") != NULL,
+              "The error should name the directory that failed to open");
+}
+
+// ========================= Benchmarks =========================
+
+// Mirrors the definitions in pstree.c.
+typedef struct {
+    int pid;
+    int ppid;
+    char name[256];
+} Process;
+
+typedef struct ProcessNode ProcessNode;
+
+ProcessNode* build_process_tree(Process* processes, int proc_count);
+void sort_process_tree(ProcessNode* node, bool numeric_sort);
+void free_process_tree(ProcessNode* node);
+
+#define BENCH_PROCS 10000
+
+static Process bench_procs[BENCH_PROCS];
+
+// init, then a tree where each process has up to 8 children
+static void setup_bench_procs() {
+    static const char *names[] = { "bash", "sshd", "kworker", "python3", "nginx" };
+    for (int i = 0; i < BENCH_PROCS; i++) {
+        bench_procs[i].pid = i + 1;
+        bench_procs[i].ppid = i ? i / 8 + 1 : 0;
+        snprintf(bench_procs[i].name, sizeof(bench_procs[i].name),
+                 "%s-%d", i ? names[i % 5] : "init", (i * 7919) % 1000);
+    }
+}
+
+BenchTest(bench_build_tree, .init = setup_bench_procs) {
+    for (long i = 0; i < bench->iters; i++) {
+        ProcessNode* root = build_process_tree(bench_procs, BENCH_PROCS);
+        free_process_tree(root);
+    }
+}
+
+BenchTest(bench_build_and_sort_tree, .init = setup_bench_procs) {
+    for (long i = 0; i < bench->iters; i++) {
+        ProcessNode* root = build_process_tree(bench_procs, BENCH_PROCS);
+        sort_process_tree(root, false);
+        free_process_tree(root);
+    }
+}
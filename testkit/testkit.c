@@ -0,0 +1,1192 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/fcntl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <signal.h>
+#include "testkit.h"
+
+static struct tk_testcase tests[TK_MAX_TESTS];
+
+/**
+ * Add a test case to the test suite. Handles both system tests (calling
+ * main with command-line arguments) and unit tests. This is the only
+ * externally visible function in TestKit.
+ */
+void tk_add_test(struct tk_testcase t) {
+    static int ntests = 0;
+
+    // Only add the test case when TestKit is enabled.
+    if (!getenv(TK_RUN) && !getenv(TK_VERBOSE)) {
+        return;
+    }
+
+    tk_assert(ntests < TK_MAX_TESTS,
+              "TestKit supports up to %d test cases", TK_MAX_TESTS);
+
+    tk_assert(!t.on_output || t.stest, "Only system tests can have on_output");
+
+    tests[ntests] = t;
+
+    if (t.argv) {
+        // This is a system test that calls main().
+        tk_assert(t.stest, "Only system tests can have argv");
+
+        // Test cases specify args via in-place arrays like:
+        //   (char *[]){"first argument", "second argument"})
+        // whose space is stack-allocated. Allocate space and copy.
+
+        // Make space for argv[0] and trailing NULL.
+        struct tk_testcase *cur = &tests[ntests];
+        cur->argc++;
+        cur->argv_copy[cur->argc] = NULL;
+        cur->argv_copy[0] = getenv("_");
+
+        tk_assert(cur->argv_copy[0] != NULL,
+                  "TestKit requires shell put executable in environ; "
+                  "try run with bash");
+
+        for (int i = 1; i < cur->argc; i++) {
+            // String literals are compile-time constants; we are safe to
+            // do only a shallow copy.
+            cur->argv_copy[i] = t.argv[i - 1];
+        }
+
+        // This is important (and tricky): there is a cross-process
+        // "memcpy" of tests to the worker after main(). We must make
+        // sure there is no dangling pointers.
+        cur->argv = cur->argv_copy;
+    }
+
+    ntests++;
+}
+
+// ------------------------------------------------------------------------
+// Below are testkit internal functions for running test cases.
+
+// Benchmark measurements, shared between the test process and TestKit.
+struct tk_bench_result {
+    long iters;
+    int reps;
+    double samples[TK_BENCH_MAX_REPS]; // nanoseconds per operation
+    double median, mad;
+};
+
+// Hardware/software counters of a test case (with TK_PERF), shared
+// between the test process and TestKit.
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[] = {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "page_faults",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+#define TK_PERF_EVENTS (int)(sizeof(perf_events) / sizeof(perf_events[0]))
+
+struct tk_perf_result {
+    int fd[TK_PERF_EVENTS]; // -1 if the counter cannot be opened
+    bool valid[TK_PERF_EVENTS];
+    double counts[TK_PERF_EVENTS]; // per operation for benchmarks
+};
+
+// Open the counters for this process and (inherit) its future children.
+// Counters that are not supported or not permitted, e.g., with
+// kernel.perf_event_paranoid or in a VM, are silently left out.
+static void perf_open(struct tk_perf_result *perf) {
+    for (int i = 0; i < TK_PERF_EVENTS; i++) {
+        struct perf_event_attr attr = {
+            .size = sizeof(attr),
+            .type = perf_events[i].type,
+            .config = perf_events[i].config,
+            .disabled = 1,
+            .inherit = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING,
+        };
+        perf->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        perf->valid[i] = false;
+    }
+}
+
+static void perf_start(struct tk_perf_result *perf) {
+    for (int i = 0; perf && i < TK_PERF_EVENTS; i++) {
+        if (perf->fd[i] >= 0) {
+            ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+// Stop counting and record counts divided by ops. Counts of children are
+// included once they have exited.
+static void perf_stop(struct tk_perf_result *perf, double ops) {
+    for (int i = 0; perf && i < TK_PERF_EVENTS; i++) {
+        uint64_t v[3]; // value, time enabled, time running
+        if (perf->fd[i] < 0) {
+            continue;
+        }
+        ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf->fd[i], v, sizeof(v)) == sizeof(v) && v[2] > 0) {
+            // Scale up if the counter was multiplexed.
+            perf->counts[i] = (double)v[0] * v[1] / v[2] / ops;
+            perf->valid[i] = true;
+        }
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_body(struct tk_testcase *t, long iters) {
+    struct tk_bench bench = { .iters = iters };
+    double start = now_ns();
+    t->btest(&bench);
+    return now_ns() - start;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median_of(double *xs, int n) {
+    qsort(xs, n, sizeof(double), cmp_double);
+    return n % 2 ? xs[n / 2] : (xs[n / 2 - 1] + xs[n / 2]) / 2;
+}
+
+static void run_benchmark(struct tk_testcase *t, struct tk_bench_result *res,
+                          struct tk_perf_result *perf) {
+    // Stay on the CPU we are running on, so that repetitions do not
+    // migrate between cores (and caches) halfway.
+    int cpu = sched_getcpu();
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    // Calibrate: double iters until one run takes a tenth of the target,
+    // then scale up to the target.
+    long iters = 1;
+    double ns;
+    while ((ns = time_body(t, iters)) < TK_BENCH_TARGET_MS * 1e5 && iters < (1L << 40)) {
+        iters *= 2;
+    }
+    if (ns < TK_BENCH_TARGET_MS * 1e6) {
+        iters = iters * (TK_BENCH_TARGET_MS * 1e6 / (ns > 1 ? ns : 1));
+        iters = iters > 0 ? iters : 1;
+    }
+
+    for (int i = 0; i < TK_BENCH_WARMUP; i++) {
+        time_body(t, iters);
+    }
+
+    int reps = t->reps > 0 ? t->reps : TK_BENCH_REPS;
+    reps = reps < TK_BENCH_MAX_REPS ? reps : TK_BENCH_MAX_REPS;
+    double sorted[TK_BENCH_MAX_REPS], dev[TK_BENCH_MAX_REPS];
+    perf_start(perf);
+    for (int i = 0; i < reps; i++) {
+        res->samples[i] = sorted[i] = time_body(t, iters) / iters;
+    }
+    perf_stop(perf, (double)iters * reps);
+    double median = median_of(sorted, reps);
+    for (int i = 0; i < reps; i++) {
+        dev[i] = res->samples[i] > median ? res->samples[i] - median : median - res->samples[i];
+    }
+
+    res->iters = iters;
+    res->reps = reps;
+    res->median = median;
+    res->mad = median_of(dev, reps);
+}
+
+// The output of main() so far, as a string. It ends where the shared
+// offset of the output file is (the file itself is TK_OUTPUT_LIMIT bytes
+// long); a terminating '\0' goes there, replacing the last byte if the
+// output filled the file, and later writes (by the test body) go after it.
+static const char *map_output(bool *truncated) {
+    off_t len = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    *truncated = len >= TK_OUTPUT_LIMIT;
+    if (len <= 0) {
+        return "";
+    }
+    if (*truncated) {
+        len = TK_OUTPUT_LIMIT - 1;
+    }
+    pwrite(STDOUT_FILENO, "", 1, len);
+    lseek(STDOUT_FILENO, len + 1, SEEK_SET);
+    const char *out = mmap(NULL, len + 1, PROT_READ, MAP_SHARED, STDOUT_FILENO, 0);
+    return out != MAP_FAILED ? out : "";
+}
+
+// Feed main()'s output to .on_output while it runs.
+static void stream_output(struct tk_testcase *t, int fd) {
+    static char chunk[TK_OUTPUT_CHUNK];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (n > 0) {
+            t->on_output(chunk, n);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static int run_testcase(struct tk_testcase *t, struct tk_bench_result *bench,
+                        struct tk_perf_result *perf) {
+    int r = 0;
+
+    if (t->init) {
+        // Run test setup
+        t->init();
+    }
+
+    if (t->stest) {
+        // Run system test: call main() manually
+        int main(int, const char **, const char **);
+
+        // With .on_output, main() writes to a pipe that we read here.
+        int pipefd[2];
+        if (t->on_output) {
+            tk_assert(pipe(pipefd) == 0, "pipe() should succeed");
+        }
+
+        perf_start(perf);
+        pid_t child_pid = fork();
+        if (child_pid == 0) {
+            if (t->on_output) {
+                dup2(pipefd[1], STDOUT_FILENO);
+                dup2(pipefd[1], STDERR_FILENO);
+                close(pipefd[0]);
+                close(pipefd[1]);
+            }
+            exit(main(t->argc, t->argv, (const char **)environ));
+        } else {
+            if (t->on_output) {
+                close(pipefd[1]);
+                stream_output(t, pipefd[0]);
+            }
+
+            int status;
+            waitpid(child_pid, &status, 0);
+            perf_stop(perf, 1);
+            if (WIFEXITED(status)) {
+                r = WEXITSTATUS(status);
+            } else if (WIFSIGNALED(status)) {
+                // main() is terminated by a signal;
+                // kill myself :)
+                kill(getpid(), WTERMSIG(status));
+            }
+
+            // Runt the bottom-half (test code).
+            bool truncated = false;
+            const char *output = t->on_output ? "" : map_output(&truncated);
+            t->stest(&(struct tk_result) {
+                .exit_status = r,
+                .output = output,
+                .truncated = truncated,
+            });
+        }
+    } else if (t->btest) {
+        // Run benchmark: calibrate, warm up and time the body.
+        run_benchmark(t, bench, perf);
+    } else {
+        // Run unit test: just run the test code.
+        perf_start(perf);
+        t->utest();
+        perf_stop(perf, 1);
+    }
+
+    return r;
+}
+
+static long timeout_of(struct tk_testcase *t) {
+    return t->timeout_ms > 0 ? t->timeout_ms : TK_TIME_LIMIT_SEC * 1000L;
+}
+
+static void set_timer(struct tk_testcase *t) {
+    long ms = timeout_of(t);
+    struct itimerval timer = {
+        .it_value = { .tv_sec = ms / 1000, .tv_usec = ms % 1000 * 1000 },
+    };
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// Linux does not enforce RLIMIT_RSS: .max_rss_mb is checked against the
+// peak RSS from wait4() when the test case is reaped. The address space
+// is only capped far above it (thread stacks and malloc arenas reserve
+// much more than they touch), to stop a runaway test before it takes
+// all memory.
+static void set_memory_limit(struct tk_testcase *t) {
+    if (t->max_rss_mb <= 0) {
+        return;
+    }
+    unsigned long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%lu", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    rlim_t limit = pages * sysconf(_SC_PAGESIZE) +
+                   ((rlim_t)t->max_rss_mb * TK_AS_FACTOR << 20) + ((rlim_t)TK_AS_SLACK_MB << 20);
+    setrlimit(RLIMIT_AS, &(struct rlimit) { .rlim_cur = limit, .rlim_max = limit });
+}
+
+static void run_cleanup(struct tk_testcase *t) {
+    if (t->fini) {
+        pid_t fini_pid = fork();
+        if (fini_pid == 0) {
+            // Cleanup function may also timeout.
+            set_timer(t);
+            t->fini();
+            exit(0);
+        } else {
+            waitpid(fini_pid, NULL, 0);
+        }
+    }
+}
+
+static char *pcol(const char *s, int color) {
+    // This is a single-threaded one-call per expression hack.
+    static char buf[64];
+
+    if (isatty(STDOUT_FILENO)) {
+        snprintf(buf, sizeof(buf), "\033[0;%dm%s\033[0;0m", color, s);
+    } else {
+        snprintf(buf, sizeof(buf), "%s", s);
+    }
+
+    return buf;
+}
+
+// A test case being run (or finished but not yet reported).
+struct tk_run {
+    pid_t pid;
+    int out_fd; // memfd for fds 1 and 2 of the test process
+    const char *out; // its contents (out_len bytes), once reaped
+    size_t out_len;
+    bool truncated; // the output reached TK_OUTPUT_LIMIT
+    struct tk_bench_result *bench; // MAP_SHARED, for benchmarks
+    struct tk_perf_result *perf; // MAP_SHARED, with TK_PERF
+    int status;
+    struct rusage usage; // of the test process and main() it ran
+    bool done;
+    const char *no_setup; // why its .setup_once fixture failed, or NULL
+};
+
+static bool check_results(struct tk_testcase *t, struct tk_run *run) {
+    // Print test result according to process exit status.
+    bool succ = false;
+    int status = run->status;
+
+    if (run->no_setup) {
+        printf("- [%s] %s (%s)", pcol("FAIL", 31), t->name, t->loc);
+        printf(" - %s\n", pcol(run->no_setup, 33));
+    } else if (t->max_rss_mb > 0 && run->usage.ru_maxrss > t->max_rss_mb * 1024L) {
+        // Checked first: exceeding the limit may be why it crashed.
+        printf("- [%s] %s (%s)", pcol("FAIL", 31), t->name, t->loc);
+        printf(" - %s\n", pcol("Memory limit exceeded", 33));
+    } else if (WIFEXITED(status)) {
+        // Normal exit.
+        succ = true;
+        printf("- [%s] %s (%s)\n", pcol("PASS", 32), t->name, t->loc);
+    } else {
+        // Killed/stopped by a signal.
+        printf("- [%s] %s (%s)", pcol("FAIL", 31), t->name, t->loc);
+        const char *msg = pcol("unknown error", 31);
+
+        if (WIFSIGNALED(status)) {
+            int sig = WTERMSIG(status);
+            switch (sig) {
+                case SIGALRM: msg = pcol("Timeout", 33); break;
+                case SIGABRT: msg = pcol("Assertion fail", 35); break;
+                case SIGSEGV: msg = pcol("Segmentation fault", 36); break;
+                default: msg = pcol(strsignal(sig), 31);
+            }
+        }
+        printf(" - %s\n", msg);
+    }
+
+    return succ;
+}
+
+static void map_testcase(struct tk_testcase *t, struct tk_run *run) {
+    run->bench = NULL;
+    if (t->btest) {
+        run->bench = mmap(NULL,
+            sizeof(struct tk_bench_result),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        tk_assert(run->bench != MAP_FAILED, "mmap() should succeed");
+    }
+    run->perf = NULL;
+    if (getenv(TK_PERF)) {
+        run->perf = mmap(NULL,
+            sizeof(struct tk_perf_result),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        tk_assert(run->perf != MAP_FAILED, "mmap() should succeed");
+    }
+}
+
+static void run_child(struct tk_testcase *t, struct tk_run *run) {
+    // Redirect both stdout and stderr (the file descriptors) to the
+    // output file; processes forked by the test case share it.
+    dup2(run->out_fd, STDOUT_FILENO);
+    dup2(run->out_fd, STDERR_FILENO);
+    close(run->out_fd);
+
+    // Child: run test case for TIME_LIMIT.
+    set_timer(t);
+    set_memory_limit(t);
+    if (run->perf) {
+        perf_open(run->perf);
+    }
+    exit(run_testcase(t, run->bench, run->perf));
+}
+
+// Pass fd along with the test index over a Unix socket.
+static bool send_index(int sock, int i, int fd) {
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {
+        .msg_iov = &(struct iovec) { .iov_base = &i, .iov_len = sizeof(i) },
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(i);
+}
+
+static bool recv_index(int sock, int *i, int *fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {
+        .msg_iov = &(struct iovec) { .iov_base = i, .iov_len = sizeof(*i) },
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(*i)) {
+        return false;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+        return false;
+    }
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return true;
+}
+
+// Test cases sharing a .setup_once fixture are forked from a zygote: a
+// process that ran setup_once() once, then creates test processes from
+// its warmed-up (copy-on-write) memory on request.
+struct tk_zygote {
+    void (*setup)(void);
+    pid_t pid;
+    int sock; // test index to the zygote, test process pid back
+    int status; // exit status, once the zygote is gone
+    double deadline; // for setup_once() to return, in now_ns() time
+    bool ready; // setup_once() has returned
+    bool timed_out; // killed for missing the deadline
+};
+
+static struct tk_zygote zygotes[TK_MAX_FIXTURES];
+static int nzygotes;
+
+static void zygote_process(void (*setup)(void), struct tk_run *runs, int sock) {
+    setup();
+
+    int i, fd;
+    while (recv_index(sock, &i, &fd)) {
+        // CLONE_PARENT makes the test process our sibling, so TestKit
+        // waits for it (and gets its rusage) like for any other.
+        runs[i].out_fd = fd;
+        pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, 0);
+        if (pid == 0) {
+            close(sock);
+            run_child(&tests[i], &runs[i]);
+        }
+        close(fd);
+        send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+    }
+    exit(0);
+}
+
+static struct tk_zygote *get_zygote(void (*setup)(void), struct tk_run *runs) {
+    for (int i = 0; i < nzygotes; i++) {
+        if (zygotes[i].setup == setup) {
+            return &zygotes[i];
+        }
+    }
+    tk_assert(nzygotes < TK_MAX_FIXTURES,
+              "TestKit supports up to %d setup_once fixtures", TK_MAX_FIXTURES);
+
+    int sv[2];
+    tk_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0,
+              "socketpair() should succeed");
+    pid_t pid = fork();
+    tk_assert(pid >= 0, "fork() should succeed");
+    if (pid == 0) {
+        // Other zygotes must see EOF when TestKit closes their sockets.
+        for (int i = 0; i < nzygotes; i++) {
+            close(zygotes[i].sock);
+        }
+        close(sv[0]);
+        zygote_process(setup, runs, sv[1]);
+    }
+    close(sv[1]);
+
+    // setup_once() may take as long as the slowest of its test cases.
+    long limit_ms = 0;
+    for (int i = 0; i < TK_MAX_TESTS && tests[i].enabled; i++) {
+        if (tests[i].setup_once == setup && timeout_of(&tests[i]) > limit_ms) {
+            limit_ms = timeout_of(&tests[i]);
+        }
+    }
+
+    struct tk_zygote *z = &zygotes[nzygotes++];
+    *z = (struct tk_zygote) {
+        .setup = setup, .pid = pid, .sock = sv[0],
+        .deadline = now_ns() + limit_ms * 1e6,
+    };
+    return z;
+}
+
+// Receive the pid of a test process the zygote started. Until
+// setup_once() has returned, wait no longer than its deadline.
+static bool recv_pid(struct tk_zygote *z, pid_t *pid) {
+    struct pollfd pfd = { .fd = z->sock, .events = POLLIN };
+    int n;
+    do {
+        int timeout = -1;
+        if (!z->ready) {
+            double left_ms = (z->deadline - now_ns()) / 1e6;
+            timeout = left_ms > 0 ? (int)left_ms + 1 : 0;
+        }
+        n = poll(&pfd, 1, timeout);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0) {
+        z->timed_out = true;
+        return false;
+    }
+    if (n < 0 || recv(z->sock, pid, sizeof(*pid), MSG_WAITALL) != sizeof(*pid)) {
+        return false;
+    }
+    z->ready = true;
+    return true;
+}
+
+static void stop_zygotes(void) {
+    for (int i = 0; i < nzygotes; i++) {
+        close(zygotes[i].sock);
+        if (zygotes[i].pid > 0) {
+            waitpid(zygotes[i].pid, NULL, 0);
+        }
+    }
+    nzygotes = 0;
+}
+
+// Start the test case; returns false if there is no process to wait for.
+static bool start_testcase(struct tk_testcase *t, struct tk_run *run, struct tk_run *runs) {
+    run->done = false;
+    run->no_setup = NULL;
+    run->out = "";
+    run->out_len = 0;
+    run->truncated = false;
+
+    // The output file has its final size from the start (pages are only
+    // allocated when written) and is sealed against growing: writes
+    // beyond TK_OUTPUT_LIMIT fail, and the output is cut short there.
+    run->out_fd = memfd_create("tk-output", MFD_ALLOW_SEALING);
+    tk_assert(run->out_fd >= 0, "memfd_create() should succeed");
+    tk_assert(ftruncate(run->out_fd, TK_OUTPUT_LIMIT) == 0 &&
+              fcntl(run->out_fd, F_ADD_SEALS, F_SEAL_GROW) == 0,
+              "Output file should be sealed at TK_OUTPUT_LIMIT");
+
+    if (t->setup_once) {
+        struct tk_zygote *z = get_zygote(t->setup_once, runs);
+        int i = run - runs;
+        pid_t pid;
+        if (z->pid > 0 &&
+            send_index(z->sock, i, run->out_fd) &&
+            recv_pid(z, &pid) &&
+            pid > 0) {
+            run->pid = pid;
+            return true;
+        }
+
+        // The zygote is gone: setup_once() crashed, exited or hung.
+        if (z->pid > 0) {
+            if (z->timed_out) {
+                kill(z->pid, SIGKILL);
+            }
+            waitpid(z->pid, &z->status, 0);
+            z->pid = -1;
+        }
+        close(run->out_fd);
+        run->pid = -1;
+        run->status = SIGKILL;
+        run->no_setup = z->timed_out ? "setup_once timed out" : "setup_once failed";
+        run->done = true;
+        return false;
+    }
+
+    // Run test case in a separated process.
+    pid_t pid = fork();
+    tk_assert(pid >= 0, "fork() should succeed");
+    if (pid == 0) {
+        run_child(t, run);
+    }
+    run->pid = pid;
+    return true;
+}
+
+// Map the output of a finished test case; it is only read from now on.
+static void collect_output(struct tk_run *run) {
+    // Test processes write through the offset we share with them.
+    off_t len = lseek(run->out_fd, 0, SEEK_CUR);
+    run->truncated = len >= TK_OUTPUT_LIMIT;
+    if (len > 0) {
+        char *out = mmap(NULL, len, PROT_READ, MAP_SHARED, run->out_fd, 0);
+        if (out != MAP_FAILED) {
+            run->out = out;
+            run->out_len = len;
+        }
+    }
+    close(run->out_fd);
+}
+
+// Print the output; a '\0' separates main()'s output from the test body's.
+static void print_output(struct tk_run *run) {
+    const char *p = run->out, *end = run->out + run->out_len;
+    bool tty = isatty(STDOUT_FILENO);
+    if (tty) {
+        printf("\033[0;90m");
+    }
+    while (p < end) {
+        size_t len = strnlen(p, end - p);
+        fwrite(p, 1, len, stdout);
+        p += len + 1;
+    }
+    if (tty) {
+        printf("\033[0;0m");
+    }
+    if (run->out_len == 0 || run->out[run->out_len - 1] != '\n') {
+        printf("\n");
+    }
+}
+
+static void print_bench(struct tk_bench_result *res) {
+    double ops = res->median > 0 ? 1e9 / res->median : 0;
+    printf("  %.2f ns/op (MAD %.2f, %.1f%%), %.3g ops/s, %ld iters x %d reps\n",
+           res->median, res->mad, res->median > 0 ? 100 * res->mad / res->median : 0,
+           ops, res->iters, res->reps);
+}
+
+static void print_usage(struct rusage *ru) {
+    printf("  %.3fs user, %.3fs sys, %.1f MiB max RSS\n",
+           ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+           ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+           ru->ru_maxrss / 1024.0);
+}
+
+static void print_perf(struct tk_perf_result *perf, bool per_op) {
+    int nvalid = 0;
+    printf("  perf:");
+    for (int i = 0; i < TK_PERF_EVENTS; i++) {
+        if (perf->valid[i]) {
+            printf("%s %.4g %s", nvalid++ ? "," : "", perf->counts[i], perf_events[i].name);
+        }
+    }
+    if (!nvalid) {
+        printf(" counters unavailable (see kernel.perf_event_paranoid)\n");
+        return;
+    }
+    if (perf->valid[0] && perf->valid[1] && perf->counts[0] > 0) {
+        printf(" (%.2f IPC)", perf->counts[1] / perf->counts[0]);
+    }
+    printf("%s\n", per_op ? " per op" : "");
+}
+
+static void write_usage_json(FILE *fp, struct rusage *ru) {
+    fprintf(fp, ", \"user_s\": %.6g, \"sys_s\": %.6g, \"max_rss_kb\": %ld",
+            ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+            ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+            ru->ru_maxrss);
+}
+
+static void write_perf_json(FILE *fp, struct tk_perf_result *perf) {
+    if (!perf) {
+        return;
+    }
+    fprintf(fp, ", \"perf\": {");
+    const char *sep = "";
+    for (int i = 0; i < TK_PERF_EVENTS; i++) {
+        if (perf->valid[i]) {
+            fprintf(fp, "%s\"%s\": %.6g", sep, perf_events[i].name, perf->counts[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(fp, "}");
+}
+
+// Write the results of all passed benchmarks as JSON.
+static void write_bench_json(const char *path, struct tk_run *runs, int ntests) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        printf("- Cannot write benchmark results to %s\n", path);
+        return;
+    }
+    fprintf(fp, "{\n  \"benchmarks\": [");
+    const char *sep = "";
+    for (int i = 0; i < ntests; i++) {
+        struct tk_bench_result *res = runs[i].bench;
+        if (!res || !WIFEXITED(runs[i].status)) {
+            continue;
+        }
+        fprintf(fp, "%s\n    {\"name\": \"%s\", \"loc\": \"%s\", \"iters\": %ld, "
+                    "\"median_ns\": %.6g, \"mad_ns\": %.6g, \"ops_per_sec\": %.6g, "
+                    "\"samples_ns\": [",
+                sep, tests[i].name, tests[i].loc, res->iters,
+                res->median, res->mad, res->median > 0 ? 1e9 / res->median : 0);
+        for (int k = 0; k < res->reps; k++) {
+            fprintf(fp, "%s%.6g", k ? ", " : "", res->samples[k]);
+        }
+        fprintf(fp, "]");
+        write_usage_json(fp, &runs[i].usage);
+        write_perf_json(fp, runs[i].perf);
+        fprintf(fp, "}");
+        sep = ",";
+    }
+    fprintf(fp, "\n  ]");
+
+    // Resource usage (and counters, with TK_PERF) of the other test cases.
+    fprintf(fp, ",\n  \"tests\": [");
+    sep = "";
+    for (int i = 0; i < ntests; i++) {
+        if (runs[i].bench || !WIFEXITED(runs[i].status)) {
+            continue;
+        }
+        fprintf(fp, "%s\n    {\"name\": \"%s\", \"loc\": \"%s\"",
+                sep, tests[i].name, tests[i].loc);
+        write_usage_json(fp, &runs[i].usage);
+        write_perf_json(fp, runs[i].perf);
+        fprintf(fp, "}");
+        sep = ",";
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+}
+
+// Stored samples of one benchmark, read from TK_BASELINE.
+struct tk_baseline {
+    char name[64];
+    int reps;
+    double samples[TK_BENCH_MAX_REPS];
+};
+
+static struct tk_baseline baseline[TK_MAX_TESTS];
+static int nbaseline = -1; // -1: no baseline given
+
+// Read back the file written by write_bench_json(). This is not a JSON
+// parser; it only understands what write_bench_json() writes.
+static void load_baseline(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("- Cannot read benchmark baseline %s\n", path);
+        return;
+    }
+    size_t size = 0, cap = 4096;
+    char *text = malloc(cap);
+    for (size_t n; text && (n = fread(text + size, 1, cap - size - 1, fp)) > 0; ) {
+        size += n;
+        if (size + 1 == cap) {
+            text = realloc(text, cap *= 2);
+        }
+    }
+    fclose(fp);
+    if (!text) {
+        return;
+    }
+    text[size] = '\0';
+
+    nbaseline = 0;
+    for (char *p = text; nbaseline < TK_MAX_TESTS && (p = strstr(p, "\"name\": \"")); ) {
+        struct tk_baseline *b = &baseline[nbaseline];
+        p += strlen("\"name\": \"");
+        size_t len = strcspn(p, "\"");
+        snprintf(b->name, sizeof(b->name), "%.*s", (int)len, p);
+
+        char *end = strchr(p, '}');
+        char *q = strstr(p, "\"samples_ns\": [");
+        if (!q || (end && q > end)) {
+            continue;
+        }
+        q += strlen("\"samples_ns\": [");
+        for (b->reps = 0; b->reps < TK_BENCH_MAX_REPS && *q != ']'; b->reps++) {
+            char *next;
+            b->samples[b->reps] = strtod(q, &next);
+            if (next == q) {
+                break;
+            }
+            q = next + strspn(next, ", ");
+        }
+        p = q;
+        nbaseline++;
+    }
+    free(text);
+}
+
+static struct tk_baseline *find_baseline(const char *name) {
+    for (int i = 0; i < nbaseline; i++) {
+        if (strcmp(baseline[i].name, name) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+// We do not link with libm; these are precise enough for a p-value.
+static double tk_sqrt(double x) {
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++) {
+        r = (r + x / r) / 2;
+    }
+    return r;
+}
+
+static double tk_exp(double x) {
+    // exp(x) = exp(x / 2^k)^(2^k), with a Taylor series for small x.
+    int k = 0;
+    while (x > 0.5 || x < -0.5) {
+        x /= 2;
+        k++;
+    }
+    double sum = 1, term = 1;
+    for (int i = 1; i < 20; i++) {
+        term *= x / i;
+        sum += term;
+    }
+    while (k--) {
+        sum *= sum;
+    }
+    return sum;
+}
+
+// P(Z > z) for a standard normal Z (erfc approximation from Numerical
+// Recipes, relative error below 1.2e-7).
+static double normal_tail(double z) {
+    double x = (z < 0 ? -z : z) / 1.4142135623730951;
+    double t = 1 / (1 + x / 2);
+    double erfc = t * tk_exp(-x * x - 1.26551223 + t * (1.00002368 +
+        t * (0.37409196 + t * (0.09678418 + t * (-0.18628806 +
+        t * (0.27886807 + t * (-1.13520398 + t * (1.48851587 +
+        t * (-0.82215223 + t * 0.17087277)))))))));
+    return z >= 0 ? erfc / 2 : 1 - erfc / 2;
+}
+
+// One-sided Mann-Whitney U test: the p-value of "xs are no slower than
+// ys", with average ranks for ties and the normal approximation.
+static double mann_whitney_p(const double *xs, int nx, const double *ys, int ny) {
+    struct { double v; int x; } all[2 * TK_BENCH_MAX_REPS];
+    int n = 0;
+    for (int i = 0; i < nx; i++) all[n++] = (typeof(all[0])) { xs[i], 1 };
+    for (int i = 0; i < ny; i++) all[n++] = (typeof(all[0])) { ys[i], 0 };
+
+    // Insertion sort: at most 2 * TK_BENCH_MAX_REPS values.
+    for (int i = 1; i < n; i++) {
+        typeof(all[0]) cur = all[i];
+        int j = i;
+        for (; j > 0 && all[j - 1].v > cur.v; j--) {
+            all[j] = all[j - 1];
+        }
+        all[j] = cur;
+    }
+
+    double rank_x = 0, ties = 0;
+    for (int i = 0, j; i < n; i = j) {
+        int in_x = 0;
+        for (j = i; j < n && all[j].v == all[i].v; j++) {
+            in_x += all[j].x;
+        }
+        double t = j - i;
+        rank_x += in_x * (i + 1 + j) / 2.0;
+        ties += t * t * t - t;
+    }
+
+    double u = rank_x - nx * (nx + 1) / 2.0;
+    double mean = nx * ny / 2.0;
+    double var = nx * ny / 12.0 * ((n + 1) - ties / ((double)n * (n - 1)));
+    if (var <= 0) {
+        return 1;
+    }
+    return normal_tail((u - mean - 0.5) / tk_sqrt(var));
+}
+
+// Compare a benchmark against the baseline; returns whether it has
+// regressed significantly, by more than the threshold.
+static bool compare_baseline(struct tk_testcase *t, struct tk_bench_result *res,
+                             double threshold) {
+    struct tk_baseline *b = find_baseline(t->name);
+    if (!b || b->reps < 2) {
+        printf("  vs baseline: no samples for %s\n", t->name);
+        return false;
+    }
+
+    double sorted[TK_BENCH_MAX_REPS];
+    memcpy(sorted, b->samples, b->reps * sizeof(double));
+    double base = median_of(sorted, b->reps);
+    double change = base > 0 ? 100 * (res->median - base) / base : 0;
+    double p = mann_whitney_p(res->samples, res->reps, b->samples, b->reps);
+
+    bool regressed = p < TK_BENCH_ALPHA && change > threshold;
+    const char *verdict = "";
+    if (regressed) {
+        verdict = pcol("REGRESSION", 31);
+    } else if (p < TK_BENCH_ALPHA && change > 0) {
+        verdict = "slower, within threshold";
+    } else if (mann_whitney_p(b->samples, b->reps, res->samples, res->reps) < TK_BENCH_ALPHA) {
+        verdict = "faster";
+    }
+    printf("  vs baseline: %+.1f%% (%.2f ns/op, p=%.2g)%s%s\n",
+           change, base, p, verdict[0] ? " " : "", verdict);
+    return regressed;
+}
+
+static double parse_threshold(void) {
+    const char *s = getenv(TK_BASELINE_THRESHOLD);
+    return s ? atof(s) : TK_BENCH_THRESHOLD;
+}
+
+static int parse_jobs(void) {
+    const char *s = getenv(TK_JOBS);
+    int jobs = s ? atoi(s) : 1;
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    return jobs;
+}
+
+static int run_all_testcases(void) {
+    if (!tests[0].enabled) {
+        // Don't bother non-testing runs.
+        return 0;
+    }
+
+    // There are test cases only if there's TK_RUN or TK_VERBOSE.
+    bool verbose = getenv(TK_VERBOSE) != NULL;
+
+    // Creating subprocesses may cause multiple atexit flushes to the stdio
+    // buffers. Clean them immediately and set stdout to non-buffered mode.
+    fflush(stdout);
+    fflush(stderr);
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+    printf("\nTestKit\n");
+
+    static struct tk_run runs[TK_MAX_TESTS];
+    int ntests = 0;
+    while (ntests < TK_MAX_TESTS && tests[ntests].enabled) {
+        ntests++;
+    }
+
+    // Keep up to TK_JOBS test cases running; collect whichever finishes
+    // first, but report results in registration order.
+    int jobs = parse_jobs();
+    int passed = 0, started = 0, reported = 0, running = 0, regressed = 0;
+
+    const char *baseline_file = getenv(TK_BASELINE);
+    double threshold = parse_threshold();
+    if (baseline_file) {
+        load_baseline(baseline_file);
+    }
+
+    // Map all shared buffers first, so that zygotes (forked later) have
+    // them as well.
+    for (int i = 0; i < ntests; i++) {
+        map_testcase(&tests[i], &runs[i]);
+    }
+
+    while (reported < ntests) {
+        // Benchmarks run alone, so that nothing else competes for the CPU.
+        while (running < jobs && started < ntests &&
+               !(started > 0 && tests[started - 1].btest && !runs[started - 1].done) &&
+               !(tests[started].btest && running > 0)) {
+            if (start_testcase(&tests[started], &runs[started], runs)) {
+                running++;
+            }
+            started++;
+        }
+
+        while (running > 0) {
+            int status;
+            struct rusage usage;
+            pid_t pid = wait4(-1, &status, 0, &usage);
+            if (pid < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                running = 0;
+                break;
+            }
+
+            int i = 0;
+            while (i < started && (runs[i].done || runs[i].pid != pid)) {
+                i++;
+            }
+            if (i == started) {
+                continue; // Not one of ours, e.g., a zygote
+            }
+            runs[i].status = status;
+            runs[i].usage = usage;
+            runs[i].done = true;
+            collect_output(&runs[i]);
+            running--;
+
+            // Cleanup code is also ran in a separate process, as soon as
+            // its own test case completes.
+            run_cleanup(&tests[i]);
+            break;
+        }
+
+        for (; reported < started && runs[reported].done; reported++) {
+            struct tk_run *run = &runs[reported];
+            bool succ = check_results(&tests[reported], run);
+            if (!run->no_setup) {
+                print_usage(&run->usage);
+            }
+            if (run->truncated) {
+                printf("  output truncated at %d bytes (TK_OUTPUT_LIMIT)\n", TK_OUTPUT_LIMIT);
+            }
+            if (succ) {
+                passed++;
+                if (run->bench) {
+                    print_bench(run->bench);
+                    if (nbaseline >= 0) {
+                        regressed += compare_baseline(&tests[reported], run->bench, threshold);
+                    }
+                }
+                if (run->perf) {
+                    print_perf(run->perf, run->bench != NULL);
+                }
+            } else if (verbose) {
+                print_output(run);
+            }
+            if (run->out_len) {
+                munmap((void *)run->out, run->out_len);
+            }
+        }
+    }
+
+    stop_zygotes();
+
+    printf("- %d/%d test cases passed.\n", passed, ntests);
+    if (regressed) {
+        printf("- %d benchmark(s) regressed by more than %g%% against %s.\n",
+               regressed, threshold, baseline_file);
+    }
+
+    const char *bench_out = getenv(TK_BENCH_OUT);
+    if (bench_out) {
+        write_bench_json(bench_out, runs, ntests);
+    }
+    return regressed;
+}
+
+static int worker_pid;
+static int pipe_read, pipe_write;
+
+static void notify_worker() {
+    // Signal the worker process--we must send tests array because
+    // tests in the worker process may not be correctly initialized.
+
+    write(pipe_write, tests, sizeof(tests));
+    close(pipe_write);
+
+    // Wait for the worker to complete. Benchmark regressions make the
+    // whole program fail; we are in atexit, so exit() is not an option.
+    int status;
+    if (waitpid(worker_pid, &status, 0) == worker_pid &&
+        WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        fflush(NULL);
+        _exit(WEXITSTATUS(status));
+    }
+}
+
+static void worker_process() {
+    // tk_register_hook() creates a forked process to run this.
+    // Read the tests array from the pipe and run all test cases.
+
+    ssize_t bytes_read;
+
+    for (bytes_read = 0; bytes_read < sizeof(tests); ) {
+        ssize_t result = read(pipe_read,
+            (char *)tests + bytes_read,
+            sizeof(tests) - bytes_read
+        );
+        if (result <= 0) break; // Error or EOF
+        bytes_read += result;
+    }
+
+    close(pipe_read);
+
+    exit(run_all_testcases() ? 1 : 0);
+}
+
+__attribute__((constructor))
+void tk_register_hook(void) {
+    // This is tricky: we must not call run_all_testcases() at exit; otherwise
+    // the exit() in atexit causes undefined behavior).
+
+    // Create a pipe for synchronization
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return;
+    }
+    pipe_read = fds[0];
+    pipe_write = fds[1];
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process
+        close(pipe_write);
+        worker_process();
+    } else {
+        // Parent process
+        worker_pid = pid;
+        close(pipe_read);
+        atexit(notify_worker);
+    }
+}
@@ -14,6 +14,15 @@
  * - Set TK_RUN environment variable (regardless of its value), all test
  *   cases will automatically run after the (normal) program exits.
  * - Set TK_VERBOSE will print program outputs for failed test cases.
+ * - Set TK_JOBS=N to run up to N test cases at once. Results are still
+ *   printed in registration order; test cases that share files (e.g., a
+ *   common test.map) must not be run in parallel.
+ * - Set TK_BASELINE=file.json (a file written via TK_BENCH_OUT) to compare
+ *   benchmarks against it; the program exits with status 1 if any of them
+ *   is significantly slower by more than TK_BASELINE_THRESHOLD percent.
+ * - Set TK_PERF to count cycles, instructions, cache misses, branch misses
+ *   and page faults of each test case (and processes it forks) with
+ *   perf_event_open(2). Counters the kernel does not allow are left out.
  * 
  * Minimal Example (test.c):
  * 
@@ -33,21 +42,61 @@
 
 /** Maximum number of allowed test cases. */
 #define TK_MAX_TESTS       1024
-/** Time limit (in seconds) for each test case. */
+/** Default time limit (in seconds) for each test case; see .timeout_ms. */
 #define TK_TIME_LIMIT_SEC  1
-/** Output limit (bytes) for output capture in struct tk_result. */
-#define TK_OUTPUT_LIMIT    (1 << 20)
+/**
+ * Output limit (bytes) of a test case. Output beyond it is dropped, and
+ * the test case is reported (and result->truncated set) as truncated.
+ */
+#define TK_OUTPUT_LIMIT    (1 << 28)
+/**
+ * Address space allowed to a test case with .max_rss_mb: TK_AS_FACTOR
+ * times the limit plus TK_AS_SLACK_MB, on top of what it starts with.
+ */
+#define TK_AS_FACTOR       4
+#define TK_AS_SLACK_MB     (16 << 10)
+/** Chunk size (bytes) for .on_output. */
+#define TK_OUTPUT_CHUNK    (1 << 16)
 
 #define TK_MAX_ARGV_LEN    64
+/** Maximum number of distinct .setup_once functions. */
+#define TK_MAX_FIXTURES    16
+
+/** Target duration (in milliseconds) of one benchmark repetition. */
+#define TK_BENCH_TARGET_MS 10
+/** Default number of measured benchmark repetitions. */
+#define TK_BENCH_REPS      10
+/** Repetitions run and discarded before measuring. */
+#define TK_BENCH_WARMUP    2
+/** Maximum number of measured repetitions (.reps). */
+#define TK_BENCH_MAX_REPS  100
+/** Significance level for comparing samples against the baseline. */
+#define TK_BENCH_ALPHA     0.01
+/** Default slowdown (in percent) tolerated against the baseline. */
+#define TK_BENCH_THRESHOLD 5
 
 /** Environment variables for enabling TestKit. */
 #define TK_RUN     "TK_RUN"
 #define TK_VERBOSE "TK_VERBOSE"
+#define TK_JOBS    "TK_JOBS"
+/** Write benchmark results (JSON) to this file. */
+#define TK_BENCH_OUT "TK_BENCH_OUT"
+/** Compare benchmarks against results in this file. */
+#define TK_BASELINE "TK_BASELINE"
+#define TK_BASELINE_THRESHOLD "TK_BASELINE_THRESHOLD"
+/** Collect performance counters for every test case. */
+#define TK_PERF "TK_PERF"
 
 /** System test run result: exit status and combined stdout and stderr. */
 struct tk_result {
     int exit_status;
     const char *output;
+    bool truncated; // output reached TK_OUTPUT_LIMIT and was cut short
+};
+
+/** Benchmark context: the body must perform iters operations. */
+struct tk_bench {
+    long iters;
 };
 
 /**
@@ -62,6 +111,9 @@ struct tk_testcase {
     const char *loc; // the program location of this test case
     void (*init)(void); // pre-test setup function (optional)
     void (*fini)(void); // post-test cleanup function (optional)
+    void (*setup_once)(void); // shared fixture, run once per suite (optional)
+    int timeout_ms; // time limit (default TK_TIME_LIMIT_SEC seconds)
+    int max_rss_mb; // memory limit, in MiB (optional)
 
     // For unit tests:
     void (*utest)(void); // unit test body
@@ -71,6 +123,11 @@ struct tk_testcase {
     int argc;
     const char **argv;
     const char *argv_copy[TK_MAX_ARGV_LEN];
+    void (*on_output)(const char *chunk, size_t len); // streaming (optional)
+
+    // For benchmarks:
+    void (*btest)(struct tk_bench *); // timed body
+    int reps; // measured repetitions (default TK_BENCH_REPS)
 };
 
 /**
@@ -104,8 +161,8 @@ struct tk_testcase {
  * Parameters:
  * 
  * - name: Test case name.
- * - Variadic arguments: Additional named fields (such as .init, .fini)
- *   that customize the test case.
+ * - Variadic arguments: Additional named fields (such as .init, .fini,
+ *   .timeout_ms, .max_rss_mb) that customize the test case.
  * - Must be followed by the test case body.
  * 
  * Example:
@@ -120,6 +177,12 @@ struct tk_testcase {
  * - The test body function is automatically registered so that it runs
  *   as part of the test suite.
  * - The post-test cleanup function is called even if the test crashes.
+ * - A test case fails if it runs longer than .timeout_ms, or if its peak
+ *   RSS (which includes the pages shared with TestKit, a few MiB) exceeds
+ *   .max_rss_mb, even if it then crashed. The address space is capped
+ *   only far above the limit (TK_AS_FACTOR, TK_AS_SLACK_MB), so threads
+ *   can be created as usual. CPU time and peak RSS are reported for
+ *   every test.
 */
 #define UnitTest(name, ...) \
     __tk_testcase(name, void, utest, __VA_ARGS__)
@@ -151,12 +214,22 @@ struct tk_testcase {
  *
  * Notes:
  * 
- * - result->output **only capture default printf() and fprintf()
- *   results** for the test body; it does not get outputs to
- *   STDOUT_FILENO/STDERR_FILENO.
+ * - result->output is everything main() (and processes it forked) wrote
+ *   to STDOUT_FILENO and STDERR_FILENO, including raw write()s, up to
+ *   TK_OUTPUT_LIMIT bytes; result->truncated tells if there was more.
+ * - To check a very large output without keeping it, set .on_output to
+ *   a function that is called with each chunk (at most TK_OUTPUT_CHUNK
+ *   bytes, split anywhere) while main() runs; it may tk_assert(). Then
+ *   result->output is empty.
  * - Automatically computes argc based on the provided argv_ array.
  * - Simulates real command-line invocations of your program.
  * - The post-test cleanup function is called even if the test crashes.
+ * - Expensive initialization shared by tests (loading a model, building
+ *   a large input) can go to .setup_once. It runs once, in a "zygote"
+ *   process, and every test case with the same .setup_once is forked
+ *   from it, so main() sees whatever setup_once() left in memory. It must
+ *   not leave threads running; if it crashes, or runs longer than the
+ *   largest .timeout_ms of its test cases, they all fail.
  */
 #define SystemTest(name, argv_, ...) \
     __tk_testcase(name, \
@@ -165,6 +238,50 @@ struct tk_testcase {
         .argv = (const char **)argv_, \
         __VA_ARGS__)
 
+/**
+ * Declares a benchmark: a test case whose body is a timed loop.
+ * 
+ * Parameters:
+ * 
+ * - name: Test case name.
+ * - Variadic arguments: Additional named fields (.init, .fini, .reps).
+ * - Must be followed by the benchmark body, which performs bench->iters
+ *   operations.
+ * 
+ * Example:
+ * 
+ *   BenchTest(bench_strlen, .reps = 20) {
+ *     for (long i = 0; i < bench->iters; i++) {
+ *       TK_KEEP(strlen(text));
+ *     }
+ *   }
+ * 
+ * Notes:
+ * 
+ * - iters is calibrated so that one run of the body takes about
+ *   TK_BENCH_TARGET_MS; then TK_BENCH_WARMUP runs are discarded and
+ *   .reps runs are timed, in the test process pinned to one CPU.
+ * - The result line reports the median time per operation, its median
+ *   absolute deviation (MAD) and operations per second.
+ * - Benchmarks never run alongside other test cases, even with TK_JOBS.
+ * - Set TK_BENCH_OUT=file.json to record every sample for comparison.
+ * - With TK_PERF, counters cover only the timed repetitions and are
+ *   reported per operation.
+ * - Set TK_BASELINE=file.json to compare the samples against a recorded
+ *   run with a one-sided Mann-Whitney U test; a benchmark regresses if
+ *   it is slower with p < TK_BENCH_ALPHA and its median slowdown exceeds
+ *   the threshold.
+ */
+#define BenchTest(name, ...) \
+    __tk_testcase(name, struct tk_bench *bench, btest, __VA_ARGS__)
+
+/** Keeps the compiler from optimizing away the computation of x. */
+#define TK_KEEP(x) \
+    do { \
+        __typeof__(x) __tk_keep = (x); \
+        __asm__ volatile ("" : : "g"(&__tk_keep) : "memory"); \
+    } while (0)
+
 // ------------------------------------------------------------------------
 // Below are helpers.
 
@@ -201,7 +318,7 @@ struct tk_testcase {
  * - name_: The name token of the test case.
  * - body_arg: The argument signature for the test function (e.g., void for
  *   unit tests or struct tk_result * for system tests).
- * - test: Specifies whether this is a unit/system test (utest/stest).
+ * - test: Specifies the kind of test case (utest/stest/btest).
  * - Variadic arguments: Extra fields to initialize the tk_testcase
  *   structure: .init, .fini, .argc, .argv, etc..
  * 